@@ -18,6 +18,12 @@ LPCSTR MethodToString(METHOD m)
 		return "HEAD";
 	case METHOD_OPTIONS:
 		return "OPTIONS";
+	case METHOD_PATCH:
+		return "PATCH";
+	case METHOD_CONNECT:
+		return "CONNECT";
+	case METHOD_TRACE:
+		return "TRACE";
 	default: 
 		return nullptr;
 	}
@@ -113,4 +119,312 @@ LPCSTR ResponseCodeToString(RESPONSE_CODE r)
 	}
 }
 
+/*
+	PREFORMATTED STATUS LINES
+
+	Every status line for every protocol, worked out at compile
+	time. The reasons match ResponseCodeToString.
+*/
+#define HTTP_STATUS_CODES(X) \
+	X(100, "Continue") \
+	X(101, "Switching Protocols") \
+	X(102, "Processing") \
+	X(200, "OK") \
+	X(201, "Created") \
+	X(202, "Accepted") \
+	X(203, "Non-Authoritative Information") \
+	X(204, "No Content") \
+	X(205, "Reset Content") \
+	X(206, "Partial Content") \
+	X(301, "") \
+	X(302, "") \
+	X(303, "") \
+	X(304, "") \
+	X(400, "Bad Request") \
+	X(401, "Unauthorized") \
+	X(402, "Payment Required") \
+	X(403, "Forbidden") \
+	X(404, "Not Found") \
+	X(500, "Not Implemented") \
+	X(501, "Server Busy") \
+	X(502, "Gateway Time-Out")
+
+struct PREFORMATTED
+{
+	LPCSTR Text;
+	SIZE_T Length;
+};
+
+#define PREFORMATTED_ENTRY(s) { s, sizeof(s) - 1 }
+
+#define STATUS_LINE_INDEX(code, reason) STATUS_LINE_##code,
+enum STATUS_LINE_INDEX
+{
+	HTTP_STATUS_CODES(STATUS_LINE_INDEX)
+	STATUS_LINE_COUNT
+};
+#undef STATUS_LINE_INDEX
+
+#define STATUS_LINE_ENTRY(code, reason) \
+	{ \
+		PREFORMATTED_ENTRY("HTTP/1.0 " #code " " reason "\r\n"), \
+		PREFORMATTED_ENTRY("HTTP/1.1 " #code " " reason "\r\n") \
+	},
+
+// Indexed by STATUS_LINE_INDEX, then PROTOCOL
+const PREFORMATTED kStatusLines[STATUS_LINE_COUNT][2] =
+{
+	HTTP_STATUS_CODES(STATUS_LINE_ENTRY)
+};
+#undef STATUS_LINE_ENTRY
+
+#define STATUS_LINE_CASE(code, reason) case code: return STATUS_LINE_##code;
+INT StatusLineIndex(RESPONSE_CODE rc)
+{
+	switch (rc)
+	{
+	HTTP_STATUS_CODES(STATUS_LINE_CASE)
+	default:
+		return -1;
+	}
+}
+#undef STATUS_LINE_CASE
+
+LPCSTR StatusLine(PROTOCOL p, RESPONSE_CODE rc, SIZE_T* pLengthOut)
+{
+	INT index = StatusLineIndex(rc);
+	if (index < 0 || p < PROTOCOL_HTTP_1_0 || p > PROTOCOL_HTTP_1_1)
+	{
+		return nullptr;
+	}
+
+	if (pLengthOut)
+	{
+		*pLengthOut = kStatusLines[index][p].Length;
+	}
+
+	return kStatusLines[index][p].Text;
+}
+
+// In the same order as COMMON_HEADER
+const PREFORMATTED kCommonHeaders[COMMON_HEADER_COUNT] =
+{
+	PREFORMATTED_ENTRY("Connection: close\r\n"),
+	PREFORMATTED_ENTRY("Connection: keep-alive\r\n"),
+	PREFORMATTED_ENTRY("Connection: Upgrade\r\n"),
+	PREFORMATTED_ENTRY("Upgrade: websocket\r\n"),
+	PREFORMATTED_ENTRY("Transfer-Encoding: chunked\r\n"),
+	PREFORMATTED_ENTRY("Content-Type: text/html; charset=utf-8\r\n"),
+	PREFORMATTED_ENTRY("Content-Type: text/plain; charset=utf-8\r\n"),
+	PREFORMATTED_ENTRY("Content-Type: application/json\r\n"),
+	PREFORMATTED_ENTRY("Content-Type: application/octet-stream\r\n"),
+	PREFORMATTED_ENTRY("Cache-Control: no-cache\r\n"),
+};
+
+LPCSTR CommonHeaderBlock(COMMON_HEADER h, SIZE_T* pLengthOut)
+{
+	if (h < 0 || h >= COMMON_HEADER_COUNT)
+	{
+		return nullptr;
+	}
+
+	if (pLengthOut)
+	{
+		*pLengthOut = kCommonHeaders[h].Length;
+	}
+
+	return kCommonHeaders[h].Text;
+}
+
+#undef PREFORMATTED_ENTRY
+
+struct HEADER_NAME
+{
+	LPCSTR Name;
+	SIZE_T Length;
+};
+
+#define HEADER_NAME_ENTRY(s) { s, sizeof(s) - 1 }
+
+// In the same order as HEADER_ID
+const HEADER_NAME kHeaderNames[HEADER_ID_COUNT] =
+{
+	HEADER_NAME_ENTRY("Host"),
+	HEADER_NAME_ENTRY("Connection"),
+	HEADER_NAME_ENTRY("Keep-Alive"),
+	HEADER_NAME_ENTRY("Upgrade"),
+	HEADER_NAME_ENTRY("Content-Length"),
+	HEADER_NAME_ENTRY("Content-Type"),
+	HEADER_NAME_ENTRY("Transfer-Encoding"),
+	HEADER_NAME_ENTRY("Expect"),
+	HEADER_NAME_ENTRY("Accept"),
+	HEADER_NAME_ENTRY("Accept-Encoding"),
+	HEADER_NAME_ENTRY("Cookie"),
+	HEADER_NAME_ENTRY("User-Agent"),
+	HEADER_NAME_ENTRY("Origin"),
+	HEADER_NAME_ENTRY("Authorization"),
+	HEADER_NAME_ENTRY("Sec-WebSocket-Key"),
+	HEADER_NAME_ENTRY("Sec-WebSocket-Version"),
+	HEADER_NAME_ENTRY("Sec-WebSocket-Protocol"),
+	HEADER_NAME_ENTRY("Sec-WebSocket-Extensions"),
+};
+
+#undef HEADER_NAME_ENTRY
+
+LPCSTR HeaderIdToString(HEADER_ID h)
+{
+	if (h < 0 || h >= HEADER_ID_COUNT)
+	{
+		return nullptr;
+	}
+
+	return kHeaderNames[h].Name;
+}
+
+// ASCII-only; header names are tokens so locales don't come into it
+bool EqualsNoCase(LPCSTR A, LPCSTR B, SIZE_T Length)
+{
+	for (SIZE_T i = 0; i < Length; ++i)
+	{
+		BYTE a = (BYTE) A[i];
+		BYTE b = (BYTE) B[i];
+
+		if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+		if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+
+		if (a != b)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+HEADER_ID HeaderIdFromString(LPCSTR Name, SIZE_T Length)
+{
+	if (!Length)
+	{
+		return HEADER_UNKNOWN;
+	}
+
+	//
+	// The length and first letter leave at most one candidate,
+	// which is then compared in full. Non-letters come out of the
+	// lowercasing as something else, but that comparison catches
+	// them.
+	//
+	CHAR first = (CHAR) (Name[0] | 0x20);
+	HEADER_ID id = HEADER_UNKNOWN;
+
+	switch (Length)
+	{
+	case 4:
+		id = HEADER_HOST;
+		break;
+	case 6:
+		id = first == 'e' ? HEADER_EXPECT
+			: first == 'a' ? HEADER_ACCEPT
+			: first == 'c' ? HEADER_COOKIE
+			: HEADER_ORIGIN;
+		break;
+	case 7:
+		id = HEADER_UPGRADE;
+		break;
+	case 10:
+		id = first == 'c' ? HEADER_CONNECTION
+			: first == 'k' ? HEADER_KEEP_ALIVE
+			: HEADER_USER_AGENT;
+		break;
+	case 12:
+		id = HEADER_CONTENT_TYPE;
+		break;
+	case 13:
+		id = HEADER_AUTHORIZATION;
+		break;
+	case 14:
+		id = HEADER_CONTENT_LENGTH;
+		break;
+	case 15:
+		id = HEADER_ACCEPT_ENCODING;
+		break;
+	case 17:
+		id = first == 't' ? HEADER_TRANSFER_ENCODING : HEADER_SEC_WEBSOCKET_KEY;
+		break;
+	case 21:
+		id = HEADER_SEC_WEBSOCKET_VERSION;
+		break;
+	case 22:
+		id = HEADER_SEC_WEBSOCKET_PROTOCOL;
+		break;
+	case 24:
+		id = HEADER_SEC_WEBSOCKET_EXTENSIONS;
+		break;
+	}
+
+	if (id != HEADER_UNKNOWN &&
+		EqualsNoCase(kHeaderNames[id].Name, Name, Length))
+	{
+		return id;
+	}
+
+	return HEADER_UNKNOWN;
+}
+
+String StringView::ToString() const
+{
+	return String(Data, Length);
+}
+
+bool StringView::operator==(LPCSTR Other) const
+{
+	return strlen(Other) == Length && memcmp(Data, Other, Length) == 0;
+}
+
+bool StringView::operator!=(LPCSTR Other) const
+{
+	return !(*this == Other);
+}
+
+bool StringView::EqualsNoCase(LPCSTR Other) const
+{
+	return strlen(Other) == Length && HTTP::EqualsNoCase(Data, Other, Length);
+}
+
+bool StringView::ContainsToken(LPCSTR Token) const
+{
+	SIZE_T tokenLength = strlen(Token);
+	SIZE_T i = 0;
+
+	while (i < Length)
+	{
+		// Skip separators and whitespace
+		while (i < Length && (Data[i] == ',' || Data[i] == ' ' || Data[i] == '\t'))
+		{
+			i++;
+		}
+
+		SIZE_T begin = i;
+		while (i < Length && Data[i] != ',')
+		{
+			i++;
+		}
+
+		// Trim trailing whitespace
+		SIZE_T end = i;
+		while (end > begin && (Data[end - 1] == ' ' || Data[end - 1] == '\t'))
+		{
+			end--;
+		}
+
+		if (end - begin == tokenLength &&
+			HTTP::EqualsNoCase(Data + begin, Token, tokenLength))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
 }
@@ -2,15 +2,72 @@
 
 #include <string>
 #include <map>
+#include <deque>
+#include <vector>
+#include <memory>
 #include <functional>
 
+#if defined(__cpp_impl_coroutine)
+#	include <coroutine>
+#endif
+
 #ifdef _WIN32
 #	include <SDKDDKVer.h>
 #	include <Windows.h>
 #else
-#	error Good luck.
+#	include <stddef.h>
+#	include <stdint.h>
+#	include <string.h>
+
+//
+// Elsewhere, the few Windows types and macros the library uses.
+// The SAL annotations are only checked by MSVC's analyser, so
+// they're defined away.
+//
+typedef char CHAR;
+typedef int INT;
+typedef unsigned int UINT;
+typedef UINT* LPUINT;
+typedef unsigned char BYTE;
+typedef BYTE* LPBYTE;
+typedef const BYTE* LPCBYTE;
+typedef unsigned short USHORT;
+typedef uint32_t DWORD;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef size_t SIZE_T;
+typedef intptr_t INT_PTR;
+typedef uintptr_t UINT_PTR;
+typedef char* LPSTR;
+typedef const char* LPCSTR;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+
+#	define ZeroMemory(p, n) memset((p), 0, (n))
+
+#	if !defined(_In_)
+#		define _In_
+#		define _In_opt_
+#		define _In_z_
+#		define _In_opt_z_
+#		define _In_reads_(x)
+#		define _In_reads_bytes_(x)
+#		define _In_reads_bytes_opt_(x)
+#		define _Inout_
+#		define _Inout_updates_(x)
+#		define _Out_
+#		define _Out_opt_
+#		define _Out_writes_(x)
+#		define _Out_writes_to_(x, y)
+#		define _Out_writes_bytes_to_(x, y)
+#	endif
 #endif
 
+// zlib's stream, for permessage-deflate; see WebsocketDeflate
+struct z_stream_s;
+
 namespace HTTP
 {
 
@@ -21,7 +78,10 @@ enum METHOD
 	METHOD_POST,
 	METHOD_DELETE,
 	METHOD_HEAD,
-	METHOD_OPTIONS
+	METHOD_OPTIONS,
+	METHOD_PATCH,
+	METHOD_CONNECT,
+	METHOD_TRACE
 };
 
 enum PROTOCOL
@@ -30,6 +90,36 @@ enum PROTOCOL
 	PROTOCOL_HTTP_1_1
 };
 
+//
+// Request headers that get their own slot in RequestHeader, so
+// looking them up doesn't involve a search. Names are matched
+// case-insensitively.
+//
+enum HEADER_ID
+{
+	HEADER_HOST,
+	HEADER_CONNECTION,
+	HEADER_KEEP_ALIVE,
+	HEADER_UPGRADE,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_EXPECT,
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_COOKIE,
+	HEADER_USER_AGENT,
+	HEADER_ORIGIN,
+	HEADER_AUTHORIZATION,				// Decoded into AuthUser/AuthPassword; never stored
+	HEADER_SEC_WEBSOCKET_KEY,
+	HEADER_SEC_WEBSOCKET_VERSION,
+	HEADER_SEC_WEBSOCKET_PROTOCOL,
+	HEADER_SEC_WEBSOCKET_EXTENSIONS,
+
+	HEADER_ID_COUNT,
+	HEADER_UNKNOWN = HEADER_ID_COUNT
+};
+
 enum AUTH_MODE
 {
 	AUTH_NONE,
@@ -79,6 +169,15 @@ enum REQUEST_PARSE_RESULT
 	REQUEST_PARSE_UNKNOWN_PROTOCOL,		// Expected HTTP/1.1
 	REQUEST_PARSE_MALFORMED_AUTH,		// Authorization data was corrupt
 	REQUEST_PARSE_MALFORMED_CONTENT,	// Content attached to the header was corrupt
+	REQUEST_PARSE_TOO_LARGE,			// The header exceeded the parser's size limit
+	REQUEST_PARSE_INCOMPLETE,			// The data ended before the header did
+};
+
+enum REQUEST_FEED_RESULT
+{
+	REQUEST_FEED_NEED_MORE,				// Header isn't complete yet; feed more bytes
+	REQUEST_FEED_DONE,					// Header is complete; see RequestParser::Request
+	REQUEST_FEED_ERROR					// Header is invalid; see RequestParser::Error
 };
 
 enum RESPONSE_HEADER_RESULT
@@ -87,7 +186,29 @@ enum RESPONSE_HEADER_RESULT
 	RESPONSE_HEADER_NEED_REDIRECT_URI,
 	RESPONSE_HEADER_NEED_AUTH_MODE,
 	RESPONSE_HEADER_NEED_AUTH_REALM,
-	RESPONSE_HEADER_NEED_CONTENT_MIME
+	RESPONSE_HEADER_NEED_CONTENT_MIME,
+	RESPONSE_HEADER_NEED_HTTP_1_1,			// Chunked responses don't exist in HTTP/1.0
+	RESPONSE_HEADER_BUFFER_TOO_SMALL
+};
+
+//
+// Header lines that responses send often enough to be worth 
+// keeping preformatted. See CommonHeaderBlock.
+//
+enum COMMON_HEADER
+{
+	COMMON_HEADER_CONNECTION_CLOSE,					// Connection: close
+	COMMON_HEADER_CONNECTION_KEEP_ALIVE,			// Connection: keep-alive
+	COMMON_HEADER_CONNECTION_UPGRADE,				// Connection: Upgrade
+	COMMON_HEADER_UPGRADE_WEBSOCKET,				// Upgrade: websocket
+	COMMON_HEADER_TRANSFER_ENCODING_CHUNKED,		// Transfer-Encoding: chunked
+	COMMON_HEADER_CONTENT_TYPE_HTML_UTF8,			// Content-Type: text/html; charset=utf-8
+	COMMON_HEADER_CONTENT_TYPE_TEXT_UTF8,			// Content-Type: text/plain; charset=utf-8
+	COMMON_HEADER_CONTENT_TYPE_JSON,				// Content-Type: application/json
+	COMMON_HEADER_CONTENT_TYPE_OCTET_STREAM,		// Content-Type: application/octet-stream
+	COMMON_HEADER_CACHE_CONTROL_NO_CACHE,			// Cache-Control: no-cache
+
+	COMMON_HEADER_COUNT
 };
 
 enum SAFE_URI_ENCODE
@@ -105,6 +226,29 @@ LPCSTR MethodToString(_In_ METHOD m);
 LPCSTR ProtocolToString(_In_ PROTOCOL p);
 LPCSTR AuthModeToString(_In_ AUTH_MODE a);
 LPCSTR ResponseCodeToString(_In_ RESPONSE_CODE rc);
+LPCSTR HeaderIdToString(_In_ HEADER_ID h);
+
+// Returns HEADER_UNKNOWN if the name isn't one of the above.
+HEADER_ID HeaderIdFromString(
+	_In_reads_(Length) LPCSTR Name,
+	_In_ SIZE_T Length);
+
+//
+// Preformatted bytes, ready to be copied straight into a response.
+// These aren't NUL-terminated in spirit; use *pLengthOut.
+//
+// StatusLine:          e.g. "HTTP/1.1 200 OK\r\n". Returns nullptr
+//                      for codes that aren't in RESPONSE_CODE.
+// CommonHeaderBlock:   e.g. "Connection: keep-alive\r\n".
+//
+LPCSTR StatusLine(
+	_In_ PROTOCOL p, 
+	_In_ RESPONSE_CODE rc,
+	_Out_opt_ SIZE_T* pLengthOut);
+
+LPCSTR CommonHeaderBlock(
+	_In_ COMMON_HEADER h,
+	_Out_opt_ SIZE_T* pLengthOut);
 
 
 typedef std::string String;
@@ -112,6 +256,28 @@ typedef const std::string& StringRef;
 typedef std::map<std::string, std::string> StringTable;
 typedef const StringTable& StringTableRef;
 
+//
+// A non-owning reference to a run of characters, e.g. a header
+// value sitting in a receive buffer. It isn't NUL-terminated.
+//
+struct StringView
+{
+	LPCSTR Data;
+	SIZE_T Length;
+
+	String ToString() const;
+
+	bool operator==(_In_z_ LPCSTR Other) const;
+	bool operator!=(_In_z_ LPCSTR Other) const;
+
+	// ASCII case-insensitive, for header names and tokens
+	bool EqualsNoCase(_In_z_ LPCSTR Other) const;
+
+	// For comma-separated header values like "keep-alive, Upgrade".
+	// Case-insensitive.
+	bool ContainsToken(_In_z_ LPCSTR Token) const;
+};
+
 //
 // When we receive data from browsers, they come prefixed
 // with a header. Pass your data to RequestHeader.Parse
@@ -158,6 +324,50 @@ public:
 	// e.g. Header()["User-Agent"]
 	StringTableRef Header() const;
 
+	//
+	// Zero-copy access to the same information. The views point
+	// into the parsed header and stay valid for as long as this
+	// RequestHeader does (or until the next Parse).
+	//
+	// ResourceURI() and Header() build std::strings the first time
+	// they're called; these never allocate. Because of that, those
+	// two aren't safe to call from two threads at once, while the
+	// views are.
+	//
+	StringView ResourceURIView() const;
+
+	SIZE_T HeaderCount() const;
+	StringView HeaderKey(_In_ SIZE_T Index) const;
+	StringView HeaderValue(_In_ SIZE_T Index) const;
+
+	// Returns false if the key isn't present. Keys are matched
+	// case-insensitively. If a key is repeated, the last one wins.
+	bool FindHeader(
+		_In_z_ LPCSTR Key,
+		_Out_opt_ StringView* pValueOut) const;
+
+	// Same as above, but doesn't search.
+	bool FindHeader(
+		_In_ HEADER_ID Id,
+		_Out_opt_ StringView* pValueOut) const;
+
+	// Whether the client wants the connection kept open after
+	// this request. HTTP/1.1 connections persist unless the
+	// client sends "Connection: close"; HTTP/1.0 ones only if
+	// it sends "Connection: keep-alive".
+	bool KeepAlive() const;
+
+	// Returns false if there's no Content-Length or it isn't a
+	// valid number. Parsing fails with MALFORMED_CONTENT if it's
+	// repeated with a different value.
+	bool ContentLength(
+		_Out_ ULONGLONG* pLengthOut) const;
+
+	// Whether "chunked" is the last coding in Transfer-Encoding,
+	// which is the only way the body's end can be found. A
+	// Transfer-Encoding without it is malformed (RFC 7230 3.3.3).
+	bool Chunked() const;
+
 	//
 	// Parses a header stream received from a browser.
 	//
@@ -168,11 +378,123 @@ public:
 		_In_ const char* pRequestData,
 		_Out_opt_ SIZE_T* pPostDataOffsetOut);
 
+	//
+	// Like Parse, but nothing is copied: the views above point
+	// straight into Buffer, and this header holds a reference to
+	// Buffer to keep it alive. Buffer doesn't need to be 
+	// NUL-terminated.
+	//
+	// Returns REQUEST_PARSE_INCOMPLETE if BufferSize bytes don't
+	// contain the whole header.
+	//
+	REQUEST_PARSE_RESULT ParseInPlace(
+		_In_ std::shared_ptr<const char> Buffer,
+		_In_ SIZE_T BufferSize,
+		_Out_opt_ SIZE_T* pPostDataOffsetOut);
+
 private:
 
+	friend class RequestParser;
+
 	struct REQUEST_DATA* m_pData;
 };
 
+//
+// Incremental version of RequestHeader::Parse for data that
+// arrives in pieces, e.g. straight from recv(). Each call to
+// Feed only looks at the new bytes, so a header that trickles
+// in over many reads is still only scanned once.
+//
+// Feed returns:
+//
+// NEED_MORE:   All of the bytes were consumed. Call Feed
+//              again once more data arrives.
+//
+// DONE:        The header is complete. *pConsumedOut is the
+//              number of bytes up to and including the blank
+//              line; anything after that is post data (or the
+//              next request) and hasn't been touched.
+//
+// ERROR:       The header is malformed or exceeded 
+//              MaxHeaderSize. Error() says why.
+//
+// Call Reset before parsing the next request.
+//
+class RequestParser
+{
+public:
+
+	RequestParser();
+
+	void Reset();
+
+	REQUEST_FEED_RESULT Feed(
+		_In_reads_(DataLength) const char* pData,
+		_In_ SIZE_T DataLength,
+		_Out_ SIZE_T* pConsumedOut);
+
+	REQUEST_PARSE_RESULT Error() const;
+
+	// Only valid once Feed has returned DONE.
+	const RequestHeader& Request() const;
+
+	SIZE_T MaxHeaderSize;	// Headers larger than this are rejected
+
+private:
+
+	REQUEST_FEED_RESULT ParseLine(
+		_In_reads_(end - begin) const char* begin,
+		_In_ const char* end);
+
+	RequestHeader m_Request;
+	String m_Buffer;		// The header bytes consumed so far
+	SIZE_T m_LineOffset;	// Where the current line begins in m_Buffer
+	bool m_HaveRequestLine;
+	REQUEST_FEED_RESULT m_State;
+	REQUEST_PARSE_RESULT m_Error;
+};
+
+//
+// A response gathered as a list of pieces instead of one buffer, 
+// for writev / sendmsg / WSASend. Nothing is concatenated: 
+//  - the status line and common header blocks point at the 
+//    static tables (see StatusLine, CommonHeaderBlock),
+//  - the per-request values and the Date are written into Scratch,
+//  - the body points at the caller's buffer.
+//
+// The body (or file) must stay alive until the response is sent,
+// and the RESPONSE_GATHER mustn't be moved or copied in the 
+// meantime, as segments point into Scratch. Reusing the same one
+// for each response means Scratch stops allocating.
+//
+#define RESPONSE_MAX_SEGMENTS	16
+
+// Same layout as POSIX struct iovec, so it can be passed straight
+// to writev.
+struct RESPONSE_SEGMENT
+{
+	LPCVOID Data;
+	SIZE_T Length;
+};
+
+// A body that's sent from a file (sendfile / TransmitFile) after
+// the segments.
+struct RESPONSE_FILE
+{
+	INT_PTR Descriptor;		// File descriptor or HANDLE. -1 for none.
+	ULONGLONG Offset;
+	ULONGLONG Length;
+};
+
+struct RESPONSE_GATHER
+{
+	RESPONSE_SEGMENT Segments[RESPONSE_MAX_SEGMENTS];
+	SIZE_T SegmentCount;
+	SIZE_T TotalLength;		// Of the segments, not including File
+	RESPONSE_FILE File;
+	String Scratch;
+};
+
 //
 // This is used to build a stream for sending back data
 // to the browser.
@@ -188,10 +510,45 @@ public:
 		_In_z_ StringRef Key,
 		_In_z_ StringRef Value);
 
+	// Adds one of the preformatted header lines. These are copied
+	// in as they are, so they're cheaper than AddKey. Each replaces
+	// any earlier line for the same header, whichever way it was 
+	// added, and AddKey replaces these in turn (and Content-Length).
+	ResponseHeaderBuilder&
+	AddCommonHeader(
+		_In_ COMMON_HEADER Header);
+
+	// Output's existing capacity is reused, so building into the
+	// same String each time doesn't allocate once it's big enough.
 	RESPONSE_HEADER_RESULT 
 	Build(
 		_Out_ String& Output) const;
 
+	// Builds into a fixed buffer instead. If it doesn't fit, this 
+	// returns RESPONSE_HEADER_BUFFER_TOO_SMALL and *pLengthOut is
+	// the size that's needed.
+	RESPONSE_HEADER_RESULT 
+	Build(
+		_Out_writes_to_(BufferSize, *pLengthOut) LPSTR pBuffer,
+		_In_ SIZE_T BufferSize,
+		_Out_ SIZE_T* pLengthOut) const;
+
+	//
+	// Builds the header as segments, followed by the body. Set the
+	// Content-Length first (e.g. with AddBinaryHeaders).
+	//
+	RESPONSE_HEADER_RESULT
+	Build(
+		_Out_ RESPONSE_GATHER& Output,
+		_In_reads_bytes_opt_(BodyLength) LPCVOID pBody,
+		_In_ SIZE_T BodyLength) const;
+
+	// As above, but the body is sent from a file.
+	RESPONSE_HEADER_RESULT
+	Build(
+		_Out_ RESPONSE_GATHER& Output,
+		_In_ const RESPONSE_FILE& File) const;
+
 	//
 	// Tools for constructing default web responses
 	//
@@ -206,23 +563,225 @@ public:
 		_In_z_ LPCSTR MimeType,
 		_In_z_ LPCSTR Encoding);
 
+	//
+	// For responses whose length isn't known up front. Send the
+	// body with ChunkedResponseWriter. If you're going to send
+	// trailers, list their names with AddKey("Trailer", ...).
+	//
+	RESPONSE_HEADER_RESULT 
+	AddChunkedHeaders(
+		_In_z_ LPCSTR MimeType);
+
+	// The Content-Length to be sent, however it was set. Returns
+	// false if there isn't one, or it isn't a number.
+	bool ContentLength(
+		_Out_ ULONGLONG* pLengthOut) const;
+
+	// Sends the current date (see DateHeader).
+	ResponseHeaderBuilder&
+	AddDateHeader();
+
+	//
+	// Sets Protocol and KeepAlive to suit the request, so the
+	// connection stays open if (and only if) the client asked
+	// for that.
+	//
+	void NegotiateConnection(
+		_In_ const RequestHeader& Request);
+
 	PROTOCOL Protocol;		// The HTTP protocol to use
 	RESPONSE_CODE Code;		// The response code
 	METHOD Method;			// For RESPONSE_METHOD only.
 	String RedirectURI;		// Must specify redirect code to use this
 	AUTH_MODE AuthMode;		// Set to non-None to request credentials
 	String AuthRealm;		// Description of the authorization realm
+	bool KeepAlive;			// Send "Connection: keep-alive" rather than "close"
+	UINT KeepAliveTimeout;	// If non-zero, advertised in a Keep-Alive header
+	UINT KeepAliveMax;		// If non-zero, advertised in a Keep-Alive header
 
 private:
 
+	RESPONSE_HEADER_RESULT Validate() const;
+	void Write(struct HEADER_WRITER& Writer) const;
+	void AddConnectionHeaders();
+	void SetContentType(_In_z_ LPCSTR MimeType, _In_opt_z_ LPCSTR Encoding);
+
 	StringTable m_ExtraLines;
+	UINT32 m_CommonHeaders;		// Bit per COMMON_HEADER
+	bool m_SendDate;
+	ULONGLONG m_ContentLength;
+	bool m_HasContentLength;
+};
+
+//
+// Browsers using HTTP/1.1 can send several requests back to back
+// without waiting for the responses. ParseRequestBatch parses as
+// many of them as it can out of one receive buffer, without
+// copying (see RequestHeader::ParseInPlace).
+//
+// It stops at the first request that:
+//  - isn't complete yet, header or body (it isn't returned),
+//  - is malformed (it's returned with Result set),
+//  - has a chunked body, as the end of that isn't known until
+//    it's decoded (it's returned with Chunked set; see
+//    ChunkedDecoder),
+//  - asks for the connection to be closed (it's returned).
+//
+// Returns the number of entries filled in. *pConsumedOut is the 
+// number of bytes taken up by complete requests and their bodies,
+// which can be discarded once they've been handled.
+//
+struct REQUEST_BATCH_ENTRY
+{
+	REQUEST_PARSE_RESULT Result;
+	SIZE_T Offset;			// Where the request starts in the buffer
+	SIZE_T BodyOffset;		// Where its post data starts
+	ULONGLONG BodyLength;	// From Content-Length. 0 if chunked.
+	bool Chunked;			// The body uses Transfer-Encoding: chunked
 };
 
+SIZE_T
+ParseRequestBatch(
+	_In_ std::shared_ptr<const char> Buffer,
+	_In_ SIZE_T BufferSize,
+	_Out_writes_to_(MaxRequests, return) RequestHeader* pRequests,
+	_Out_writes_to_(MaxRequests, return) REQUEST_BATCH_ENTRY* pEntries,
+	_In_ SIZE_T MaxRequests,
+	_Out_ SIZE_T* pConsumedOut);
+
+//
+// Decodes a body sent with "Transfer-Encoding: chunked" as it 
+// arrives, without buffering it. Feed it whatever has been
+// received, starting at the post data offset:
+//
+// CHUNKED_DATA:        *pSliceOut is the next piece of the body.
+//                      It points into pData, so nothing's copied.
+//                      Call Decode again with the rest of pData.
+//
+// CHUNKED_NEED_MORE:   Everything was consumed; call Decode again
+//                      once more data arrives.
 //
-// Utility to generate timestamps
+// CHUNKED_DONE:        The last chunk (and any trailers, which are
+//                      skipped) has been read. Bytes after the 
+//                      consumed ones belong to the next request.
+//
+// CHUNKED_ERROR:       The framing is malformed, or one of the
+//                      limits below was hit.
+//
+enum CHUNKED_RESULT
+{
+	CHUNKED_NEED_MORE,
+	CHUNKED_DATA,
+	CHUNKED_DONE,
+	CHUNKED_ERROR
+};
+
+class ChunkedDecoder
+{
+public:
+
+	ChunkedDecoder();
+
+	void Reset();
+
+	CHUNKED_RESULT Decode(
+		_In_reads_(DataLength) const char* pData,
+		_In_ SIZE_T DataLength,
+		_Out_ SIZE_T* pConsumedOut,
+		_Out_ StringView* pSliceOut);
+
+	// How much of the body has been decoded so far
+	ULONGLONG BodySize() const;
+
+	ULONGLONG MaxChunkSize;		// Largest chunk that will be accepted
+	ULONGLONG MaxBodySize;		// Largest total body that will be accepted
+	SIZE_T MaxOverheadSize;		// Limit on each chunk extension, and on the trailers
+
+private:
+
+	INT m_State;
+	ULONGLONG m_ChunkRemaining;
+	ULONGLONG m_BodySize;
+	SIZE_T m_Digits;
+	SIZE_T m_Overhead;
+};
+
+//
+// Chunked responses. Each piece of the body is sent as a chunk
+// header (the size in hex and a CRLF), the data, then a CRLF.
+//
+// SetChunkHeader fills in the header for a chunk of the given
+// size, much like SetWebsocketFrame. kChunkTerminator is the CRLF
+// that follows the data.
+//
+struct CHUNK_HEADER
+{
+	BYTE Length;
+	CHAR Data[18];			// 16 hex digits and a CRLF
+};
+
+extern const CHAR kChunkTerminator[3];
+
+void
+SetChunkHeader(
+	_In_ ULONGLONG ChunkSize,
+	_Out_ CHUNK_HEADER* pChunkHeader);
+
+//
+// Or let ChunkedResponseWriter do the framing. It never copies 
+// the body: each piece goes to SendFunc as it is. SendFunc should
+// return false if the connection has failed, and every call after
+// that will fail too.
+//
+typedef std::function<bool (LPCVOID, SIZE_T)> SendFunc;
+
+class ChunkedResponseWriter
+{
+public:
+
+	ChunkedResponseWriter(
+		_In_ SendFunc Send);
+
+	// Sends the header, e.g. from ResponseHeaderBuilder::Build
+	// after AddChunkedHeaders.
+	bool Begin(
+		_In_ StringRef Header);
+
+	// Sends one chunk. Empty writes are ignored, since an empty
+	// chunk marks the end of the body.
+	bool Write(
+		_In_reads_(DataLength) LPCVOID pData,
+		_In_ SIZE_T DataLength);
+
+	// Ends the body, optionally with trailers.
+	bool Finish();
+
+	bool Finish(
+		_In_ StringTableRef Trailers);
+
+private:
+
+	bool Send(LPCVOID pData, SIZE_T DataLength);
+
+	SendFunc m_Send;
+	bool m_Failed;
+};
+
+//
+// Utility to generate timestamps, in the IMF-fixdate format HTTP
+// uses (e.g. "Sun, 06 Nov 1994 08:49:37 GMT").
 //
 String TimeStampString();
 
+//
+// The current "Date: ...\r\n" header line, ready to send. It's 
+// only formatted once a second and shared between threads, so 
+// this is cheap enough to call for every response. The text stays 
+// valid for at least a minute, long enough to send it.
+//
+LPCSTR DateHeader(
+	_Out_opt_ SIZE_T* pLengthOut);
+
 //
 // Utility function for splitting HTTP-style parameter
 // lists into key-value pairs.
@@ -325,7 +884,50 @@ public:
 
 // 
 // Base64 decoding/encoding
+//
+// Encoding always pads. Decoding is strict: the input must be
+// padded, contain nothing outside the alphabet (no whitespace),
+// and leave no stray bits in the last character.
+//
+// The buffer versions write exactly Base64EncodedSize or 
+// Base64DecodedSize bytes, without a terminating NUL. If the 
+// buffer's too small, *pLengthOut is the size that's needed.
+//
+// The String versions return an empty string for malformed input.
 // 
+enum BASE64_RESULT
+{
+	BASE64_OK,
+	BASE64_BUFFER_TOO_SMALL,
+	BASE64_MALFORMED,
+};
+
+SIZE_T
+Base64EncodedSize(
+	_In_ SIZE_T DataSize);
+
+// Exact for well formed input
+SIZE_T
+Base64DecodedSize(
+	_In_reads_(EncodedSize) LPCSTR pEncoded,
+	_In_ SIZE_T EncodedSize);
+
+BASE64_RESULT
+Base64Encode(
+	_In_reads_bytes_(DataSize) LPCVOID pData,
+	_In_ SIZE_T DataSize,
+	_Out_writes_to_(BufferSize, *pLengthOut) LPSTR pBuffer,
+	_In_ SIZE_T BufferSize,
+	_Out_ SIZE_T* pLengthOut);
+
+BASE64_RESULT
+Base64Decode(
+	_In_reads_(EncodedSize) LPCSTR pEncoded,
+	_In_ SIZE_T EncodedSize,
+	_Out_writes_bytes_to_(BufferSize, *pLengthOut) LPVOID pBuffer,
+	_In_ SIZE_T BufferSize,
+	_Out_ SIZE_T* pLengthOut);
+
 String
 Base64Encode(
 	_In_reads_(DataSize) LPCVOID pData,
@@ -368,6 +970,24 @@ BuildWebsocketRequestResponse(
 	_In_ HashFunc HashFunction,
 	_Out_ ResponseHeaderBuilder* responseBuilder);
 
+// As above, using the library's own SHA-1.
+WS_RESPONSE_RESULT
+BuildWebsocketRequestResponse(
+	_In_ const HTTP::RequestHeader& request,
+	_Out_ ResponseHeaderBuilder* responseBuilder);
+
+//
+// Works out the Sec-WebSocket-Accept value for a client's
+// Sec-WebSocket-Key, without allocating. pOut isn't NUL-terminated.
+//
+#define WS_ACCEPT_KEY_LENGTH	28
+
+void
+ComputeWebsocketAcceptKey(
+	_In_reads_(KeyLength) LPCSTR pKey,
+	_In_ SIZE_T KeyLength,
+	_Out_writes_(WS_ACCEPT_KEY_LENGTH) LPSTR pOut);
+
 enum WS_FRAME_RESULT
 {
 	WS_FRAME_OK,
@@ -375,7 +995,10 @@ enum WS_FRAME_RESULT
 
 	// If you get this, it means you specified/received an OpCode
 	// without FinalPacket set.
-	WS_FRAME_FRAGMENTED_OPCODE
+	WS_FRAME_FRAGMENTED_OPCODE,
+
+	// The frame header isn't all there yet.
+	WS_FRAME_NEED_MORE
 };
 
 enum WS_FRAME_OPCODE
@@ -424,6 +1047,12 @@ struct WS_PACKED_FRAME_HEADER
 	BYTE Data[15];
 };
 
+//
+// Parses the frame header at pData. It never reads past DataLength,
+// and returns WS_FRAME_NEED_MORE if the header goes beyond it. The
+// payload at *pFramePayload may not all have arrived yet; check it
+// against PayloadLength.
+//
 WS_FRAME_RESULT 
 ParseWebsocketFrame(
 	_In_reads_(DataLength) LPCVOID pData,
@@ -431,6 +1060,74 @@ ParseWebsocketFrame(
 	_Out_ WS_FRAME_INFO* pFrameInfo,
 	_Out_ LPCVOID* pFramePayload);
 
+//
+// Decodes frames as they arrive, however the stream is split, so
+// they can be handled straight out of the receive buffer. Feed it
+// whatever has been received and it returns one event at a time:
+//
+// WS_DECODE_HEADER:    A frame's header is complete; see Frame().
+// WS_DECODE_DATA:      *pPayloadOut is the next piece of the frame's
+//                      payload. It points into pData and has been
+//                      unmasked in place (unless Unmask is false).
+// WS_DECODE_FRAME_END: The frame's payload is complete. This comes
+//                      even for empty payloads.
+// WS_DECODE_NEED_MORE: All of pData has been used up.
+// WS_DECODE_ERROR:     The stream breaks the protocol. Error() is
+//                      the reason to close the connection with.
+//
+// *pConsumedOut is how much of pData was used. Call Decode again
+// with the rest. Header bytes are copied aside until the header's
+// complete, so a header split across reads is fine.
+//
+enum WS_DECODE_RESULT
+{
+	WS_DECODE_NEED_MORE,
+	WS_DECODE_HEADER,
+	WS_DECODE_DATA,
+	WS_DECODE_FRAME_END,
+	WS_DECODE_ERROR
+};
+
+class WebsocketFrameDecoder
+{
+public:
+
+	WebsocketFrameDecoder();
+
+	void Reset();
+
+	WS_DECODE_RESULT Decode(
+		_Inout_updates_(DataLength) LPVOID pData,
+		_In_ SIZE_T DataLength,
+		_Out_ SIZE_T* pConsumedOut,
+		_Out_ StringView* pPayloadOut);
+
+	// The current frame, once WS_DECODE_HEADER has been returned
+	const WS_FRAME_INFO& Frame() const;
+
+	// How much of the current frame's payload came before the
+	// last piece returned. Use with MaskWebsocketPayloadAt if 
+	// Unmask is false.
+	ULONGLONG PayloadOffset() const;
+
+	WS_CLOSE_REASON Error() const;
+
+	ULONGLONG MaxPayloadSize;	// Larger frames fail with WS_CLOSE_MESSAGE_TOO_LARGE
+	bool RequireMasked;			// Servers must reject unmasked frames from clients
+	bool Unmask;				// Unmask payloads in place
+	bool AllowRSV1;				// Set if permessage-deflate was negotiated
+
+private:
+
+	INT m_State;
+	BYTE m_Header[14];
+	BYTE m_HeaderLength;
+	WS_FRAME_INFO m_Frame;
+	ULONGLONG m_PayloadOffset;
+	ULONGLONG m_SliceOffset;
+	WS_CLOSE_REASON m_Error;
+};
+
 WS_FRAME_RESULT
 SetWebsocketFrame(
 	_In_ const WS_FRAME_INFO* pFrameInfo,
@@ -450,8 +1147,262 @@ SetWebsocketCloseFrame(
 	_In_ ULONGLONG PayloadLength,
 	_Out_ WS_PACKED_FRAME_HEADER* pFrameHeader);
 
+//
+// Fixed size blocks for WebsocketMessageAssembler to gather 
+// fragmented messages into. Blocks that are released are kept
+// (up to MaxFree of them) for the next message, so a busy
+// connection stops allocating. Not thread safe; share one between
+// the connections on one thread.
+//
+class WebsocketBufferPool
+{
+public:
+
+	WebsocketBufferPool(
+		_In_ SIZE_T BlockSize = 16 * 1024,
+		_In_ SIZE_T MaxFree = 64);
+
+	~WebsocketBufferPool();
+
+	LPBYTE Acquire();
+
+	void Release(
+		_In_ LPBYTE pBlock);
+
+	SIZE_T BlockSize() const;
+
+private:
+
+	WebsocketBufferPool(const WebsocketBufferPool&);
+	WebsocketBufferPool& operator=(const WebsocketBufferPool&);
+
+	SIZE_T m_BlockSize;
+	SIZE_T m_MaxFree;
+	std::vector<LPBYTE> m_Free;
+};
+
+//
+// Puts messages back together from their frames. Feed it what's
+// been received and it returns each message once it's complete:
+//
+// WS_MESSAGE_COMPLETE: *pMessageOut is a TEXT or BINARY message.
+// WS_MESSAGE_CONTROL:  *pMessageOut is a PING, PONG or CLOSE. These
+//                      can arrive in the middle of a message; it 
+//                      carries on afterwards.
+// WS_MESSAGE_NEED_MORE: All of pData has been used up.
+// WS_MESSAGE_ERROR:    Close the connection, with Error() as the
+//                      reason (see SetWebsocketCloseFrame). 
+//                      Messages over MaxMessageSize give
+//                      WS_CLOSE_MESSAGE_TOO_LARGE.
+//
+// A message that arrives as one frame, all in one Feed, is handed
+// back where it is in pData (unmasked in place), so it's never
+// copied. Anything else is copied into blocks from the pool. 
+// Either way the message is made of one or more pieces, which 
+// stay valid until the next call to Feed or Reset.
+//
+// *pConsumedOut is how much of pData was used. Call Feed again 
+// with the rest.
+//
+enum WS_MESSAGE_RESULT
+{
+	WS_MESSAGE_NEED_MORE,
+	WS_MESSAGE_COMPLETE,
+	WS_MESSAGE_CONTROL,
+	WS_MESSAGE_ERROR
+};
+
+struct WS_MESSAGE
+{
+	WS_FRAME_OPCODE OpCode;
+	const StringView* Pieces;
+	SIZE_T PieceCount;
+	ULONGLONG Length;			// Of all the pieces together
+	bool Compressed;			// Pass it to WebsocketDeflate::Decompress
+};
+
+class WebsocketMessageAssembler
+{
+public:
+
+	// Without a pool, it makes one of its own.
+	WebsocketMessageAssembler(
+		_In_opt_ WebsocketBufferPool* pPool = nullptr);
+
+	~WebsocketMessageAssembler();
+
+	void Reset();
+
+	WS_MESSAGE_RESULT Feed(
+		_Inout_updates_(DataLength) LPVOID pData,
+		_In_ SIZE_T DataLength,
+		_Out_ SIZE_T* pConsumedOut,
+		_Out_ WS_MESSAGE* pMessageOut);
+
+	WS_CLOSE_REASON Error() const;
+
+	ULONGLONG MaxMessageSize;	// Across all of a message's frames
+	bool RequireMasked;			// See WebsocketFrameDecoder
+	bool AllowCompressed;		// Set if permessage-deflate was negotiated
+
+private:
+
+	WebsocketMessageAssembler(const WebsocketMessageAssembler&);
+	WebsocketMessageAssembler& operator=(const WebsocketMessageAssembler&);
+
+	void Fail(_In_ WS_CLOSE_REASON Reason);
+	void Append(_In_ StringView Data);
+	void ReleaseBlocks();
+
+	WebsocketFrameDecoder m_Decoder;
+	WebsocketBufferPool* m_pPool;
+	std::unique_ptr<WebsocketBufferPool> m_OwnPool;
+
+	std::vector<StringView> m_Blocks;		// Used part of each block
+	StringView m_Direct;					// A frame delivered in place
+	CHAR m_Control[125];
+	SIZE_T m_ControlLength;
+
+	bool m_InMessage;						// Between the first and final frame
+	WS_FRAME_OPCODE m_MessageOpCode;
+	bool m_MessageCompressed;
+	ULONGLONG m_MessageLength;
+	bool m_Failed;
+	WS_CLOSE_REASON m_Error;
+};
+
+//
+// The permessage-deflate extension (RFC 7692). Messages are
+// compressed with zlib and sent with RSV1 set on the first frame.
+// Define HTTP_NO_DEFLATE to build without zlib.
+//
+// To use it, when the handshake comes in:
+//  - fill in a WS_DEFLATE_PARAMS with what you'd like,
+//  - call NegotiateWebsocketDeflate; if it returns true, the 
+//    client supports it and the params now say what was agreed,
+//  - call AddWebsocketDeflateHeader on the handshake response,
+//  - make a WebsocketDeflate for the connection, and set 
+//    AllowCompressed on its WebsocketMessageAssembler.
+//
+// Without context takeover, each message is compressed on its own,
+// so a connection doesn't need to keep any zlib state between
+// messages. It borrows it from a WebsocketDeflatePool instead,
+// which saves about 300KB per idle connection. Asking for both 
+// is the default.
+//
+#if !defined(HTTP_NO_DEFLATE)
+
+struct WS_DEFLATE_PARAMS
+{
+	bool ServerNoContextTakeover;	// We start each message afresh
+	bool ClientNoContextTakeover;	// The client starts each message afresh
+	BYTE ServerMaxWindowBits;		// 9-15, the window we compress with
+	BYTE ClientMaxWindowBits;		// 8-15 to limit the client, 0 to leave it
+};
+
+void
+DefaultWebsocketDeflateParams(
+	_Out_ WS_DEFLATE_PARAMS* pParams);
+
+bool
+NegotiateWebsocketDeflate(
+	_In_ const RequestHeader& Request,
+	_Inout_ WS_DEFLATE_PARAMS* pParams);
+
+void
+AddWebsocketDeflateHeader(
+	_In_ const WS_DEFLATE_PARAMS& Params,
+	_Inout_ ResponseHeaderBuilder* pResponseBuilder);
+
+enum WS_DEFLATE_RESULT
+{
+	WS_DEFLATE_OK,
+	WS_DEFLATE_ERROR,			// Close with WS_CLOSE_INCONSISTENT_DATA
+	WS_DEFLATE_TOO_LARGE		// Close with WS_CLOSE_MESSAGE_TOO_LARGE
+};
+
+//
+// zlib streams that aren't in use, kept for the next message.
+// Not thread safe; share one between the connections on one 
+// thread.
+//
+class WebsocketDeflatePool
+{
+public:
+
+	WebsocketDeflatePool(
+		_In_ INT Level = 6,
+		_In_ INT MemLevel = 8,
+		_In_ SIZE_T MaxFree = 16);
+
+	~WebsocketDeflatePool();
+
+	::z_stream_s* AcquireDeflate(_In_ INT WindowBits);
+	void ReleaseDeflate(_In_ ::z_stream_s* pStream, _In_ INT WindowBits);
+
+	::z_stream_s* AcquireInflate();
+	void ReleaseInflate(_In_ ::z_stream_s* pStream);
+
+private:
+
+	WebsocketDeflatePool(const WebsocketDeflatePool&);
+	WebsocketDeflatePool& operator=(const WebsocketDeflatePool&);
+
+	INT m_Level;
+	INT m_MemLevel;
+	SIZE_T m_MaxFree;
+	std::vector<::z_stream_s*> m_FreeDeflate[16];	// By window bits
+	std::vector<::z_stream_s*> m_FreeInflate;
+};
+
+class WebsocketDeflate
+{
+public:
+
+	// Without a pool, it makes one of its own.
+	WebsocketDeflate(
+		_In_ const WS_DEFLATE_PARAMS& Params,
+		_In_opt_ WebsocketDeflatePool* pPool = nullptr);
+
+	~WebsocketDeflate();
+
+	// Output is the payload to send, with RSV1 set. Its capacity
+	// is reused.
+	WS_DEFLATE_RESULT Compress(
+		_In_reads_bytes_(DataLength) LPCVOID pData,
+		_In_ SIZE_T DataLength,
+		_Out_ String& Output);
+
+	WS_DEFLATE_RESULT Decompress(
+		_In_ const WS_MESSAGE& Message,
+		_Out_ String& Output);
+
+	// What was agreed, after any fixing up
+	const WS_DEFLATE_PARAMS& Params() const;
+
+	ULONGLONG MaxMessageSize;	// Limit on what a message inflates to
+
+private:
+
+	WebsocketDeflate(const WebsocketDeflate&);
+	WebsocketDeflate& operator=(const WebsocketDeflate&);
+
+	WS_DEFLATE_PARAMS m_Params;
+	WebsocketDeflatePool* m_pPool;
+	std::unique_ptr<WebsocketDeflatePool> m_OwnPool;
+
+	// Only kept between messages with context takeover
+	::z_stream_s* m_pDeflate;
+	::z_stream_s* m_pInflate;
+};
+
+#endif
+
 // This is synonymous with UnmaskWebsocketFrame, but 
 // is aliased for clarity.
+//
+// pOutData may be the same as pData to (un)mask in place, but the
+// two mustn't otherwise overlap.
 void 
 MaskWebsocketPayload(
 	_In_reads_(DataLength) LPCVOID pData,
@@ -468,4 +1419,651 @@ UnmaskWebsocketPayload(
 	_In_ DWORD MaskingKey,
 	_Out_writes_(DataLength) LPVOID pOutData);
 
+// For payloads that arrive in pieces: masks DataLength bytes that
+// start Offset bytes into the payload, so the right key byte is 
+// used for each. Masking a payload in several calls gives the 
+// same result as doing it in one.
+void 
+MaskWebsocketPayloadAt(
+	_In_reads_(DataLength) LPCVOID pData,
+	_In_ ULONGLONG DataLength,
+	_In_ DWORD MaskingKey,
+	_In_ ULONGLONG Offset,
+	_Out_writes_(DataLength) LPVOID pOutData);
+
+//
+// A whole frame, header and payload, ready to send. Frames from
+// the server aren't masked, so the same bytes can go to any 
+// number of connections: build it once and queue the same 
+// WS_SHARED_FRAME on each of them. It can't be changed once it's
+// built, so it's safe to share between threads.
+//
+class WebsocketSharedFrame;
+typedef std::shared_ptr<const WebsocketSharedFrame> WS_SHARED_FRAME;
+
+class WebsocketSharedFrame
+{
+public:
+
+	// Returns null if the frame can't be built (e.g. a control 
+	// frame with more than 125 bytes of payload).
+	static WS_SHARED_FRAME Create(
+		_In_ WS_FRAME_OPCODE OpCode,
+		_In_reads_bytes_opt_(PayloadLength) LPCVOID pPayload,
+		_In_ SIZE_T PayloadLength);
+
+#if !defined(HTTP_NO_DEFLATE)
+	//
+	// Compressed with permessage-deflate. Only connections that
+	// negotiated it can be sent this, and Deflate has to have been
+	// made with ServerNoContextTakeover; otherwise each message
+	// depends on what that connection was sent before, and this 
+	// returns null.
+	//
+	static WS_SHARED_FRAME Create(
+		_In_ WS_FRAME_OPCODE OpCode,
+		_In_reads_bytes_opt_(PayloadLength) LPCVOID pPayload,
+		_In_ SIZE_T PayloadLength,
+		_Inout_ WebsocketDeflate& Deflate);
+#endif
+
+	LPCVOID Data() const;
+	SIZE_T Length() const;			// Header and payload
+	SIZE_T HeaderLength() const;
+
+private:
+
+	WebsocketSharedFrame();
+	WebsocketSharedFrame(const WebsocketSharedFrame&);
+	WebsocketSharedFrame& operator=(const WebsocketSharedFrame&);
+
+	static WS_SHARED_FRAME Build(
+		_In_ WS_FRAME_OPCODE OpCode,
+		_In_ bool Compressed,
+		_In_reads_bytes_opt_(PayloadLength) LPCVOID pPayload,
+		_In_ SIZE_T PayloadLength);
+
+	String m_Data;
+	SIZE_T m_HeaderLength;
+};
+
+//
+// The frames waiting to go out on one connection. Nothing is 
+// copied: the queue holds a reference to each frame until it's
+// been sent. Not thread safe.
+//
+// To send:
+//  - Gather the front of the queue into segments,
+//  - writev/WSASend them,
+//  - call Consume with the number of bytes that went.
+//
+class WebsocketSendQueue
+{
+public:
+
+	WebsocketSendQueue();
+
+	// Returns false (and doesn't queue it) if that would take the
+	// queue past MaxQueuedBytes. A client that can't keep up is 
+	// usually best disconnected.
+	bool Push(
+		_In_ const WS_SHARED_FRAME& Frame);
+
+	// Returns the number of segments filled in.
+	SIZE_T Gather(
+		_Out_writes_to_(MaxSegments, return) RESPONSE_SEGMENT* pSegments,
+		_In_ SIZE_T MaxSegments) const;
+
+	void Consume(
+		_In_ SIZE_T BytesSent);
+
+	void Clear();
+
+	bool Empty() const;
+	ULONGLONG QueuedBytes() const;
+
+	ULONGLONG MaxQueuedBytes;	// 0 for no limit
+
+private:
+
+	std::deque<WS_SHARED_FRAME> m_Frames;
+	SIZE_T m_FrontOffset;		// How much of the front frame has gone
+	ULONGLONG m_QueuedBytes;
+};
+
+enum WS_BATCH_RESULT
+{
+	WS_BATCH_OK,				// Added
+	WS_BATCH_FLUSH,				// Added, and the batch is full: send it
+	WS_BATCH_FULL,				// Not added: send the batch, then add it again
+	WS_BATCH_ERROR				// Not added: the frame is invalid
+};
+
+//
+// Packs frames one after another into one buffer, so lots of
+// small messages go out in one send rather than one each. 
+//
+// A batch is sent when it's full (MaxBatchSize) or when its 
+// deadline comes, FlushDelay after the first frame went in, 
+// whichever is first. Times are whatever clock the caller uses
+// (e.g. GetTickCount64), as long as it's the same for every call;
+// Deadline() is what to wait on. A frame bigger than MaxBatchSize
+// gets a batch to itself.
+//
+// To send:
+//  - Data()/Length() are what's waiting,
+//  - send what you can,
+//  - call Consume with the number of bytes that went.
+//
+// Adding can move what's waiting, so Data() is only good until the
+// next Add.
+//
+// Not thread safe.
+//
+class WebsocketFrameBatcher
+{
+public:
+
+	WebsocketFrameBatcher(
+		_In_ SIZE_T MaxBatchSize = 16 * 1024,
+		_In_ ULONGLONG FlushDelay = 1);
+
+	// If Info.Masked is set, the payload is masked as it's copied.
+	// Info.PayloadLength is the length of pPayload.
+	WS_BATCH_RESULT Add(
+		_In_ const WS_FRAME_INFO& Info,
+		_In_reads_bytes_opt_(Info.PayloadLength) LPCVOID pPayload,
+		_In_ ULONGLONG Now);
+
+	// A whole, unfragmented, unmasked frame
+	WS_BATCH_RESULT Add(
+		_In_ WS_FRAME_OPCODE OpCode,
+		_In_reads_bytes_opt_(PayloadLength) LPCVOID pPayload,
+		_In_ SIZE_T PayloadLength,
+		_In_ ULONGLONG Now);
+
+	// Copies in a frame that's also being sent elsewhere
+	WS_BATCH_RESULT Add(
+		_In_ const WebsocketSharedFrame& Frame,
+		_In_ ULONGLONG Now);
+
+	// Whether anything's waiting and its deadline has come
+	bool FlushDue(
+		_In_ ULONGLONG Now) const;
+
+	// When the batch has to go. Only meaningful if !Empty().
+	ULONGLONG Deadline() const;
+
+	LPCVOID Data() const;
+	SIZE_T Length() const;
+	bool Empty() const;
+
+	void Consume(
+		_In_ SIZE_T BytesSent);
+
+	void Clear();
+
+	SIZE_T MaxBatchSize;
+	ULONGLONG FlushDelay;
+
+private:
+
+	WS_BATCH_RESULT Reserve(
+		_In_ SIZE_T FrameLength,
+		_In_ ULONGLONG Now);
+
+	WS_BATCH_RESULT Added() const;
+
+	String m_Buffer;
+	SIZE_T m_Offset;			// How much of m_Buffer has been sent
+	ULONGLONG m_Deadline;
+};
+
+#if defined(__linux__)
+
+//
+// A server built on the above, using non-blocking sockets and 
+// either io_uring (on 6.0 and later kernels) or edge-triggered 
+// epoll. It owns the connections, their buffers and what's waiting
+// to be sent, and hands each complete request (header and body) to
+// the handler. Pipelined requests are answered in order.
+//
+// With one thread (the default), everything happens on the thread
+// that calls Run, including all of the handler calls. With more,
+// each thread runs its own loop with its own SO_REUSEPORT listener,
+// and the kernel spreads new connections across them. A connection
+// stays on the loop that accepted it, so its exchanges and its 
+// ServerWebsocket must only be used on that loop's thread (e.g. 
+// from its handlers), but the handlers themselves are shared and 
+// must be thread safe. Only Stop, Stats and TotalStats can be 
+// called from anywhere.
+//
+
+//
+// How the loops do their I/O. With io_uring, accepting and 
+// receiving are multishot, and the kernel receives into a ring of
+// buffers that requests are then parsed from where they are. 
+//
+enum SERVER_IO
+{
+	SERVER_IO_AUTO,				// io_uring if the kernel has all we need, otherwise epoll
+	SERVER_IO_EPOLL,
+	SERVER_IO_URING				// Or fail to start
+};
+
+struct SERVER_CONFIG
+{
+	LPCSTR Address;				// IPv4 or IPv6 address to listen on; null for all
+	USHORT Port;
+	INT Backlog;				// For listen()
+	SIZE_T ReadBufferSize;		// Each connection's, to start with
+	SIZE_T MaxRequestSize;		// Header and body; larger requests get a 400
+	SIZE_T MaxWriteQueue;		// Bytes queued before a WebSocket, or a streamed response, is dropped
+	SIZE_T MaxConnections;		// More are accepted and closed straight away
+	UINT IdleTimeout;			// Seconds without traffic before closing; 0 for never
+	bool EnableDeflate;			// Agree to permessage-deflate if a client offers it
+	UINT Threads;				// Loops to run; 0 for one per CPU we can run on
+	bool PinThreads;			// Pin each loop's thread to its own CPU
+	SERVER_IO Io;
+	UINT RingBuffers;			// Per loop, for io_uring to receive into; each is ReadBufferSize
+	bool StreamBodies;			// Hand requests over before their bodies are in (see ReadBody)
+	UINT Workers;				// Threads for ServerExchange::Offload, shared by the loops; 0 for none
+};
+
+void
+DefaultServerConfig(
+	_Out_ SERVER_CONFIG* pConfig);
+
+enum SERVER_RESULT
+{
+	SERVER_OK,
+	SERVER_ADDRESS_INVALID,
+	SERVER_SOCKET_FAILED,		// errno says why, for these
+	SERVER_BIND_FAILED,
+	SERVER_LISTEN_FAILED,
+	SERVER_EPOLL_FAILED,
+	SERVER_URING_FAILED,		// io_uring was asked for, but isn't available
+	SERVER_ALREADY_STARTED
+};
+
+//
+// Counted by each loop as it goes. They're read without stopping
+// the loop, so a snapshot may be a moment out between fields.
+//
+struct SERVER_STATS
+{
+	ULONGLONG Accepted;			// Connections
+	ULONGLONG Open;
+	ULONGLONG Requests;
+	ULONGLONG WebsocketMessages;	// Received
+	ULONGLONG BytesReceived;
+	ULONGLONG BytesSent;
+};
+
+//
+// One request and its response. The handler can answer straight
+// away, or hold on to the exchange and answer later (on the 
+// same thread); requests pipelined after it wait until it does,
+// and until the client's taken most of the answers before them.
+//
+// Response is already set up for the request's protocol and
+// keep-alive, and to send the date. Set the code and headers
+// (including the Content-Length, e.g. with AddBinaryHeaders) and
+// call Send. The body is copied, and isn't sent for HEAD requests.
+//
+// Or, to send the body as it's produced, call Write as often as
+// needed, then Finish. Without a Content-Length it's sent in chunks
+// (AddChunkedHeaders sets the Content-Type too); an HTTP/1.0 client
+// can't take chunks, so it gets the body as it is and the 
+// connection's closed after. With one, it's sent as it is, and if
+// it turns out longer or shorter, it's cut off at the length and
+// the connection's closed after. Write only copies, so a handler that
+// writes a lot should wait for OnWritable once Writable is false;
+// one that gets MaxWriteQueue ahead of the client is dropped.
+//
+// With StreamBodies set, the handler's called once the header's
+// in, and the body is read with ReadBody as it arrives. Reading
+// stops while MaxRequestSize is waiting to be read, and anything
+// still to come once the exchange is answered is thrown away.
+// Without it, ReadBody returns the whole body the first time.
+//
+// The callbacks are each called once, on the loop's thread, or
+// when the client goes away (in which case Pending is false).
+//
+class ServerExchange
+{
+public:
+
+	const RequestHeader& Request() const;
+
+	// The request's body. For a chunked request, it's been decoded.
+	// Empty if it's being streamed.
+	StringView Body() const;
+
+	// After Write, this writes the last of it and finishes
+	void Send(
+		_In_reads_bytes_opt_(BodyLength) LPCVOID pBody,
+		_In_ SIZE_T BodyLength);
+
+	// False once the response has been sent, or if the client 
+	// went away first.
+	bool Pending() const;
+
+	// What's arrived since the last call, which is valid until the
+	// next. Empty if there's nothing yet, or nothing more to come.
+	StringView ReadBody();
+
+	// Whether ReadBody has anything to return, or the body's done
+	bool BodyReadable() const;
+
+	// Whether all of the body has been read. If the client went 
+	// away part way through, it's all there's going to be.
+	bool BodyDone() const;
+
+	void OnBody(
+		_In_ std::function<void ()> Callback);
+
+	// The first call sends the header too. False if the client's
+	// gone, or this went past the Content-Length.
+	bool Write(
+		_In_reads_bytes_opt_(Length) LPCVOID pData,
+		_In_ SIZE_T Length);
+
+	void Finish();
+
+	bool Writable() const;
+
+	void OnWritable(
+		_In_ std::function<void ()> Callback);
+
+	//
+	// Runs Work on one of the server's workers, so that heavy work
+	// doesn't hold up everything else on the loop. It can read the
+	// request and its Body, set Response, and fill in the body to
+	// send, but mustn't call anything on the exchange; the response
+	// is sent from the exchange's own loop once it's done. Without
+	// workers, it's run and sent straight away. If the loop reads
+	// the request meanwhile, both sides should stick to the views
+	// (see RequestHeader::ResourceURIView).
+	//
+	void Offload(
+		_In_ std::function<void (String& Body)> Work);
+
+#if defined(__cpp_impl_coroutine)
+	// See ServerTask
+	struct SERVER_BODY_AWAITER BodyChunk();
+
+	struct SERVER_WRITE_AWAITER WriteAsync(
+		_In_reads_bytes_opt_(Length) LPCVOID pData,
+		_In_ SIZE_T Length);
+#endif
+
+	ResponseHeaderBuilder Response;
+
+private:
+
+	friend struct SERVER_CONNECTION;
+	friend struct SERVER_LOOP;
+
+	ServerExchange();
+	ServerExchange(const ServerExchange&);
+	ServerExchange& operator=(const ServerExchange&);
+
+	RequestHeader m_Request;
+	StringView m_HeaderText;
+	StringView m_Body;
+	String m_ChunkedBody;
+	struct SERVER_CONNECTION* m_pConnection;
+
+	bool m_Streaming;
+	bool m_BodyRead;			// The whole body's been handed out, when not streaming
+	bool m_BodyDone;			// Nothing more's coming in
+	String m_BodyIn;			// Arrived, not yet read
+	String m_BodyOut;			// Last returned by ReadBody
+	std::function<void ()> m_OnBody;
+
+	std::unique_ptr<ChunkedResponseWriter> m_pWriter;
+	String m_Output;			// What the writer's produced, to be queued
+	bool m_Chunked;				// Written as chunks, not as it is
+	ULONGLONG m_BodyLeft;		// Of the Content-Length; -1 if there isn't one
+	std::function<void ()> m_OnWritable;
+};
+
+typedef std::shared_ptr<ServerExchange> SERVER_EXCHANGE;
+
+// A message taken with ServerWebsocket::Receive
+struct SERVER_MESSAGE
+{
+	WS_FRAME_OPCODE OpCode;
+	String Data;				// Decompressed
+};
+
+//
+// A WebSocket connection, once the handshake's done. Hold on to
+// it to send to the client later; once it's closed, sending does
+// nothing and returns false.
+//
+class ServerWebsocket
+{
+public:
+
+	//
+	// A whole message. If permessage-deflate was agreed, it's 
+	// compressed. Small messages are gathered up and sent together
+	// at the end of the server's current turn.
+	//
+	bool Send(
+		_In_ WS_FRAME_OPCODE OpCode,
+		_In_reads_bytes_opt_(PayloadLength) LPCVOID pPayload,
+		_In_ SIZE_T PayloadLength);
+
+	// A frame built once for many connections. Compressed frames
+	// should only be sent where Compressed() is true.
+	bool Send(
+		_In_ const WS_SHARED_FRAME& Frame);
+
+	// Sends a close frame and closes once it's gone
+	void Close(
+		_In_ WS_CLOSE_REASON Reason);
+
+	bool Open() const;
+
+	// Whether permessage-deflate was agreed
+	bool Compressed() const;
+
+	// The handshake request
+	const RequestHeader& Request() const;
+
+	//
+	// Without an OnMessage handler, messages are kept until they're
+	// taken with this instead. False if there are none waiting. 
+	// Reading stops while MaxRequestSize is waiting.
+	//
+	bool Receive(
+		_Out_ SERVER_MESSAGE* pMessage);
+
+	// Called once when there's a message, or it's closed
+	void OnReceivable(
+		_In_ std::function<void ()> Callback);
+
+#if defined(__cpp_impl_coroutine)
+	// See ServerTask
+	struct SERVER_MESSAGE_AWAITER NextMessage(
+		_Out_ SERVER_MESSAGE* pMessage);
+#endif
+
+	std::shared_ptr<void> Context;	// Yours
+
+private:
+
+	friend struct SERVER_CONNECTION;
+	friend struct SERVER_LOOP;
+
+	ServerWebsocket();
+	ServerWebsocket(const ServerWebsocket&);
+	ServerWebsocket& operator=(const ServerWebsocket&);
+
+	SERVER_EXCHANGE m_Handshake;
+	struct SERVER_CONNECTION* m_pConnection;
+
+	std::deque<SERVER_MESSAGE> m_Messages;
+	SIZE_T m_MessageBytes;
+	std::function<void ()> m_OnReceivable;
+};
+
+typedef std::shared_ptr<ServerWebsocket> SERVER_WEBSOCKET;
+
+typedef std::function<void (const SERVER_EXCHANGE&)> RequestHandler;
+
+//
+// If OnMessage or OnOpen is set, requests for which 
+// IsWebsocketRequest is true are upgraded rather than passed to the
+// request handler.
+//
+// Accept:     Optional. Return false to refuse the upgrade (with
+//             a 403).
+// OnMessage:  A complete message, already decompressed. The 
+//             pieces are only valid during the call. Without it,
+//             messages wait for ServerWebsocket::Receive.
+// OnClose:    The connection's gone; the reason is the one the
+//             client gave, if it gave one.
+//
+struct WEBSOCKET_HANDLERS
+{
+	std::function<bool (const RequestHeader&)> Accept;
+	std::function<void (const SERVER_WEBSOCKET&)> OnOpen;
+	std::function<void (const SERVER_WEBSOCKET&, const WS_MESSAGE&)> OnMessage;
+	std::function<void (const SERVER_WEBSOCKET&, WS_CLOSE_REASON)> OnClose;
+};
+
+class Server
+{
+public:
+
+	Server();
+	~Server();
+
+	void OnRequest(
+		_In_ RequestHandler Handler);
+
+	void OnWebsocket(
+		_In_ const WEBSOCKET_HANDLERS& Handlers);
+
+	// Creates the listening sockets. 
+	SERVER_RESULT Start(
+		_In_ const SERVER_CONFIG& Config);
+
+	// Serves until Stop is called. Connections that are still 
+	// open are closed before it returns. With more than one 
+	// thread, the loops get threads of their own and this waits
+	// for them.
+	void Run();
+
+	// Can be called from any thread, or from a handler.
+	void Stop();
+
+	// The port being listened on, e.g. after starting on port 0
+	USHORT Port() const;
+
+	// How many loops there are, once started
+	UINT Threads() const;
+
+	// Which the loops ended up using, once started
+	SERVER_IO Io() const;
+
+	void Stats(
+		_In_ UINT Thread,
+		_Out_ SERVER_STATS* pStats) const;
+
+	// All of the loops' stats added up
+	void TotalStats(
+		_Out_ SERVER_STATS* pStats) const;
+
+private:
+
+	Server(const Server&);
+	Server& operator=(const Server&);
+
+	struct SERVER_DATA* m_pData;
+};
+
+#if defined(__cpp_impl_coroutine)
+
+//
+// For handlers written as C++20 coroutines. They run on the loop's
+// thread like any other handler, and each co_await parks the 
+// coroutine until the loop has what it's waiting for, e.g.
+//
+//     HTTP::ServerTask Upload(HTTP::SERVER_EXCHANGE exchange)
+//     {
+//         for (;;)
+//         {
+//             HTTP::StringView chunk = co_await exchange->BodyChunk();
+//             if (!chunk.Length) break;
+//             ...
+//         }
+//         exchange->Response.AddChunkedHeaders("text/plain");
+//         co_await exchange->WriteAsync("Thanks", 6);
+//         exchange->Finish();
+//     }
+//
+//     server.OnRequest([] (const HTTP::SERVER_EXCHANGE& exchange) { Upload(exchange); });
+//
+// Take the exchange or websocket by value, so the coroutine keeps
+// it alive. A coroutine starts straight away and frees itself when
+// it returns; if the client goes away, whatever it's waiting on 
+// completes (with nothing) so that it can. The library has to be
+// built as C++20 too for these to be there.
+//
+class ServerTask
+{
+public:
+
+	struct promise_type
+	{
+		ServerTask get_return_object();
+		std::suspend_never initial_suspend();
+		std::suspend_never final_suspend() noexcept;
+		void return_void();
+		void unhandled_exception();
+	};
+};
+
+// The next piece of the body; empty at the end
+struct SERVER_BODY_AWAITER
+{
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> Handle);
+	StringView await_resume();
+
+	ServerExchange* pExchange;
+};
+
+// Writes, then waits until more can be written. False if the client's gone.
+struct SERVER_WRITE_AWAITER
+{
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> Handle);
+	bool await_resume();
+
+	ServerExchange* pExchange;
+	bool Written;
+};
+
+// False once it's closed and there's nothing left
+struct SERVER_MESSAGE_AWAITER
+{
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> Handle);
+	bool await_resume();
+
+	ServerWebsocket* pWebsocket;
+	SERVER_MESSAGE* pMessage;
+	bool Received;
+};
+
+#endif
+
+#endif
+
 }
@@ -1,79 +1,380 @@
-#include "HTTP.h"
+#include "HTTPInternal.h"
 
 namespace HTTP
 {
 
 /*
-	WARNING:
-	Shameless, shameless rip from http://www.adp-gmbh.ch/win/misc/webserver.html
+	TABLES
 */
+const CHAR kBase64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define BASE64_INVALID	0xFF
+
+//
+// Character to 6 bit value, or BASE64_INVALID. '=' is invalid
+// too; padding is dealt with separately.
+//
+struct BASE64_DECODE_TABLE
+{
+	BASE64_DECODE_TABLE()
+	{
+		memset(Value, BASE64_INVALID, sizeof(Value));
+
+		for (BYTE i = 0; i < 64; ++i)
+		{
+			Value[(BYTE) kBase64Alphabet[i]] = i;
+		}
+	}
+
+	BYTE Value[256];
+};
+
+const BASE64_DECODE_TABLE& GetBase64DecodeTable()
+{
+	static const BASE64_DECODE_TABLE table;
+	return table;
+}
 
 /*
-	The character array
+	SSSE3 / AVX2 KERNELS
+
+	These do the bulk of the work 12 (or 24) bytes at a time, then
+	leave the rest to the scalar code. They load and store whole
+	vectors, so they stop while there's less than a vector's worth
+	of room left either side.
+
+	The approach is Wojciech Muła's: encoding shuffles each 3 bytes
+	into 4 lanes and shifts the 6 bit fields into place with
+	multiplies, then turns them into characters by adding an offset
+	picked by range. Decoding checks and translates characters by
+	looking up their high and low nibbles, then packs the fields
+	back together with multiply-adds.
+
+	Each kernel advances the pointers past what it's done. Decoding
+	stops at the first block with anything that isn't in the
+	alphabet, so the scalar code can find out what's wrong with it.
 */
-const String kBase64Array = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+#if defined(HTTP_X86)
+
+#define BASE64_ENCODE_SHUFFLE	10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+#define BASE64_ENCODE_OFFSETS \
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+#define BASE64_DECODE_LUT_LO \
+	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+	0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define BASE64_DECODE_LUT_HI \
+	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_DECODE_ROLL \
+	0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define BASE64_DECODE_PACK \
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+HTTP_TARGET("ssse3")
+inline __m128i EncodeSSSE3(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(BASE64_ENCODE_SHUFFLE));
+
+	__m128i fields = _mm_or_si128(
+		_mm_mulhi_epu16(
+			_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)),
+			_mm_set1_epi32(0x04000040)),
+		_mm_mullo_epi16(
+			_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)),
+			_mm_set1_epi32(0x01000010)));
+
+	// 0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10, 62 -> 11, 63 -> 12
+	__m128i range = _mm_subs_epu8(fields, _mm_set1_epi8(51));
+	range = _mm_or_si128(range,
+		_mm_and_si128(
+			_mm_cmpgt_epi8(_mm_set1_epi8(26), fields),
+			_mm_set1_epi8(13)));
+
+	return _mm_add_epi8(
+		fields,
+		_mm_shuffle_epi8(_mm_setr_epi8(BASE64_ENCODE_OFFSETS), range));
+}
+
+HTTP_TARGET("ssse3")
+void Base64EncodeSSSE3(const BYTE*& pIn, const BYTE* pInEnd, LPSTR& pOut)
+{
+	while (pInEnd - pIn >= 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*) pIn);
+		_mm_storeu_si128((__m128i*) pOut, EncodeSSSE3(in));
+
+		pIn += 12;
+		pOut += 16;
+	}
+}
+
+HTTP_TARGET("avx2")
+void Base64EncodeAVX2(const BYTE*& pIn, const BYTE* pInEnd, LPSTR& pOut)
+{
+	const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_set_epi8(BASE64_ENCODE_SHUFFLE));
+	const __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8(BASE64_ENCODE_OFFSETS));
+
+	while (pInEnd - pIn >= 28)
+	{
+		// 12 bytes into each lane
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) pIn)),
+			_mm_loadu_si128((const __m128i*) (pIn + 12)),
+			1);
+
+		in = _mm256_shuffle_epi8(in, shuffle);
+
+		__m256i fields = _mm256_or_si256(
+			_mm256_mulhi_epu16(
+				_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)),
+				_mm256_set1_epi32(0x04000040)),
+			_mm256_mullo_epi16(
+				_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)),
+				_mm256_set1_epi32(0x01000010)));
+
+		__m256i range = _mm256_subs_epu8(fields, _mm256_set1_epi8(51));
+		range = _mm256_or_si256(range,
+			_mm256_and_si256(
+				_mm256_cmpgt_epi8(_mm256_set1_epi8(26), fields),
+				_mm256_set1_epi8(13)));
+
+		__m256i out = _mm256_add_epi8(fields, _mm256_shuffle_epi8(offsets, range));
+		_mm256_storeu_si256((__m256i*) pOut, out);
+
+		pIn += 24;
+		pOut += 32;
+	}
+
+	Base64EncodeSSSE3(pIn, pInEnd, pOut);
+}
+
+HTTP_TARGET("ssse3")
+void Base64DecodeSSSE3(LPCSTR& pIn, LPCSTR pInEnd, BYTE*& pOut, const BYTE* pOutEnd)
+{
+	const __m128i mask2F = _mm_set1_epi8(0x2F);
+
+	while (pInEnd - pIn >= 16 && pOutEnd - pOut >= 16)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*) pIn);
+
+		__m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask2F);
+		__m128i loNibbles = _mm_and_si128(in, mask2F);
+		__m128i hi = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_DECODE_LUT_HI), hiNibbles);
+		__m128i lo = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_DECODE_LUT_LO), loNibbles);
+
+		// A character's valid if its two lookups have no bits in common
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xFFFF)
+		{
+			break;
+		}
+
+		__m128i roll = _mm_shuffle_epi8(
+			_mm_setr_epi8(BASE64_DECODE_ROLL),
+			_mm_add_epi8(_mm_cmpeq_epi8(in, mask2F), hiNibbles));
+		__m128i fields = _mm_add_epi8(in, roll);
+
+		__m128i packed = _mm_madd_epi16(
+			_mm_maddubs_epi16(fields, _mm_set1_epi32(0x01400140)),
+			_mm_set1_epi32(0x00011000));
+		packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(BASE64_DECODE_PACK));
+
+		_mm_storeu_si128((__m128i*) pOut, packed);
+
+		pIn += 16;
+		pOut += 12;
+	}
+}
+
+HTTP_TARGET("avx2")
+void Base64DecodeAVX2(LPCSTR& pIn, LPCSTR pInEnd, BYTE*& pOut, const BYTE* pOutEnd)
+{
+	const __m256i mask2F = _mm256_set1_epi8(0x2F);
+	const __m256i lutLo = _mm256_broadcastsi128_si256(_mm_setr_epi8(BASE64_DECODE_LUT_LO));
+	const __m256i lutHi = _mm256_broadcastsi128_si256(_mm_setr_epi8(BASE64_DECODE_LUT_HI));
+	const __m256i lutRoll = _mm256_broadcastsi128_si256(_mm_setr_epi8(BASE64_DECODE_ROLL));
+	const __m256i pack = _mm256_broadcastsi128_si256(_mm_setr_epi8(BASE64_DECODE_PACK));
+
+	while (pInEnd - pIn >= 32 && pOutEnd - pOut >= 32)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i*) pIn);
+
+		__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+		__m256i loNibbles = _mm256_and_si256(in, mask2F);
+		__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+		__m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+
+		if (!_mm256_testz_si256(lo, hi))
+		{
+			break;
+		}
+
+		__m256i roll = _mm256_shuffle_epi8(
+			lutRoll,
+			_mm256_add_epi8(_mm256_cmpeq_epi8(in, mask2F), hiNibbles));
+		__m256i fields = _mm256_add_epi8(in, roll);
+
+		__m256i packed = _mm256_madd_epi16(
+			_mm256_maddubs_epi16(fields, _mm256_set1_epi32(0x01400140)),
+			_mm256_set1_epi32(0x00011000));
+		packed = _mm256_shuffle_epi8(packed, pack);
+
+		// 12 bytes at the bottom of each lane; close the gap
+		packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+		_mm256_storeu_si256((__m256i*) pOut, packed);
+
+		pIn += 32;
+		pOut += 24;
+	}
+
+	Base64DecodeSSSE3(pIn, pInEnd, pOut, pOutEnd);
+}
+
+#endif
 
 /*
-	Is the character in base64?
+	DISPATCH
 */
-bool __IsBase64( BYTE b )
+typedef void (*BASE64_ENCODE_FUNC)(const BYTE*&, const BYTE*, LPSTR&);
+typedef void (*BASE64_DECODE_FUNC)(LPCSTR&, LPCSTR, BYTE*&, const BYTE*);
+
+void Base64EncodeNone(const BYTE*&, const BYTE*, LPSTR&)
 {
-	return ( 
-		(b >= '0' && b <= '9') || 
-		(b >= 'a' && b <= 'z') || 
-		(b >= 'A' && b <= 'Z') ||
-		b == '+' || 
-		b == '/' );
+}
+
+void Base64DecodeNone(LPCSTR&, LPCSTR, BYTE*&, const BYTE*)
+{
+}
+
+struct BASE64_DISPATCH
+{
+	BASE64_DISPATCH()
+		: Encode(Base64EncodeNone)
+		, Decode(Base64DecodeNone)
+	{
+#if defined(HTTP_X86)
+		const CPU_FEATURES& cpu = GetCPUFeatures();
+
+		if (cpu.AVX2)
+		{
+			Encode = Base64EncodeAVX2;
+			Decode = Base64DecodeAVX2;
+		}
+		else if (cpu.SSSE3)
+		{
+			Encode = Base64EncodeSSSE3;
+			Decode = Base64DecodeSSSE3;
+		}
+#endif
+	}
+
+	BASE64_ENCODE_FUNC Encode;
+	BASE64_DECODE_FUNC Decode;
+};
+
+const BASE64_DISPATCH& GetBase64Dispatch()
+{
+	static const BASE64_DISPATCH dispatch;
+	return dispatch;
 }
 
 /*
-	Encode
+	SIZES
 */
-String Base64Encode(
-	LPCVOID vpData, 
-	SIZE_T Size )
+SIZE_T Base64EncodedSize(
+	SIZE_T DataSize)
 {
-	String ret;
+	return (DataSize + 2) / 3 * 4;
+}
 
-	const BYTE* pData = (const BYTE *) vpData;
-	int i = 0;
-	int j = 0;
-	BYTE char_array_3[3];
-	BYTE char_array_4[4];
+SIZE_T Base64DecodedSize(
+	LPCSTR pEncoded,
+	SIZE_T EncodedSize)
+{
+	SIZE_T size = EncodedSize / 4 * 3;
 
-	while (Size--)
+	if (EncodedSize >= 4 && EncodedSize % 4 == 0)
 	{
-		char_array_3[i++] = *(pData++);
-		if (i == 3)
+		if (pEncoded[EncodedSize - 1] == '=')
 		{
-			char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-			char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-			char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-			char_array_4[3] = char_array_3[2] & 0x3f;
-
-			for(i = 0; i < 4; i++)
-				ret += kBase64Array[char_array_4[i]];
-			i = 0;
+			size--;
+
+			if (pEncoded[EncodedSize - 2] == '=')
+			{
+				size--;
+			}
 		}
 	}
 
-	if (i)
+	return size;
+}
+
+/*
+	Encode
+*/
+BASE64_RESULT Base64Encode(
+	LPCVOID vpData,
+	SIZE_T DataSize,
+	LPSTR pBuffer,
+	SIZE_T BufferSize,
+	SIZE_T* pLengthOut)
+{
+	SIZE_T needed = Base64EncodedSize(DataSize);
+	*pLengthOut = needed;
+
+	if (BufferSize < needed)
+	{
+		return BASE64_BUFFER_TOO_SMALL;
+	}
+
+	const BYTE* pIn = (const BYTE*) vpData;
+	const BYTE* pInEnd = pIn + DataSize;
+	LPSTR pOut = pBuffer;
+
+	GetBase64Dispatch().Encode(pIn, pInEnd, pOut);
+
+	while (pInEnd - pIn >= 3)
 	{
-		for(j = i; j < 3; j++)
-			char_array_3[j] = '\0';
+		UINT32 triple = ((UINT32) pIn[0] << 16) | ((UINT32) pIn[1] << 8) | pIn[2];
 
-		char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-		char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-		char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-		char_array_4[3] = char_array_3[2] & 0x3f;
+		pOut[0] = kBase64Alphabet[(triple >> 18) & 0x3F];
+		pOut[1] = kBase64Alphabet[(triple >> 12) & 0x3F];
+		pOut[2] = kBase64Alphabet[(triple >> 6) & 0x3F];
+		pOut[3] = kBase64Alphabet[triple & 0x3F];
 
-		for (j = 0; j < i + 1; j++)
-			ret += kBase64Array[char_array_4[j]];
+		pIn += 3;
+		pOut += 4;
+	}
 
-		while(i++ < 3)
-			ret += '=';
+	SIZE_T remaining = (SIZE_T) (pInEnd - pIn);
+	if (remaining)
+	{
+		UINT32 triple = (UINT32) pIn[0] << 16;
+		if (remaining == 2)
+		{
+			triple |= (UINT32) pIn[1] << 8;
+		}
+
+		pOut[0] = kBase64Alphabet[(triple >> 18) & 0x3F];
+		pOut[1] = kBase64Alphabet[(triple >> 12) & 0x3F];
+		pOut[2] = remaining == 2 ? kBase64Alphabet[(triple >> 6) & 0x3F] : '=';
+		pOut[3] = '=';
 	}
 
+	return BASE64_OK;
+}
+
+String Base64Encode(
+	LPCVOID pData,
+	SIZE_T Size )
+{
+	String ret(Base64EncodedSize(Size), '\0');
+
+	SIZE_T length;
+	Base64Encode(pData, Size, &ret[0], ret.size(), &length);
+
 	return ret;
 }
 String Base64Encode( StringRef pData )
@@ -84,53 +385,117 @@ String Base64Encode( StringRef pData )
 /*
 	Decode
 */
-String Base64Decode( 
-	LPCVOID pData, 
-	SIZE_T Size )
+BASE64_RESULT Base64Decode(
+	LPCSTR pEncoded,
+	SIZE_T EncodedSize,
+	LPVOID pBuffer,
+	SIZE_T BufferSize,
+	SIZE_T* pLengthOut)
 {
-	String ret;
+	*pLengthOut = 0;
 
-	String encoded_string( (const char *)pData );
-	int in_len = (int)encoded_string.size();
-	int i = 0;
-	int j = 0;
-	int in_ = 0;
-	BYTE char_array_4[4], char_array_3[3];
+	// Padding is required, so it always comes in fours
+	if (EncodedSize % 4)
+	{
+		return BASE64_MALFORMED;
+	}
 
-	while (in_len-- && ( encoded_string[in_] != '=') && __IsBase64(encoded_string[in_]))
+	if (!EncodedSize)
 	{
-		char_array_4[i++] = encoded_string[in_]; in_++;
-		if (i ==4)
-		{
-			for (i = 0; i <4; i++)
-				char_array_4[i] = (BYTE)kBase64Array.find(char_array_4[i]);
+		return BASE64_OK;
+	}
 
-			char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-			char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-			char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+	SIZE_T needed = Base64DecodedSize(pEncoded, EncodedSize);
+	if (BufferSize < needed)
+	{
+		*pLengthOut = needed;
+		return BASE64_BUFFER_TOO_SMALL;
+	}
+
+	const BYTE* table = GetBase64DecodeTable().Value;
+
+	// The last four characters may be padded, so they're done last
+	LPCSTR pIn = pEncoded;
+	LPCSTR pLast = pEncoded + EncodedSize - 4;
+	BYTE* pOut = (BYTE*) pBuffer;
 
-			for (i = 0; (i < 3); i++)
-				ret += char_array_3[i];
-			i = 0;
+	GetBase64Dispatch().Decode(pIn, pLast, pOut, pOut + BufferSize);
+
+	while (pIn < pLast)
+	{
+		UINT32 a = table[(BYTE) pIn[0]];
+		UINT32 b = table[(BYTE) pIn[1]];
+		UINT32 c = table[(BYTE) pIn[2]];
+		UINT32 d = table[(BYTE) pIn[3]];
+
+		// BASE64_INVALID is the only value above 63
+		if ((a | b | c | d) > 63)
+		{
+			return BASE64_MALFORMED;
 		}
+
+		UINT32 triple = (a << 18) | (b << 12) | (c << 6) | d;
+		pOut[0] = (BYTE) (triple >> 16);
+		pOut[1] = (BYTE) (triple >> 8);
+		pOut[2] = (BYTE) triple;
+
+		pIn += 4;
+		pOut += 3;
 	}
 
-	if (i)
+	//
+	// The final group. Padding can only be here, and the bits it
+	// leaves over must be zero, so each value has one encoding.
+	//
+	SIZE_T padding = EncodedSize / 4 * 3 - needed;
+
+	UINT32 a = table[(BYTE) pIn[0]];
+	UINT32 b = table[(BYTE) pIn[1]];
+	UINT32 c = padding >= 2 ? 0 : table[(BYTE) pIn[2]];
+	UINT32 d = padding >= 1 ? 0 : table[(BYTE) pIn[3]];
+
+	if ((a | b | c | d) > 63)
 	{
-		for (j = i; j <4; j++)
-			char_array_4[j] = 0;
+		return BASE64_MALFORMED;
+	}
 
-		for (j = 0; j <4; j++)
-			char_array_4[j] = (BYTE)kBase64Array.find(char_array_4[j]);
+	UINT32 triple = (a << 18) | (b << 12) | (c << 6) | d;
 
-		char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-		char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-		char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+	if ((padding == 1 && (triple & 0xFF)) ||
+		(padding == 2 && (triple & 0xFFFF)))
+	{
+		return BASE64_MALFORMED;
+	}
 
-		for (j = 0; (j < i - 1); j++)
-			ret += char_array_3[j];
+	pOut[0] = (BYTE) (triple >> 16);
+	if (padding < 2)
+	{
+		pOut[1] = (BYTE) (triple >> 8);
+	}
+	if (padding < 1)
+	{
+		pOut[2] = (BYTE) triple;
 	}
 
+	*pLengthOut = needed;
+
+	return BASE64_OK;
+}
+
+String Base64Decode(
+	LPCVOID pData,
+	SIZE_T Size )
+{
+	String ret(Base64DecodedSize((LPCSTR) pData, Size), '\0');
+
+	SIZE_T length;
+	if (Base64Decode((LPCSTR) pData, Size, &ret[0], ret.size(), &length) != BASE64_OK)
+	{
+		return String();
+	}
+
+	ret.resize(length);
+
 	return ret;
 }
 String Base64Decode( StringRef pData )
@@ -138,4 +503,4 @@ String Base64Decode( StringRef pData )
 	return Base64Decode( pData.c_str(), pData.size() );
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,398 @@
+#include "HTTP.h"
+
+#include <string.h>
+
+namespace HTTP
+{
+
+/*
+	CHUNKED TRANSFER ENCODING
+
+	chunked-body = *chunk last-chunk trailer-part CRLF
+	chunk        = chunk-size [ chunk-ext ] CRLF chunk-data CRLF
+	last-chunk   = 1*("0") [ chunk-ext ] CRLF
+
+	Everything but the chunk data goes through one byte at a time;
+	the data itself is handed back in as large a slice as we have.
+*/
+
+enum CHUNKED_STATE
+{
+	CHUNKED_STATE_SIZE,				// Reading hex digits
+	CHUNKED_STATE_EXTENSION,		// Skipping ";name=value" up to the line end
+	CHUNKED_STATE_SIZE_LF,			// Seen the '\r' after the size line
+	CHUNKED_STATE_DATA,				// Inside the chunk data
+	CHUNKED_STATE_DATA_CR,			// Expecting the '\r' after the data
+	CHUNKED_STATE_DATA_LF,			// Expecting the '\n' after the data
+	CHUNKED_STATE_TRAILER,			// At the start of a trailer line
+	CHUNKED_STATE_TRAILER_LINE,		// Skipping a trailer line
+	CHUNKED_STATE_TRAILER_LF,		// Seen the '\r' of the final blank line
+	CHUNKED_STATE_DONE,
+	CHUNKED_STATE_ERROR
+};
+
+INT HexDigitValue(CHAR c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+ChunkedDecoder::ChunkedDecoder()
+	: MaxChunkSize(16 * 1024 * 1024)
+	, MaxBodySize(1024 * 1024 * 1024)
+	, MaxOverheadSize(8 * 1024)
+{
+	Reset();
+}
+
+void ChunkedDecoder::Reset()
+{
+	m_State = CHUNKED_STATE_SIZE;
+	m_ChunkRemaining = 0;
+	m_BodySize = 0;
+	m_Digits = 0;
+	m_Overhead = 0;
+}
+
+ULONGLONG ChunkedDecoder::BodySize() const
+{
+	return m_BodySize;
+}
+
+CHUNKED_RESULT ChunkedDecoder::Decode(
+	const char* pData,
+	SIZE_T DataLength,
+	SIZE_T* pConsumedOut,
+	StringView* pSliceOut)
+{
+	SIZE_T i = 0;
+
+	pSliceOut->Data = nullptr;
+	pSliceOut->Length = 0;
+
+	while (i < DataLength && 
+		   m_State != CHUNKED_STATE_DONE && 
+		   m_State != CHUNKED_STATE_ERROR)
+	{
+		CHAR c = pData[i];
+
+		switch (m_State)
+		{
+		case CHUNKED_STATE_SIZE:
+		{
+			INT digit = HexDigitValue(c);
+			if (digit >= 0)
+			{
+				// 16 hex digits is as many as fit in 64 bits
+				if (++m_Digits > 16)
+				{
+					m_State = CHUNKED_STATE_ERROR;
+					break;
+				}
+
+				m_ChunkRemaining = (m_ChunkRemaining << 4) | (ULONGLONG) digit;
+				i++;
+				break;
+			}
+
+			if (m_Digits == 0)
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			if (c == ';' || c == ' ' || c == '\t')
+			{
+				m_Overhead = 0;
+				m_State = CHUNKED_STATE_EXTENSION;
+				i++;
+			}
+			else if (c == '\r')
+			{
+				m_State = CHUNKED_STATE_SIZE_LF;
+				i++;
+			}
+			else if (c == '\n')
+			{
+				// Bare '\n'; let CHUNKED_STATE_SIZE_LF consume it
+				m_State = CHUNKED_STATE_SIZE_LF;
+			}
+			else
+			{
+				m_State = CHUNKED_STATE_ERROR;
+			}
+
+			break;
+		}
+
+		case CHUNKED_STATE_EXTENSION:
+		{
+			// Extensions are skipped, but only up to a point
+			const char* lineEnd = (const char*) memchr(pData + i, '\n', DataLength - i);
+			SIZE_T skip = lineEnd
+				? (SIZE_T) (lineEnd - (pData + i))
+				: DataLength - i;
+
+			m_Overhead += skip;
+			if (m_Overhead > MaxOverheadSize)
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			i += skip;
+
+			if (lineEnd)
+			{
+				m_State = CHUNKED_STATE_SIZE_LF;
+			}
+
+			break;
+		}
+
+		case CHUNKED_STATE_SIZE_LF:
+		{
+			if (c != '\n')
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			i++;
+
+			if (m_ChunkRemaining > MaxChunkSize ||
+				m_ChunkRemaining > MaxBodySize - m_BodySize)
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			m_Overhead = 0;
+			m_State = m_ChunkRemaining 
+				? CHUNKED_STATE_DATA 
+				: CHUNKED_STATE_TRAILER;
+			break;
+		}
+
+		case CHUNKED_STATE_DATA:
+		{
+			SIZE_T available = DataLength - i;
+			SIZE_T take = m_ChunkRemaining < available
+				? (SIZE_T) m_ChunkRemaining
+				: available;
+
+			pSliceOut->Data = pData + i;
+			pSliceOut->Length = take;
+
+			i += take;
+			m_ChunkRemaining -= take;
+			m_BodySize += take;
+
+			if (!m_ChunkRemaining)
+			{
+				m_State = CHUNKED_STATE_DATA_CR;
+			}
+
+			*pConsumedOut = i;
+
+			return CHUNKED_DATA;
+		}
+
+		case CHUNKED_STATE_DATA_CR:
+		case CHUNKED_STATE_DATA_LF:
+		{
+			// Be lenient about a bare '\n'
+			if (c == '\r' && m_State == CHUNKED_STATE_DATA_CR)
+			{
+				m_State = CHUNKED_STATE_DATA_LF;
+			}
+			else if (c == '\n')
+			{
+				m_ChunkRemaining = 0;
+				m_Digits = 0;
+				m_State = CHUNKED_STATE_SIZE;
+			}
+			else
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			i++;
+			break;
+		}
+
+		case CHUNKED_STATE_TRAILER:
+		{
+			if (c == '\r')
+			{
+				m_State = CHUNKED_STATE_TRAILER_LF;
+			}
+			else if (c == '\n')
+			{
+				m_State = CHUNKED_STATE_DONE;
+			}
+			else
+			{
+				m_State = CHUNKED_STATE_TRAILER_LINE;
+				break;
+			}
+
+			i++;
+			break;
+		}
+
+		case CHUNKED_STATE_TRAILER_LINE:
+		{
+			const char* lineEnd = (const char*) memchr(pData + i, '\n', DataLength - i);
+			SIZE_T skip = lineEnd
+				? (SIZE_T) (lineEnd - (pData + i)) + 1
+				: DataLength - i;
+
+			m_Overhead += skip;
+			if (m_Overhead > MaxOverheadSize)
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			i += skip;
+
+			if (lineEnd)
+			{
+				m_State = CHUNKED_STATE_TRAILER;
+			}
+
+			break;
+		}
+
+		case CHUNKED_STATE_TRAILER_LF:
+		{
+			if (c != '\n')
+			{
+				m_State = CHUNKED_STATE_ERROR;
+				break;
+			}
+
+			i++;
+			m_State = CHUNKED_STATE_DONE;
+			break;
+		}
+		}
+	}
+
+	*pConsumedOut = i;
+
+	switch (m_State)
+	{
+	case CHUNKED_STATE_DONE:
+		return CHUNKED_DONE;
+	case CHUNKED_STATE_ERROR:
+		return CHUNKED_ERROR;
+	default:
+		return CHUNKED_NEED_MORE;
+	}
+}
+
+/*
+	ENCODING
+*/
+
+const CHAR kChunkTerminator[3] = "\r\n";
+
+void
+SetChunkHeader(
+	ULONGLONG ChunkSize,
+	CHUNK_HEADER* pChunkHeader)
+{
+	static const CHAR kHexDigits[] = "0123456789abcdef";
+
+	// Write the digits backwards, then move them to the front
+	CHAR digits[16];
+	BYTE count = 0;
+
+	do
+	{
+		digits[count++] = kHexDigits[ChunkSize & 0xF];
+		ChunkSize >>= 4;
+	}
+	while (ChunkSize);
+
+	BYTE i = 0;
+	while (count)
+	{
+		pChunkHeader->Data[i++] = digits[--count];
+	}
+
+	pChunkHeader->Data[i++] = '\r';
+	pChunkHeader->Data[i++] = '\n';
+	pChunkHeader->Length = i;
+}
+
+ChunkedResponseWriter::ChunkedResponseWriter(
+	SendFunc Send)
+	: m_Send(Send)
+	, m_Failed(false)
+{
+}
+
+bool ChunkedResponseWriter::Send(LPCVOID pData, SIZE_T DataLength)
+{
+	if (!m_Failed && !m_Send(pData, DataLength))
+	{
+		m_Failed = true;
+	}
+
+	return !m_Failed;
+}
+
+bool ChunkedResponseWriter::Begin(
+	StringRef Header)
+{
+	return Send(Header.c_str(), Header.size());
+}
+
+bool ChunkedResponseWriter::Write(
+	LPCVOID pData,
+	SIZE_T DataLength)
+{
+	if (!DataLength)
+	{
+		return !m_Failed;
+	}
+
+	CHUNK_HEADER header;
+	SetChunkHeader(DataLength, &header);
+
+	return
+		Send(header.Data, header.Length) &&
+		Send(pData, DataLength) &&
+		Send(kChunkTerminator, 2);
+}
+
+bool ChunkedResponseWriter::Finish()
+{
+	return Send("0\r\n\r\n", 5);
+}
+
+bool ChunkedResponseWriter::Finish(
+	StringTableRef Trailers)
+{
+	String last = "0\r\n";
+
+	for (auto t = std::begin(Trailers); t != std::end(Trailers); ++t)
+	{
+		last += t->first;
+		last += ": ";
+		last += t->second;
+		last += "\r\n";
+	}
+
+	last += "\r\n";
+
+	return Send(last.c_str(), last.size());
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+//
+// Shared by the library's own .cpp files; not part of the 
+// public API.
+//
+
+#include "HTTP.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#	define HTTP_X86 1
+#	include <emmintrin.h>
+#	include <immintrin.h>
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#	endif
+#endif
+
+//
+// GCC and Clang only let you use intrinsics above the baseline
+// instruction set inside functions marked for them. MSVC lets 
+// you use them anywhere.
+//
+#if defined(__GNUC__)
+#	define HTTP_TARGET(x) __attribute__((target(x)))
+#else
+#	define HTTP_TARGET(x)
+#endif
+
+namespace HTTP
+{
+
+//
+// What the CPU we're running on supports. Detected once.
+//
+struct CPU_FEATURES
+{
+	bool SSE2;
+	bool SSSE3;
+	bool SSE41;
+	bool AVX2;		// Only set if the OS saves the YMM registers too
+	bool SHA;
+};
+
+const CPU_FEATURES& GetCPUFeatures();
+
+//
+// Scanning for delimiters in request headers. Each of these 
+// returns the first byte in [begin, end) that stops the scan, 
+// or end if there isn't one. None of them care about locale.
+//
+// SCAN_LINE:   '\n'
+// SCAN_TOKEN:  ':', space, control characters and DEL. Used
+//              for header names.
+// SCAN_WORD:   Space, control characters and DEL. Used for the
+//              request URI.
+// SCAN_VALUE:  Control characters other than tab, and DEL. Used
+//              for header values.
+//
+enum SCAN_MODE
+{
+	SCAN_LINE,
+	SCAN_TOKEN,
+	SCAN_WORD,
+	SCAN_VALUE,
+
+	SCAN_MODE_COUNT
+};
+
+//
+// Writes Value in decimal without a terminating NUL and returns
+// the number of characters written (at most 20).
+//
+SIZE_T FormatDecimal(
+	_In_ ULONGLONG Value,
+	_Out_writes_to_(20, return) LPSTR pOut);
+
+//
+// SHA-1, for the WebSocket handshake. Uses the SHA extensions
+// when the CPU has them.
+//
+#define SHA1_DIGEST_SIZE	20
+#define SHA1_BLOCK_SIZE		64
+
+struct SHA1_CONTEXT
+{
+	UINT32 State[5];
+	ULONGLONG Length;
+	BYTE Buffer[SHA1_BLOCK_SIZE];
+	SIZE_T BufferLength;
+};
+
+void Sha1Init(
+	_Out_ SHA1_CONTEXT* pContext);
+
+void Sha1Update(
+	_Inout_ SHA1_CONTEXT* pContext,
+	_In_reads_bytes_(DataLength) LPCVOID pData,
+	_In_ SIZE_T DataLength);
+
+void Sha1Final(
+	_Inout_ SHA1_CONTEXT* pContext,
+	_Out_writes_(SHA1_DIGEST_SIZE) LPBYTE pDigest);
+
+//
+// Close, ping and pong frames have the top bit of the opcode set.
+// They can't be fragmented and carry at most 125 bytes.
+//
+#define WS_CONTROL_OPCODE		0x8
+#define WS_MAX_CONTROL_PAYLOAD	125
+
+bool IsControlOpCode(
+	_In_ INT OpCode);
+
+//
+// Whether a peer may send Code in a close frame (RFC 6455 7.4):
+// the ones the RFC defines, less those that only describe a close
+// locally (1005, 1006, 1015), and those for applications, 3000 to
+// 4999. The rest are reserved.
+//
+bool IsValidCloseReason(
+	_In_ INT Code);
+
+const char* ScanFor(
+	_In_ SCAN_MODE Mode,
+	_In_reads_(end - begin) const char* begin,
+	_In_ const char* end);
+
+}
@@ -1,9 +1,12 @@
-#include "HTTP.h"
+#include "HTTPInternal.h"
 #include <assert.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <map>
+#include <vector>
+#include <memory>
 
 namespace HTTP
 {
@@ -11,33 +14,190 @@ namespace HTTP
 /*
 	REQUEST INTERNALS
 */
+
+// A run of characters inside the raw header. It's stored as an
+// offset from REQUEST_DATA::Base rather than a pointer, so it 
+// stays valid if the buffer holding the header moves.
+struct STRING_SPAN
+{
+	UINT32 Offset;
+	UINT32 Length;
+};
+
+struct HEADER_SPAN
+{
+	STRING_SPAN Key;
+	STRING_SPAN Value;
+};
+
+/*
+	HEADER TABLE
+
+	Most requests have somewhere between 10 and 30 headers, so the
+	first kInlineHeaders of them live in the table itself and only
+	the rest spill onto the heap. Each HEADER_ID also gets a slot
+	holding the index of its (last) entry, so the common headers
+	are found without a search.
+*/
+const SIZE_T kInlineHeaders = 32;
+const USHORT kNoSlot = 0xFFFF;
+
+struct HEADER_TABLE
+{
+	HEADER_TABLE()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		Count = 0;
+		Overflow.clear();
+
+		for (INT i = 0; i < HEADER_ID_COUNT; ++i)
+		{
+			Slots[i] = kNoSlot;
+		}
+	}
+
+	SIZE_T Size() const
+	{
+		return Count;
+	}
+
+	const HEADER_SPAN& operator[](SIZE_T Index) const
+	{
+		assert(Index < Count);
+
+		return Index < kInlineHeaders
+			? Inline[Index]
+			: Overflow[Index - kInlineHeaders];
+	}
+
+	void Add(HEADER_ID Id, const HEADER_SPAN& Header)
+	{
+		if (Count < kInlineHeaders)
+		{
+			Inline[Count] = Header;
+		}
+		else
+		{
+			Overflow.push_back(Header);
+		}
+
+		if (Id != HEADER_UNKNOWN && Count < kNoSlot)
+		{
+			Slots[Id] = (USHORT) Count;
+		}
+
+		Count++;
+	}
+
+	const HEADER_SPAN* Find(HEADER_ID Id) const
+	{
+		return Slots[Id] != kNoSlot 
+			? &(*this)[Slots[Id]] 
+			: nullptr;
+	}
+
+	HEADER_SPAN Inline[kInlineHeaders];
+	std::vector<HEADER_SPAN> Overflow;
+	SIZE_T Count;
+	USHORT Slots[HEADER_ID_COUNT];
+};
+
 struct REQUEST_DATA
 {
 	REQUEST_DATA()
-		: Method(METHOD_GET)
-		, Protocol(PROTOCOL_HTTP_1_1)
-		, AuthMode(AUTH_NONE)
 	{
+		Reset();
+	}
+
+	// Keeps the capacity of Headers around for the next request
+	void Reset()
+	{
+		Method = METHOD_GET;
+		Protocol = PROTOCOL_HTTP_1_1;
+		AuthMode = AUTH_NONE;
+		AuthUser.clear();
+		AuthPassword.clear();
+
+		Buffer.reset();
+		Base = nullptr;
+		ResourceURISpan.Offset = 0;
+		ResourceURISpan.Length = 0;
+		Headers.Clear();
+
+		HaveStrings = false;
+		ResourceURI.clear();
+		Header.clear();
+	}
+
+	STRING_SPAN Span(const char* begin, const char* end) const
+	{
+		STRING_SPAN span;
+		span.Offset = (UINT32) (begin - Base);
+		span.Length = (UINT32) (end - begin);
+		return span;
+	}
+
+	StringView View(STRING_SPAN span) const
+	{
+		StringView view;
+		view.Data = Base + span.Offset;
+		view.Length = span.Length;
+		return view;
+	}
+
+	// The std::string versions of the URI and header table are 
+	// only built if somebody asks for them.
+	void BuildStrings()
+	{
+		if (HaveStrings)
+		{
+			return;
+		}
+
+		ResourceURI = View(ResourceURISpan).ToString();
+
+		for (SIZE_T i = 0; i < Headers.Size(); ++i)
+		{
+			Header[View(Headers[i].Key).ToString()] = View(Headers[i].Value).ToString();
+		}
+
+		HaveStrings = true;
 	}
 
 	METHOD Method;
 	PROTOCOL Protocol;
 	AUTH_MODE AuthMode;
-	String ResourceURI;
 	String AuthUser;
 	String AuthPassword;
+
+	// The raw header text. All of the spans point into this.
+	std::shared_ptr<const char> Buffer;
+	const char* Base;
+	STRING_SPAN ResourceURISpan;
+	HEADER_TABLE Headers;
+
+	bool HaveStrings;
+	String ResourceURI;
 	StringTable Header;
 };
 
 /*
 	PARSING
+
+	The helpers below work on a single line, bounded by [cursor, end).
+	The line ending has already been stripped by the time they see it.
 */
 
-bool Parse(const char*& cursor, const char* compare)
+bool Parse(const char*& cursor, const char* end, const char* compare)
 {
-	int compLen = strlen(compare);
+	SIZE_T compLen = strlen(compare);
 
-	if (strncmp(cursor, compare, compLen) == 0)
+	if ((SIZE_T)(end - cursor) >= compLen &&
+		strncmp(cursor, compare, compLen) == 0)
 	{
 		cursor += compLen;
 		return true;
@@ -46,41 +206,33 @@ bool Parse(const char*& cursor, const char* compare)
 	return false;
 }
 
-void EatSpaces(const char*& cursor)
+// Optional whitespace: just spaces and tabs. Everything else is
+// either part of a token or rejected by the scanners.
+void EatSpaces(const char*& cursor, const char* end)
 {
 	while (
-		*cursor &&
-		*cursor != '\r' &&
-		*cursor != '\n' && 
-		isspace(*cursor)) 
+		cursor < end &&
+		(*cursor == ' ' || *cursor == '\t')) 
 	{ 
 		cursor++; 
 	}
 }
 
-const char* FindNextWhiteSpace(const char* cursor)
+// Returns the '\n' that ends the line, or end if there's no '\n'.
+const char* FindEndOfLine(const char* cursor, const char* end)
 {
-	while (*cursor && !isspace(*cursor)) 
-	{ 
-		cursor++; 
-	}
-
-	return cursor;
+	return ScanFor(SCAN_LINE, cursor, end);
 }
 
-bool ExpectNewLine(const char*& cursor)
+// Lines may end in either "\n" or "\r\n"; this strips the '\r'.
+const char* TrimLineEnding(const char* begin, const char* end)
 {
-	if (cursor[0] == '\n')
+	if (end > begin && end[-1] == '\r')
 	{
-		cursor++;
-		return true;
+		return end - 1;
 	}
-	if (cursor[0] == '\r' && cursor[1] == '\n')
-	{
-		cursor += 2;
-		return true;
-	}
-	return false;
+
+	return end;
 }
 
 void CopyIntoStdString(const char* begin, const char* end, String& out)
@@ -91,76 +243,144 @@ void CopyIntoStdString(const char* begin, const char* end, String& out)
 	memcpy((char *)out.c_str(), begin, length);
 }
 
-String GetWord(const char*& cursor)
+/*
+	FIRST LINE
+
+	The method (plus the space after it) and the protocol are all
+	8 bytes or less, so they're matched by loading up to 8 bytes 
+	of the line into a word and comparing it against constants 
+	worked out at compile time.
+*/
+
+// Packs up to 8 characters into a word, first character in the 
+// lowest byte.
+constexpr UINT64 PackWord(const char* s, SIZE_T i = 0)
 {
-	assert(!isspace(*cursor));
+	return (i == 8 || s[i] == 0) 
+		? 0 
+		: ((UINT64) (BYTE) s[i] << (8 * i)) | PackWord(s, i + 1);
+}
 
-	const char* begin = cursor;
+// Selects the first Length bytes of a packed word
+constexpr UINT64 PackMask(SIZE_T Length)
+{
+	return Length >= 8 ? ~0ULL : (1ULL << (8 * Length)) - 1;
+}
 
-	cursor = FindNextWhiteSpace(cursor);
+UINT64 LoadWord(const char* cursor, const char* end)
+{
+	BYTE bytes[8] = { 0 };
+	SIZE_T count = (SIZE_T) (end - cursor) < 8 ? (SIZE_T) (end - cursor) : 8;
 
-	String out;
-	CopyIntoStdString(begin, cursor, out);
+	memcpy(bytes, cursor, count);
 
-	return out;
+	UINT64 word = 0;
+	for (SIZE_T i = 0; i < 8; ++i)
+	{
+		word |= (UINT64) bytes[i] << (8 * i);
+	}
+
+	return word;
 }
 
-/*
-	FIRST LINE
-*/
+// Includes the space that must follow the method
+#define MATCH_METHOD(name, method) \
+	if ((word & PackMask(sizeof(name))) == PackWord(name " ")) \
+	{ \
+		*pMethod = method; \
+		*pLength = sizeof(name); \
+		return true; \
+	}
+
+bool MatchMethod(UINT64 word, METHOD* pMethod, SIZE_T* pLength)
+{
+	switch ((BYTE) word)
+	{
+	case 'G':
+		MATCH_METHOD("GET", METHOD_GET);
+		break;
+	case 'P':
+		MATCH_METHOD("POST", METHOD_POST);
+		MATCH_METHOD("PUT", METHOD_PUT);
+		MATCH_METHOD("PATCH", METHOD_PATCH);
+		break;
+	case 'H':
+		MATCH_METHOD("HEAD", METHOD_HEAD);
+		break;
+	case 'D':
+		MATCH_METHOD("DELETE", METHOD_DELETE);
+		break;
+	case 'O':
+		MATCH_METHOD("OPTIONS", METHOD_OPTIONS);
+		break;
+	case 'C':
+		MATCH_METHOD("CONNECT", METHOD_CONNECT);
+		break;
+	case 'T':
+		MATCH_METHOD("TRACE", METHOD_TRACE);
+		break;
+	}
+
+	return false;
+}
+
+#undef MATCH_METHOD
 
 REQUEST_PARSE_RESULT
 ParseRequestHeader(
 	const char*& cursor,
+	const char* end,
 	REQUEST_DATA* out)
 {
 	// 
-	// The first token is either GET or POST. Check for this.
+	// The first token is the method, followed by a space.
 	// 
-	INT methodIndex = 0;
-	LPCSTR methodName = nullptr;
-	while ((methodName = MethodToString((METHOD)methodIndex)) != nullptr)
-	{
-		if (Parse(cursor, methodName))
-		{
-			out->Method = (METHOD)methodIndex;
-			break;
-		}
-
-		methodIndex++;
-	}
-	
-	if (methodName == nullptr)
+	SIZE_T methodLength = 0;
+	if (!MatchMethod(LoadWord(cursor, end), &out->Method, &methodLength))
 	{
 		return REQUEST_PARSE_UNKNOWN_METHOD;
 	}
 
-	EatSpaces(cursor);
+	cursor += methodLength;
+
+	EatSpaces(cursor, end);
 
 	// 
 	// The next token is the requested resource.
 	// 
-	out->ResourceURI = GetWord(cursor);
+	const char* uri = cursor;
+	cursor = ScanFor(SCAN_WORD, cursor, end);
+	out->ResourceURISpan = out->Span(uri, cursor);
 
-	EatSpaces(cursor);
+	// The URI can only be followed by whitespace
+	if (cursor < end && *cursor != ' ' && *cursor != '\t')
+	{
+		return REQUEST_PARSE_MALFORMED;
+	}
+
+	EatSpaces(cursor, end);
 
 	// 
-	// Finally, the protocol. If it isn't HTTP/1.1, reject.
+	// Finally, the protocol. If it isn't HTTP/1.0 or 1.1, reject.
 	// 
-	if (Parse(cursor, "HTTP/1.0"))
+	UINT64 protocol = (end - cursor >= 8) ? LoadWord(cursor, end) : 0;
+	if (protocol == PackWord("HTTP/1.1"))
 	{
-		out->Protocol = PROTOCOL_HTTP_1_0;
+		out->Protocol = PROTOCOL_HTTP_1_1;
 	}
-	else if (Parse(cursor, "HTTP/1.1"))
+	else if (protocol == PackWord("HTTP/1.0"))
 	{
-		out->Protocol = PROTOCOL_HTTP_1_1;
+		out->Protocol = PROTOCOL_HTTP_1_0;
 	}
 	else
 	{
 		return REQUEST_PARSE_UNKNOWN_PROTOCOL;
 	}
 
-	if (!ExpectNewLine(cursor)) 
+	cursor += 8;
+
+	// Nothing else is allowed on the line
+	if (cursor != end) 
 	{
 		return REQUEST_PARSE_MALFORMED;
 	}
@@ -174,52 +394,45 @@ ParseRequestHeader(
 REQUEST_PARSE_RESULT 
 ParseKeyValuePair(
 	const char*& cursor,
-	String& keyOut,
-	String& valueOut)
+	const char* end,
+	StringView& keyOut,
+	StringView& valueOut)
 {
 	//
-	// Consume letters until the first :
+	// Consume letters until the first :. Whitespace and control
+	// characters aren't allowed in the key.
 	//
 	const char* key = cursor;
-	while (
-		*cursor && 
-		*cursor != ':' && 
-		*cursor != '\r' && 
-		*cursor != '\n')
-	{
-		// Sanity check
-		if (isspace(*cursor)) 
-		{
-			return REQUEST_PARSE_MALFORMED;
-		}
+	cursor = ScanFor(SCAN_TOKEN, cursor, end);
 
-		cursor++;
+	if (cursor < end && *cursor != ':')
+	{
+		return REQUEST_PARSE_MALFORMED;
 	}
 
-	CopyIntoStdString(key, cursor, keyOut);
+	keyOut.Data = key;
+	keyOut.Length = (SIZE_T) (cursor - key);
 
 	// Skip the :
-	cursor++;
+	if (cursor < end)
+	{
+		cursor++;
+	}
 
-	EatSpaces(cursor);
+	EatSpaces(cursor, end);
 
-	// Extract the value
+	// Extract the value. Control characters (e.g. a stray '\r')
+	// can't appear in here, but tabs can.
 	const char* value = cursor;
-	while (
-		*cursor && 
-		*cursor != '\r' && 
-		*cursor != '\n')
+	cursor = ScanFor(SCAN_VALUE, cursor, end);
+
+	if (cursor != end)
 	{
-		cursor++;
+		return REQUEST_PARSE_MALFORMED;
 	}
 
-	CopyIntoStdString(value, cursor, valueOut);
-
-	ExpectNewLine(cursor);
-	//if (!ExpectNewLine(cursor)) 
-	//{
-	//	return REQUEST_PARSE_MALFORMED;
-	//}
+	valueOut.Data = value;
+	valueOut.Length = (SIZE_T) (cursor - value);
 
 	return REQUEST_PARSE_OK;
 }
@@ -229,22 +442,30 @@ ParseKeyValuePair(
 */
 bool DecodeAuth(
 	const char* authString,
+	const char* end,
 	REQUEST_DATA* out)
 {
 	const char* cursor = authString;
 
 	// Ensure it's "Basic"
-	if (!Parse(cursor, "Basic"))
+	if (!Parse(cursor, end, "Basic"))
 	{
 		return false;
 	}
 
-	EatSpaces(cursor);
+	EatSpaces(cursor, end);
 
 	// Decode the message
-	String credentials = Base64Decode(
-		cursor,
-		(SIZE_T) strlen(cursor));
+	SIZE_T encodedSize = (SIZE_T) (end - cursor);
+	String credentials(Base64DecodedSize(cursor, encodedSize), '\0');
+
+	SIZE_T length;
+	if (Base64Decode(cursor, encodedSize, &credentials[0], credentials.size(), &length) != BASE64_OK)
+	{
+		return false;
+	}
+
+	credentials.resize(length);
 
 	// Split it 
 	String::size_type colonPos = credentials.find(':');
@@ -255,6 +476,166 @@ bool DecodeAuth(
 	return true;
 }
 
+/*
+	HEADER LINES
+*/
+REQUEST_PARSE_RESULT
+ParseHeaderLine(
+	const char* cursor,
+	const char* end,
+	REQUEST_DATA* out)
+{
+	// 
+	// Extract the key and value from the string.
+	// 
+	StringView key, value;
+	REQUEST_PARSE_RESULT lineResult = ParseKeyValuePair(
+		cursor, 
+		end,
+		key,
+		value);
+	if (lineResult != REQUEST_PARSE_OK)
+	{
+		return lineResult;
+	}
+
+	HEADER_ID id = HeaderIdFromString(key.Data, key.Length);
+
+	//
+	// The authorization information shouldn't go into the Header array
+	//
+	if (id == HEADER_AUTHORIZATION)
+	{
+		if (!DecodeAuth(value.Data, value.Data + value.Length, out))
+		{
+			return REQUEST_PARSE_MALFORMED_AUTH;
+		}
+
+		return REQUEST_PARSE_OK;
+	}
+
+	//
+	// Repeats that disagree could be framed differently by anything
+	// in front of us that takes the first one (RFC 9112 6.3).
+	//
+	if (id == HEADER_CONTENT_LENGTH)
+	{
+		const HEADER_SPAN* previous = out->Headers.Find(id);
+		if (previous)
+		{
+			StringView length = out->View(previous->Value);
+			if (length.Length != value.Length ||
+				memcmp(length.Data, value.Data, value.Length) != 0)
+			{
+				return REQUEST_PARSE_MALFORMED_CONTENT;
+			}
+		}
+	}
+
+	HEADER_SPAN header;
+	header.Key = out->Span(key.Data, key.Data + key.Length);
+	header.Value = out->Span(value.Data, value.Data + value.Length);
+	out->Headers.Add(id, header);
+
+	return REQUEST_PARSE_OK;
+}
+
+/*
+	HEADER BLOCK
+
+	Parses everything up to and including the blank line. If end 
+	is null the data is NUL-terminated, and (as RequestHeader::Parse
+	always has) running into the NUL is treated as the end of the
+	header. Otherwise running into end means we need more data.
+*/
+REQUEST_PARSE_RESULT
+ParseHeaderBlock(
+	const char* begin,
+	const char* end,
+	REQUEST_DATA* out,
+	const char** pBodyOut)
+{
+	const char* cursor = begin;
+
+	// NUL-terminated data is measured once, so that both kinds
+	// are scanned for line endings the same way.
+	const char* limit = end ? end : begin + strlen(begin);
+
+	// 
+	// Parse the first line for the method, protocol and URI
+	// 
+	const char* lineEnd = FindEndOfLine(cursor, limit);
+	if (end && lineEnd == end)
+	{
+		return REQUEST_PARSE_INCOMPLETE;
+	}
+
+	REQUEST_PARSE_RESULT headerResult = ParseRequestHeader(
+		cursor,
+		TrimLineEnding(cursor, lineEnd),
+		out);
+	if (headerResult != REQUEST_PARSE_OK)
+	{
+		return headerResult;
+	}
+
+	if (*lineEnd != '\n')
+	{
+		return REQUEST_PARSE_MALFORMED;
+	}
+
+	cursor = lineEnd + 1;
+
+	// 
+	// Now we're looking at a dictionary of possible keys and values.
+	// 
+	for (;;)
+	{
+		if (cursor == limit)
+		{
+			if (end)
+			{
+				return REQUEST_PARSE_INCOMPLETE;
+			}
+
+			break;
+		}
+
+		lineEnd = FindEndOfLine(cursor, limit);
+		if (end && lineEnd == end)
+		{
+			return REQUEST_PARSE_INCOMPLETE;
+		}
+
+		const char* contentEnd = TrimLineEnding(cursor, lineEnd);
+		const char* nextLine = lineEnd != limit ? lineEnd + 1 : lineEnd;
+
+		// 
+		// An empty line means it's the end of the header block.
+		// 
+		if (contentEnd == cursor)
+		{
+			cursor = nextLine;
+			break;
+		}
+
+		REQUEST_PARSE_RESULT lineResult = ParseHeaderLine(
+			cursor,
+			contentEnd,
+			out);
+		if (lineResult != REQUEST_PARSE_OK)
+		{
+			return lineResult;
+		}
+
+		cursor = nextLine;
+	}
+
+	*pBodyOut = cursor;
+
+	return REQUEST_PARSE_OK;
+}
+
 /*
 	REQUEST IMPLEMENTATION
 */
@@ -280,6 +661,7 @@ PROTOCOL RequestHeader::Protocol() const
 
 StringRef RequestHeader::ResourceURI() const
 {
+	m_pData->BuildStrings();
 	return m_pData->ResourceURI;
 }
 
@@ -300,9 +682,168 @@ StringRef RequestHeader::AuthPassword() const
 
 StringTableRef RequestHeader::Header() const
 {
+	m_pData->BuildStrings();
 	return m_pData->Header;
 }
 
+StringView RequestHeader::ResourceURIView() const
+{
+	return m_pData->View(m_pData->ResourceURISpan);
+}
+
+SIZE_T RequestHeader::HeaderCount() const
+{
+	return m_pData->Headers.Size();
+}
+
+StringView RequestHeader::HeaderKey(SIZE_T Index) const
+{
+	return m_pData->View(m_pData->Headers[Index].Key);
+}
+
+StringView RequestHeader::HeaderValue(SIZE_T Index) const
+{
+	return m_pData->View(m_pData->Headers[Index].Value);
+}
+
+bool RequestHeader::FindHeader(
+	LPCSTR Key,
+	StringView* pValueOut) const
+{
+	HEADER_ID id = HeaderIdFromString(Key, strlen(Key));
+	if (id != HEADER_UNKNOWN)
+	{
+		return FindHeader(id, pValueOut);
+	}
+
+	// Search backwards so repeated keys behave like Header(), 
+	// where the last one wins.
+	for (SIZE_T i = m_pData->Headers.Size(); i-- > 0; )
+	{
+		if (m_pData->View(m_pData->Headers[i].Key).EqualsNoCase(Key))
+		{
+			if (pValueOut)
+			{
+				*pValueOut = m_pData->View(m_pData->Headers[i].Value);
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool RequestHeader::FindHeader(
+	HEADER_ID Id,
+	StringView* pValueOut) const
+{
+	if (Id < 0 || Id >= HEADER_ID_COUNT)
+	{
+		return false;
+	}
+
+	const HEADER_SPAN* header = m_pData->Headers.Find(Id);
+	if (!header)
+	{
+		return false;
+	}
+
+	if (pValueOut)
+	{
+		*pValueOut = m_pData->View(header->Value);
+	}
+
+	return true;
+}
+
+bool RequestHeader::KeepAlive() const
+{
+	StringView connection;
+	bool haveConnection = FindHeader(HEADER_CONNECTION, &connection);
+
+	if (m_pData->Protocol == PROTOCOL_HTTP_1_0)
+	{
+		return haveConnection && connection.ContainsToken("keep-alive");
+	}
+
+	return !haveConnection || !connection.ContainsToken("close");
+}
+
+bool RequestHeader::Chunked() const
+{
+	StringView value;
+	if (!FindHeader(HEADER_TRANSFER_ENCODING, &value))
+	{
+		return false;
+	}
+
+	// Only the final coding counts, e.g. "gzip, chunked"
+	SIZE_T end = value.Length;
+	while (end > 0 && (value.Data[end - 1] == ' ' || value.Data[end - 1] == '\t'))
+	{
+		end--;
+	}
+
+	SIZE_T begin = end;
+	while (begin > 0 && value.Data[begin - 1] != ',')
+	{
+		begin--;
+	}
+
+	while (begin < end && (value.Data[begin] == ' ' || value.Data[begin] == '\t'))
+	{
+		begin++;
+	}
+
+	StringView last = { value.Data + begin, end - begin };
+	return last.EqualsNoCase("chunked");
+}
+
+bool RequestHeader::ContentLength(
+	ULONGLONG* pLengthOut) const
+{
+	StringView value;
+	if (!FindHeader(HEADER_CONTENT_LENGTH, &value) || !value.Length)
+	{
+		return false;
+	}
+
+	ULONGLONG length = 0;
+	SIZE_T i = 0;
+
+	for (; i < value.Length && value.Data[i] >= '0' && value.Data[i] <= '9'; ++i)
+	{
+		ULONGLONG digit = (ULONGLONG) (value.Data[i] - '0');
+
+		// Overflow
+		if (length > (~0ULL - digit) / 10)
+		{
+			return false;
+		}
+
+		length = length * 10 + digit;
+	}
+
+	// No digits, or something other than trailing whitespace after them
+	if (i == 0)
+	{
+		return false;
+	}
+
+	for (; i < value.Length; ++i)
+	{
+		if (value.Data[i] != ' ' && value.Data[i] != '\t')
+		{
+			return false;
+		}
+	}
+
+	*pLengthOut = length;
+
+	return true;
+}
+
 /*
 	PARSING
 */
@@ -311,69 +852,308 @@ RequestHeader::Parse(
 	const char* pRequestData,
 	SIZE_T* pPostDataOffsetOut)
 {
-	*m_pData = REQUEST_DATA();
-
-	const char* cursor = (const char *) pRequestData;
+	m_pData->Reset();
+	m_pData->Base = pRequestData;
+
+	const char* body = nullptr;
+	REQUEST_PARSE_RESULT result = ParseHeaderBlock(
+		pRequestData,
+		nullptr,
+		m_pData,
+		&body);
+	if (result != REQUEST_PARSE_OK)
+	{
+		return result;
+	}
 
 	// 
-	// Parse the first line for the method, protocol and URI
+	// We don't own the caller's data, so take a single copy of
+	// the header for the spans to point into.
 	// 
-	REQUEST_PARSE_RESULT headerResult = ParseRequestHeader(
-		cursor,
-		m_pData);
-	if (headerResult != REQUEST_PARSE_OK)
+	SIZE_T headerSize = (SIZE_T) (body - pRequestData);
+	std::shared_ptr<String> copy = std::make_shared<String>(pRequestData, headerSize);
+
+	m_pData->Buffer = std::shared_ptr<const char>(copy, copy->c_str());
+	m_pData->Base = m_pData->Buffer.get();
+
+	if (pPostDataOffsetOut)
 	{
-		return headerResult;
+		*pPostDataOffsetOut = headerSize;
 	}
 
-	// 
-	// Now we're looking at a dictionary of possible keys and values.
-	// 
-	while (*cursor)
+	return REQUEST_PARSE_OK;
+}
+
+REQUEST_PARSE_RESULT
+RequestHeader::ParseInPlace(
+	std::shared_ptr<const char> Buffer,
+	SIZE_T BufferSize,
+	SIZE_T* pPostDataOffsetOut)
+{
+	m_pData->Reset();
+	m_pData->Base = Buffer.get();
+
+	const char* body = nullptr;
+	REQUEST_PARSE_RESULT result = ParseHeaderBlock(
+		Buffer.get(),
+		Buffer.get() + BufferSize,
+		m_pData,
+		&body);
+	if (result != REQUEST_PARSE_OK)
+	{
+		return result;
+	}
+
+	m_pData->Buffer = std::move(Buffer);
+
+	if (pPostDataOffsetOut)
 	{
+		*pPostDataOffsetOut = (SIZE_T) (body - m_pData->Base);
+	}
+
+	return REQUEST_PARSE_OK;
+}
+
+/*
+	INCREMENTAL PARSING
+*/
+RequestParser::RequestParser()
+	: MaxHeaderSize(64 * 1024)
+{
+	Reset();
+}
+
+void RequestParser::Reset()
+{
+	m_Request.m_pData->Reset();
+	m_Buffer.clear();
+	m_LineOffset = 0;
+	m_HaveRequestLine = false;
+	m_State = REQUEST_FEED_NEED_MORE;
+	m_Error = REQUEST_PARSE_OK;
+}
+
+REQUEST_PARSE_RESULT RequestParser::Error() const
+{
+	return m_Error;
+}
+
+const RequestHeader& RequestParser::Request() const
+{
+	return m_Request;
+}
+
+REQUEST_FEED_RESULT RequestParser::ParseLine(
+	const char* begin,
+	const char* end)
+{
+	REQUEST_PARSE_RESULT result = REQUEST_PARSE_OK;
+
+	if (!m_HaveRequestLine)
+	{
+		// Be lenient about blank lines before the request, 
+		// e.g. a stray CRLF after the previous request's body.
+		if (begin == end)
+		{
+			return REQUEST_FEED_NEED_MORE;
+		}
+
+		result = ParseRequestHeader(begin, end, m_Request.m_pData);
+		m_HaveRequestLine = true;
+	}
+	else if (begin == end)
+	{
+		return REQUEST_FEED_DONE;
+	}
+	else
+	{
+		result = ParseHeaderLine(begin, end, m_Request.m_pData);
+	}
+
+	if (result != REQUEST_PARSE_OK)
+	{
+		m_Error = result;
+		return REQUEST_FEED_ERROR;
+	}
+
+	return REQUEST_FEED_NEED_MORE;
+}
+
+REQUEST_FEED_RESULT
+RequestParser::Feed(
+	const char* pData,
+	SIZE_T DataLength,
+	SIZE_T* pConsumedOut)
+{
+	REQUEST_DATA* request = m_Request.m_pData;
+	SIZE_T consumed = 0;
+
+	while (m_State == REQUEST_FEED_NEED_MORE && consumed < DataLength)
+	{
+		const char* chunk = pData + consumed;
+		SIZE_T remaining = DataLength - consumed;
+
 		// 
-		// An empty line means it's the end of the header block.
+		// Only the new bytes are searched for the end of the line.
 		// 
-		if (ExpectNewLine(cursor))
+		const char* newLine = ScanFor(SCAN_LINE, chunk, chunk + remaining);
+		if (newLine == chunk + remaining)
 		{
+			newLine = nullptr;
+		}
+
+		SIZE_T take = newLine 
+			? (SIZE_T) (newLine - chunk) + 1 
+			: remaining;
+
+		if (m_Buffer.size() + take > MaxHeaderSize)
+		{
+			m_Error = REQUEST_PARSE_TOO_LARGE;
+			m_State = REQUEST_FEED_ERROR;
 			break;
 		}
 
 		// 
-		// Extract the key and value from the string.
+		// The caller is free to throw away what we've consumed, so
+		// the header is kept here. The spans are offsets, so it 
+		// doesn't matter if appending moves the buffer.
 		// 
-		String key, value;
-		REQUEST_PARSE_RESULT lineResult = ParseKeyValuePair(
-			cursor, 
-			key,
-			value);
-		if (lineResult != REQUEST_PARSE_OK)
+		m_Buffer.append(chunk, take);
+		request->Base = m_Buffer.c_str();
+		consumed += take;
+
+		if (!newLine)
 		{
-			return lineResult;
+			break;
 		}
 
-		//
-		// The authorization information shouldn't go into the Header array
-		//
-		if (key == "Authorization")
+		const char* lineBegin = request->Base + m_LineOffset;
+		const char* lineEnd = request->Base + m_Buffer.size() - 1;
+
+		m_State = ParseLine(lineBegin, TrimLineEnding(lineBegin, lineEnd));
+		m_LineOffset = m_Buffer.size();
+	}
+
+	if (m_State == REQUEST_FEED_DONE && !request->Buffer)
+	{
+		// Hand the header over to the request.
+		std::shared_ptr<String> header = std::make_shared<String>();
+		header->swap(m_Buffer);
+
+		request->Buffer = std::shared_ptr<const char>(header, header->c_str());
+		request->Base = request->Buffer.get();
+	}
+
+	*pConsumedOut = consumed;
+
+	return m_State;
+}
+
+/*
+	PIPELINING
+*/
+SIZE_T
+ParseRequestBatch(
+	std::shared_ptr<const char> Buffer,
+	SIZE_T BufferSize,
+	RequestHeader* pRequests,
+	REQUEST_BATCH_ENTRY* pEntries,
+	SIZE_T MaxRequests,
+	SIZE_T* pConsumedOut)
+{
+	const char* base = Buffer.get();
+	SIZE_T offset = 0;
+	SIZE_T count = 0;
+
+	while (count < MaxRequests && offset < BufferSize)
+	{
+		// 
+		// Clients may send a stray CRLF between requests.
+		// 
+		SIZE_T start = offset;
+		while (start < BufferSize && (base[start] == '\r' || base[start] == '\n'))
+		{
+			start++;
+		}
+
+		if (start == BufferSize)
 		{
-			if (!DecodeAuth(value.c_str(), m_pData))
+			offset = start;
+			break;
+		}
+
+		// 
+		// The request shares ownership of the whole buffer, but
+		// its views start where it does.
+		// 
+		RequestHeader& request = pRequests[count];
+		REQUEST_BATCH_ENTRY& entry = pEntries[count];
+
+		SIZE_T bodyOffset = 0;
+		REQUEST_PARSE_RESULT result = request.ParseInPlace(
+			std::shared_ptr<const char>(Buffer, base + start),
+			BufferSize - start,
+			&bodyOffset);
+		if (result == REQUEST_PARSE_INCOMPLETE)
+		{
+			break;
+		}
+
+		ZeroMemory(&entry, sizeof(entry));
+		entry.Result = result;
+		entry.Offset = start;
+		entry.BodyOffset = start + bodyOffset;
+
+		if (result != REQUEST_PARSE_OK)
+		{
+			count++;
+			break;
+		}
+
+		// 
+		// Work out where the body ends, and so where the next
+		// request begins.
+		// 
+		if (request.FindHeader(HEADER_TRANSFER_ENCODING, nullptr))
+		{
+			if (!request.Chunked())
 			{
-				return REQUEST_PARSE_MALFORMED_AUTH;
+				entry.Result = REQUEST_PARSE_MALFORMED_CONTENT;
+				count++;
+				break;
 			}
 
-			continue;
+			entry.Chunked = true;
+			offset = entry.BodyOffset;
+			count++;
+			break;
 		}
 
-		m_pData->Header[key] = value;
-	}
+		if (request.FindHeader(HEADER_CONTENT_LENGTH, nullptr) &&
+			!request.ContentLength(&entry.BodyLength))
+		{
+			entry.Result = REQUEST_PARSE_MALFORMED_CONTENT;
+			count++;
+			break;
+		}
 
-	if (pPostDataOffsetOut)
-	{
-		*pPostDataOffsetOut = (cursor - pRequestData);
+		if (BufferSize - entry.BodyOffset < entry.BodyLength)
+		{
+			break;
+		}
+
+		offset = entry.BodyOffset + (SIZE_T) entry.BodyLength;
+		count++;
+
+		if (!request.KeepAlive())
+		{
+			break;
+		}
 	}
 
-	return REQUEST_PARSE_OK;
+	*pConsumedOut = offset;
+
+	return count;
 }
 
 /*
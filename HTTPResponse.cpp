@@ -1,74 +1,304 @@
-#include "HTTP.h"
+#include "HTTPInternal.h"
 
-#include <sstream>
+#include <string.h>
 #include <time.h>
+#include <atomic>
 
 namespace HTTP
 {
 
-#define HTTP_LINE_ENDING	"\r\n";
+#define HTTP_LINE_ENDING	"\r\n"
 
 ResponseHeaderBuilder::ResponseHeaderBuilder()
 	: Protocol(PROTOCOL_HTTP_1_1)
 	, Code(RESPONSE_OK)
 	, Method(METHOD_GET)
 	, AuthMode(AUTH_NONE)
+	, KeepAlive(false)
+	, KeepAliveTimeout(0)
+	, KeepAliveMax(0)
+	, m_CommonHeaders(0)
+	, m_SendDate(false)
+	, m_ContentLength(0)
+	, m_HasContentLength(false)
 {
 }
 
+void ResponseHeaderBuilder::NegotiateConnection(
+	const RequestHeader& Request)
+{
+	Protocol = Request.Protocol();
+	KeepAlive = Request.KeepAlive();
+}
+
+#define COMMON_HEADER_BIT(h) (1u << (h))
+
+// Only one line from each of these groups makes sense at a time
+const UINT32 kConnectionHeaders =
+	COMMON_HEADER_BIT(COMMON_HEADER_CONNECTION_CLOSE) |
+	COMMON_HEADER_BIT(COMMON_HEADER_CONNECTION_KEEP_ALIVE) |
+	COMMON_HEADER_BIT(COMMON_HEADER_CONNECTION_UPGRADE);
+
+const UINT32 kContentTypeHeaders =
+	COMMON_HEADER_BIT(COMMON_HEADER_CONTENT_TYPE_HTML_UTF8) |
+	COMMON_HEADER_BIT(COMMON_HEADER_CONTENT_TYPE_TEXT_UTF8) |
+	COMMON_HEADER_BIT(COMMON_HEADER_CONTENT_TYPE_JSON) |
+	COMMON_HEADER_BIT(COMMON_HEADER_CONTENT_TYPE_OCTET_STREAM);
+
+//
+// Which common lines each key is sent as, so that adding one either
+// way replaces the other, as AddKey always replaced its own.
+//
+struct COMMON_HEADER_KEY
+{
+	LPCSTR Key;
+	UINT32 Headers;
+};
+
+const COMMON_HEADER_KEY kCommonHeaderKeys[] =
+{
+	{ "Connection",			kConnectionHeaders },
+	{ "Content-Type",		kContentTypeHeaders },
+	{ "Upgrade",			COMMON_HEADER_BIT(COMMON_HEADER_UPGRADE_WEBSOCKET) },
+	{ "Transfer-Encoding",	COMMON_HEADER_BIT(COMMON_HEADER_TRANSFER_ENCODING_CHUNKED) },
+	{ "Cache-Control",		COMMON_HEADER_BIT(COMMON_HEADER_CACHE_CONTROL_NO_CACHE) },
+};
+
 ResponseHeaderBuilder& ResponseHeaderBuilder::AddKey(
 	StringRef A,
 	StringRef B)
 {
-	if (A.size())
+	if (!A.size())
+	{
+		return *this;
+	}
+
+	for (auto key = std::begin(kCommonHeaderKeys); key != std::end(kCommonHeaderKeys); ++key)
 	{
-		m_ExtraLines[A] = B;
+		if (A == key->Key)
+		{
+			m_CommonHeaders &= ~key->Headers;
+		}
+	}
+
+	// It'd otherwise be sent as well as this one
+	if (A == "Content-Length")
+	{
+		m_HasContentLength = false;
 	}
 
+	m_ExtraLines[A] = B;
+
 	return *this;
 }
 
-RESPONSE_HEADER_RESULT 
-ResponseHeaderBuilder::Build(
-	String& OutResponse) const
+ResponseHeaderBuilder& ResponseHeaderBuilder::AddCommonHeader(
+	COMMON_HEADER Header)
 {
-	std::stringstream response; 
-	
-	response << ProtocolToString(Protocol) << " ";
+	if (Header < 0 || Header >= COMMON_HEADER_COUNT)
+	{
+		return *this;
+	}
 
-	//
-	// Some codes need special cases
-	//
-	if (Code == RESPONSE_MOVED ||
-		Code == RESPONSE_FOUND)
+	UINT32 bit = COMMON_HEADER_BIT(Header);
+
+	for (auto key = std::begin(kCommonHeaderKeys); key != std::end(kCommonHeaderKeys); ++key)
 	{
-		if (!RedirectURI.size())
+		if (bit & key->Headers)
 		{
-			return RESPONSE_HEADER_NEED_REDIRECT_URI;
+			m_CommonHeaders &= ~key->Headers;
+			m_ExtraLines.erase(key->Key);
+		}
+	}
+
+	m_CommonHeaders |= bit;
+
+	return *this;
+}
+
+ResponseHeaderBuilder& ResponseHeaderBuilder::AddDateHeader()
+{
+	m_SendDate = true;
+
+	return *this;
+}
+
+/*
+	FORMATTING
+*/
+
+// Pairs of digits, so numbers can be written two at a time
+const CHAR kDigitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+SIZE_T FormatDecimal(ULONGLONG Value, LPSTR pOut)
+{
+	// Fill from the back, then move to the front
+	CHAR digits[20];
+	SIZE_T i = sizeof(digits);
+
+	while (Value >= 100)
+	{
+		SIZE_T pair = (SIZE_T) (Value % 100) * 2;
+		Value /= 100;
+
+		digits[--i] = kDigitPairs[pair + 1];
+		digits[--i] = kDigitPairs[pair];
+	}
+
+	if (Value >= 10)
+	{
+		SIZE_T pair = (SIZE_T) Value * 2;
+		digits[--i] = kDigitPairs[pair + 1];
+		digits[--i] = kDigitPairs[pair];
+	}
+	else
+	{
+		digits[--i] = (CHAR) ('0' + Value);
+	}
+
+	SIZE_T length = sizeof(digits) - i;
+	memcpy(pOut, digits + i, length);
+
+	return length;
+}
+
+//
+// Appends to a fixed buffer. If it runs out of room it stops
+// writing but keeps counting, so Length ends up as the size the
+// buffer needed to be.
+//
+// If it's given a segment list, text that doesn't change between
+// responses (AppendShared) is referenced rather than copied, and
+// the buffer only holds what's in between.
+//
+struct HEADER_WRITER
+{
+	HEADER_WRITER(LPSTR pBuffer, SIZE_T BufferSize)
+		: Buffer(pBuffer)
+		, Capacity(BufferSize)
+		, Length(0)
+		, Segments(nullptr)
+		, MaxSegments(0)
+		, SegmentCount(0)
+		, SegmentStart(0)
+	{
+	}
+
+	HEADER_WRITER(
+		LPSTR pBuffer, 
+		SIZE_T BufferSize,
+		RESPONSE_SEGMENT* pSegments,
+		SIZE_T SegmentsSize)
+		: Buffer(pBuffer)
+		, Capacity(BufferSize)
+		, Length(0)
+		, Segments(pSegments)
+		, MaxSegments(SegmentsSize)
+		, SegmentCount(0)
+		, SegmentStart(0)
+	{
+	}
+
+	void AppendShared(LPCSTR pData, SIZE_T DataLength)
+	{
+		// Keep room for this and whatever's written after it. If
+		// there isn't any, it's copied like everything else.
+		if (!Segments || SegmentCount + 2 > MaxSegments)
+		{
+			Append(pData, DataLength);
+			return;
 		}
 
-		response 
-			<< "URI: " 
-			<< RedirectURI
-			<< HTTP_LINE_ENDING;
+		EndSegment();
+
+		Segments[SegmentCount].Data = pData;
+		Segments[SegmentCount].Length = DataLength;
+		SegmentCount++;
 	}
-	else if (Code == RESPONSE_METHOD)
+
+	// Closes off what's been written to the buffer since the last
+	// shared segment.
+	void EndSegment()
 	{
-		if (!RedirectURI.size())
+		if (Length == SegmentStart)
 		{
-			return RESPONSE_HEADER_NEED_REDIRECT_URI;
+			return;
 		}
 
-		response 
-			<< "Method: " 
-			<< MethodToString(Method) 
-			<< " "
-			<< RedirectURI 
-			<< HTTP_LINE_ENDING;
+		Segments[SegmentCount].Data = Overflowed() ? nullptr : Buffer + SegmentStart;
+		Segments[SegmentCount].Length = Length - SegmentStart;
+		SegmentCount++;
+
+		SegmentStart = Length;
 	}
-	else
+
+	void Append(LPCSTR pData, SIZE_T DataLength)
+	{
+		if (Length + DataLength <= Capacity)
+		{
+			memcpy(Buffer + Length, pData, DataLength);
+		}
+
+		Length += DataLength;
+	}
+
+	void Append(LPCSTR pString)
+	{
+		Append(pString, strlen(pString));
+	}
+
+	void Append(StringRef s)
+	{
+		Append(s.c_str(), s.size());
+	}
+
+	void AppendNumber(ULONGLONG Value)
+	{
+		CHAR digits[20];
+		Append(digits, FormatDecimal(Value, digits));
+	}
+
+	bool Overflowed() const
+	{
+		return Length > Capacity;
+	}
+
+	LPSTR Buffer;
+	SIZE_T Capacity;
+	SIZE_T Length;
+
+	RESPONSE_SEGMENT* Segments;
+	SIZE_T MaxSegments;
+	SIZE_T SegmentCount;
+	SIZE_T SegmentStart;
+};
+
+#define APPEND_LITERAL(writer, s) (writer).Append(s, sizeof(s) - 1)
+
+RESPONSE_HEADER_RESULT 
+ResponseHeaderBuilder::Validate() const
+{
+	//
+	// Some codes need special cases
+	//
+	if (Code == RESPONSE_MOVED ||
+		Code == RESPONSE_FOUND ||
+		Code == RESPONSE_METHOD)
 	{
-		response << Code << " " << ResponseCodeToString(Code) << HTTP_LINE_ENDING;
+		if (!RedirectURI.size())
+		{
+			return RESPONSE_HEADER_NEED_REDIRECT_URI;
+		}
 	}
 
 	//
@@ -85,40 +315,334 @@ ResponseHeaderBuilder::Build(
 		{
 			return RESPONSE_HEADER_NEED_AUTH_REALM;
 		}
+	}
+
+	return RESPONSE_HEADER_OK;
+}
+
+void
+ResponseHeaderBuilder::Write(
+	HEADER_WRITER& response) const
+{
+	SIZE_T length;
+	LPCSTR statusLine = StatusLine(Protocol, Code, &length);
+
+	if (Code == RESPONSE_MOVED ||
+		Code == RESPONSE_FOUND)
+	{
+		response.Append(ProtocolToString(Protocol));
+		APPEND_LITERAL(response, " URI: ");
+		response.Append(RedirectURI);
+		APPEND_LITERAL(response, HTTP_LINE_ENDING);
+	}
+	else if (Code == RESPONSE_METHOD)
+	{
+		response.Append(ProtocolToString(Protocol));
+		APPEND_LITERAL(response, " Method: ");
+		response.Append(MethodToString(Method));
+		APPEND_LITERAL(response, " ");
+		response.Append(RedirectURI);
+		APPEND_LITERAL(response, HTTP_LINE_ENDING);
+	}
+	else if (statusLine)
+	{
+		response.AppendShared(statusLine, length);
+	}
+	else
+	{
+		response.Append(ProtocolToString(Protocol));
+		APPEND_LITERAL(response, " ");
+		response.AppendNumber(Code);
+		APPEND_LITERAL(response, " ");
+		response.Append(ResponseCodeToString(Code));
+		APPEND_LITERAL(response, HTTP_LINE_ENDING);
+	}
+
+	if (Code == RESPONSE_UNAUTHORISED)
+	{
+		APPEND_LITERAL(response, "WWW-Authenticate: ");
+		response.Append(AuthModeToString(AuthMode));
+		APPEND_LITERAL(response, " realm=\"");
+		response.Append(AuthRealm);
+		APPEND_LITERAL(response, "\"" HTTP_LINE_ENDING);
+	}
+
+	//
+	// The preformatted lines
+	//
+	for (UINT32 bits = m_CommonHeaders; bits; bits &= bits - 1)
+	{
+		INT header = 0;
+		while (!(bits & COMMON_HEADER_BIT(header)))
+		{
+			header++;
+		}
+
+		LPCSTR block = CommonHeaderBlock((COMMON_HEADER) header, &length);
+		response.AppendShared(block, length);
+	}
 
-		response 
-			<< "WWW-Authenticate: " 
-			<< AuthModeToString(AuthMode) 
-			<< "Realm=\""
-			<< AuthRealm 
-			<< "\"" 
-			<< HTTP_LINE_ENDING;
+	// Copied rather than shared: the gather segments can outlive
+	// the slot DateHeader hands back.
+	if (m_SendDate)
+	{
+		LPCSTR date = DateHeader(&length);
+		response.Append(date, length);
+	}
+
+	if (m_HasContentLength)
+	{
+		APPEND_LITERAL(response, "Content-Length: ");
+		response.AppendNumber(m_ContentLength);
+		APPEND_LITERAL(response, HTTP_LINE_ENDING);
 	}
 
 	//
 	// Add the keys
 	//
-	for (auto pair : m_ExtraLines)
+	for (auto pair = std::begin(m_ExtraLines); pair != std::end(m_ExtraLines); ++pair)
 	{
-		response << pair.first << ":";
-		if (pair.second.size())
-			response << " " << pair.second;
-		response << HTTP_LINE_ENDING;
+		response.Append(pair->first);
+		APPEND_LITERAL(response, ":");
+		if (pair->second.size())
+		{
+			APPEND_LITERAL(response, " ");
+			response.Append(pair->second);
+		}
+		APPEND_LITERAL(response, HTTP_LINE_ENDING);
 	}
 
 	// Terminating line break
-	response << HTTP_LINE_ENDING;
+	APPEND_LITERAL(response, HTTP_LINE_ENDING);
+}
+
+RESPONSE_HEADER_RESULT 
+ResponseHeaderBuilder::Build(
+	String& OutResponse) const
+{
+	RESPONSE_HEADER_RESULT result = Validate();
+	if (result != RESPONSE_HEADER_OK)
+	{
+		return result;
+	}
+
+	//
+	// Write straight into whatever capacity the string already
+	// has. Only if that's too small does it have to grow.
+	//
+	OutResponse.resize(OutResponse.capacity());
+
+	HEADER_WRITER response(&OutResponse[0], OutResponse.size());
+	Write(response);
+
+	if (response.Overflowed())
+	{
+		OutResponse.resize(response.Length);
 
-	OutResponse = response.str();
+		response = HEADER_WRITER(&OutResponse[0], OutResponse.size());
+		Write(response);
+	}
+
+	OutResponse.resize(response.Length);
+
+	return RESPONSE_HEADER_OK;
+}
+
+RESPONSE_HEADER_RESULT 
+ResponseHeaderBuilder::Build(
+	LPSTR pBuffer,
+	SIZE_T BufferSize,
+	SIZE_T* pLengthOut) const
+{
+	RESPONSE_HEADER_RESULT result = Validate();
+	if (result != RESPONSE_HEADER_OK)
+	{
+		return result;
+	}
+
+	HEADER_WRITER response(pBuffer, BufferSize);
+	Write(response);
+
+	*pLengthOut = response.Length;
+
+	return response.Overflowed()
+		? RESPONSE_HEADER_BUFFER_TOO_SMALL
+		: RESPONSE_HEADER_OK;
+}
+
+RESPONSE_HEADER_RESULT 
+ResponseHeaderBuilder::Build(
+	RESPONSE_GATHER& Output,
+	LPCVOID pBody,
+	SIZE_T BodyLength) const
+{
+	RESPONSE_HEADER_RESULT result = Validate();
+	if (result != RESPONSE_HEADER_OK)
+	{
+		return result;
+	}
+
+	//
+	// As with the String version, the scratch buffer's capacity is
+	// reused, and it's written a second time if that's too small.
+	// The last segment is kept back for the body.
+	//
+	String& scratch = Output.Scratch;
+	scratch.resize(scratch.capacity());
+
+	HEADER_WRITER response(
+		&scratch[0], 
+		scratch.size(), 
+		Output.Segments, 
+		RESPONSE_MAX_SEGMENTS - 1);
+
+	Write(response);
+	response.EndSegment();
+
+	if (response.Overflowed())
+	{
+		scratch.resize(response.Length);
+
+		response = HEADER_WRITER(
+			&scratch[0], 
+			scratch.size(), 
+			Output.Segments, 
+			RESPONSE_MAX_SEGMENTS - 1);
+
+		Write(response);
+		response.EndSegment();
+	}
+
+	scratch.resize(response.Length);
+
+	Output.SegmentCount = response.SegmentCount;
+	Output.TotalLength = 0;
+
+	if (pBody && BodyLength)
+	{
+		Output.Segments[Output.SegmentCount].Data = pBody;
+		Output.Segments[Output.SegmentCount].Length = BodyLength;
+		Output.SegmentCount++;
+	}
+
+	for (SIZE_T i = 0; i < Output.SegmentCount; ++i)
+	{
+		Output.TotalLength += Output.Segments[i].Length;
+	}
+
+	Output.File.Descriptor = -1;
+	Output.File.Offset = 0;
+	Output.File.Length = 0;
+
+	return RESPONSE_HEADER_OK;
+}
+
+RESPONSE_HEADER_RESULT 
+ResponseHeaderBuilder::Build(
+	RESPONSE_GATHER& Output,
+	const RESPONSE_FILE& File) const
+{
+	RESPONSE_HEADER_RESULT result = Build(Output, nullptr, 0);
+	if (result != RESPONSE_HEADER_OK)
+	{
+		return result;
+	}
+
+	Output.File = File;
 
 	return RESPONSE_HEADER_OK;
 }
 
 String IntToStr(SIZE_T T)
 {
-	std::stringstream s;
-	s << T;
-	return s.str();
+	CHAR digits[20];
+	return String(digits, FormatDecimal(T, digits));
+}
+
+void ResponseHeaderBuilder::AddConnectionHeaders()
+{
+	AddCommonHeader(KeepAlive 
+		? COMMON_HEADER_CONNECTION_KEEP_ALIVE 
+		: COMMON_HEADER_CONNECTION_CLOSE);
+
+	if (!KeepAlive || (!KeepAliveTimeout && !KeepAliveMax))
+	{
+		return;
+	}
+
+	String params;
+	if (KeepAliveTimeout)
+	{
+		params += "timeout=";
+		params += IntToStr(KeepAliveTimeout);
+	}
+	if (KeepAliveMax)
+	{
+		if (params.size())
+		{
+			params += ", ";
+		}
+
+		params += "max=";
+		params += IntToStr(KeepAliveMax);
+	}
+
+	AddKey("Keep-Alive", params);
+}
+
+//
+// Uses a preformatted line for the usual types, and falls back 
+// to AddKey for the rest.
+//
+void ResponseHeaderBuilder::SetContentType(
+	LPCSTR MimeType,
+	LPCSTR Encoding)
+{
+	COMMON_HEADER common = COMMON_HEADER_COUNT;
+
+	if (!Encoding)
+	{
+		if (!strcmp(MimeType, "application/json"))
+		{
+			common = COMMON_HEADER_CONTENT_TYPE_JSON;
+		}
+		else if (!strcmp(MimeType, "application/octet-stream"))
+		{
+			common = COMMON_HEADER_CONTENT_TYPE_OCTET_STREAM;
+		}
+	}
+	else if (StringView{ Encoding, strlen(Encoding) }.EqualsNoCase("charset=utf-8"))
+	{
+		if (!strcmp(MimeType, "text/html"))
+		{
+			common = COMMON_HEADER_CONTENT_TYPE_HTML_UTF8;
+		}
+		else if (!strcmp(MimeType, "text/plain"))
+		{
+			common = COMMON_HEADER_CONTENT_TYPE_TEXT_UTF8;
+		}
+	}
+
+	if (common != COMMON_HEADER_COUNT)
+	{
+		AddCommonHeader(common);
+		return;
+	}
+
+	m_CommonHeaders &= ~kContentTypeHeaders;
+
+	if (!Encoding)
+	{
+		AddKey("Content-Type", MimeType);
+		return;
+	}
+
+	String mimeAndEncoding = MimeType;
+
+	mimeAndEncoding += "; ";
+	mimeAndEncoding += Encoding;
+
+	AddKey("Content-Type", mimeAndEncoding);
 }
 
 RESPONSE_HEADER_RESULT ResponseHeaderBuilder::AddBinaryHeaders(
@@ -130,9 +654,12 @@ RESPONSE_HEADER_RESULT ResponseHeaderBuilder::AddBinaryHeaders(
 		return RESPONSE_HEADER_NEED_CONTENT_MIME;
 	}
 
-	AddKey("Content-Type", MimeType);
-	AddKey("Content-Length", IntToStr(ContentLength));
-	AddKey("Connection", "close");
+	SetContentType(MimeType, nullptr);
+	m_ContentLength = ContentLength;
+	m_HasContentLength = true;
+	m_ExtraLines.erase("Content-Length");
+	m_CommonHeaders &= ~COMMON_HEADER_BIT(COMMON_HEADER_TRANSFER_ENCODING_CHUNKED);
+	AddConnectionHeaders();
 
 	return RESPONSE_HEADER_OK;
 }
@@ -148,34 +675,204 @@ RESPONSE_HEADER_RESULT ResponseHeaderBuilder::AddTextHeaders(
 		return RESPONSE_HEADER_NEED_CONTENT_MIME;
 	}
 
-	String mimeAndEncoding = MimeType;
+	SetContentType(MimeType, Encoding);
+	m_ContentLength = ContentLength;
+	m_HasContentLength = true;
+	m_ExtraLines.erase("Content-Length");
+	m_CommonHeaders &= ~COMMON_HEADER_BIT(COMMON_HEADER_TRANSFER_ENCODING_CHUNKED);
+	AddConnectionHeaders();
 
-	mimeAndEncoding += "; ";
-	mimeAndEncoding += Encoding;
+	return RESPONSE_HEADER_OK;
+}
 
-	AddKey("Content-Type", mimeAndEncoding);
-	AddKey("Content-Length", IntToStr(ContentLength));
-	AddKey("Connection", "close");
+RESPONSE_HEADER_RESULT ResponseHeaderBuilder::AddChunkedHeaders(
+	LPCSTR MimeType)
+{
+	if (!MimeType || !*MimeType)
+	{
+		return RESPONSE_HEADER_NEED_CONTENT_MIME;
+	}
+
+	if (Protocol != PROTOCOL_HTTP_1_1)
+	{
+		return RESPONSE_HEADER_NEED_HTTP_1_1;
+	}
+
+	SetContentType(MimeType, nullptr);
+	AddCommonHeader(COMMON_HEADER_TRANSFER_ENCODING_CHUNKED);
+	m_HasContentLength = false;
+	m_ExtraLines.erase("Content-Length");
+	AddConnectionHeaders();
 
 	return RESPONSE_HEADER_OK;
 }
 
-String TimeStampString()
+bool ResponseHeaderBuilder::ContentLength(
+	ULONGLONG* pLengthOut) const
 {
- 	struct tm timeinfo;
-	time_t rawtime;
+	if (m_HasContentLength)
+	{
+		*pLengthOut = m_ContentLength;
+		return true;
+	}
+
+	auto line = m_ExtraLines.find("Content-Length");
+	if (line == m_ExtraLines.end() || line->second.empty())
+	{
+		return false;
+	}
+
+	ULONGLONG length = 0;
 
-	time(&rawtime);
-	localtime_s(&timeinfo, &rawtime);
+	for (auto c = std::begin(line->second); c != std::end(line->second); ++c)
+	{
+		ULONGLONG digit = (ULONGLONG) (*c - '0');
 
-	char time_str[256];
-	asctime_s(time_str, sizeof(time_str), &timeinfo);
+		if (*c < '0' || *c > '9' || length > (~0ULL - digit) / 10)
+		{
+			return false;
+		}
+
+		length = length * 10 + digit;
+	}
 
-	// chop of \n
-	size_t len = strlen(time_str);
-	time_str[len-1] = 0;
+	*pLengthOut = length;
 
-	return time_str;
+	return true;
+}
+
+/*
+	DATES
+*/
+
+#define DATE_PREFIX			"Date: "
+#define DATE_PREFIX_LENGTH	(sizeof(DATE_PREFIX) - 1)
+#define IMF_FIXDATE_LENGTH	29	// "Sun, 06 Nov 1994 08:49:37 GMT"
+#define DATE_HEADER_LENGTH	(DATE_PREFIX_LENGTH + IMF_FIXDATE_LENGTH + 2)
+
+//
+// Writes Seconds (since 1970) as an IMF-fixdate. This does its own
+// calendar maths so it doesn't depend on gmtime's thread safety.
+//
+void FormatIMFFixdate(LONGLONG Seconds, LPSTR pOut)
+{
+	static const CHAR kDays[] = "ThuFriSatSunMonTueWed";
+	static const CHAR kMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+	LONGLONG days = Seconds / 86400;
+	LONGLONG secondOfDay = Seconds % 86400;
+	if (secondOfDay < 0)
+	{
+		secondOfDay += 86400;
+		days--;
+	}
+
+	// 1970-01-01 was a Thursday
+	LONGLONG weekday = days % 7;
+	if (weekday < 0)
+	{
+		weekday += 7;
+	}
+
+	//
+	// Days to a civil date, working in 400 year eras starting 
+	// on the 1st of March so leap days fall at the end.
+	//
+	LONGLONG z = days + 719468;
+	LONGLONG era = (z >= 0 ? z : z - 146096) / 146097;
+	LONGLONG dayOfEra = z - era * 146097;
+	LONGLONG yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	LONGLONG dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+	LONGLONG shiftedMonth = (5 * dayOfYear + 2) / 153;
+	LONGLONG day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+	LONGLONG month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+	LONGLONG year = yearOfEra + era * 400 + (month <= 2);
+
+	LONGLONG hour = secondOfDay / 3600;
+	LONGLONG minute = secondOfDay / 60 % 60;
+	LONGLONG second = secondOfDay % 60;
+
+	memcpy(pOut, kDays + weekday * 3, 3);
+	pOut[3] = ',';
+	pOut[4] = ' ';
+	memcpy(pOut + 5, kDigitPairs + day * 2, 2);
+	pOut[7] = ' ';
+	memcpy(pOut + 8, kMonths + (month - 1) * 3, 3);
+	pOut[11] = ' ';
+	memcpy(pOut + 12, kDigitPairs + (year / 100 % 100) * 2, 2);
+	memcpy(pOut + 14, kDigitPairs + (year % 100) * 2, 2);
+	pOut[16] = ' ';
+	memcpy(pOut + 17, kDigitPairs + hour * 2, 2);
+	pOut[19] = ':';
+	memcpy(pOut + 20, kDigitPairs + minute * 2, 2);
+	pOut[22] = ':';
+	memcpy(pOut + 23, kDigitPairs + second * 2, 2);
+	memcpy(pOut + 25, " GMT", 4);
+}
+
+//
+// One slot per second, so a line that's been handed out isn't
+// overwritten until the ring comes back round to it.
+//
+// Second is the second the slot holds, or DATE_SLOT_BUSY while a
+// thread is writing it. Whoever claims the slot formats it; anyone
+// who gets there meanwhile formats a copy of their own instead of
+// waiting.
+//
+#define DATE_SLOTS		64
+#define DATE_SLOT_BUSY	-1
+
+struct DATE_SLOT
+{
+	std::atomic<LONGLONG> Second;
+	CHAR Text[DATE_HEADER_LENGTH + 1];
+};
+
+DATE_SLOT g_DateSlots[DATE_SLOTS];
+
+void FormatDateHeader(LONGLONG Seconds, LPSTR pOut)
+{
+	memcpy(pOut, DATE_PREFIX, DATE_PREFIX_LENGTH);
+	FormatIMFFixdate(Seconds, pOut + DATE_PREFIX_LENGTH);
+	memcpy(pOut + DATE_PREFIX_LENGTH + IMF_FIXDATE_LENGTH, HTTP_LINE_ENDING, 3);
+}
+
+LPCSTR DateHeader(SIZE_T* pLengthOut)
+{
+	if (pLengthOut)
+	{
+		*pLengthOut = DATE_HEADER_LENGTH;
+	}
+
+	LONGLONG now = (LONGLONG) time(nullptr);
+	DATE_SLOT& slot = g_DateSlots[now % DATE_SLOTS];
+
+	LONGLONG held = slot.Second.load(std::memory_order_acquire);
+	if (held == now)
+	{
+		return slot.Text;
+	}
+
+	if (held != DATE_SLOT_BUSY &&
+		slot.Second.compare_exchange_strong(held, DATE_SLOT_BUSY, std::memory_order_acquire))
+	{
+		FormatDateHeader(now, slot.Text);
+		slot.Second.store(now, std::memory_order_release);
+
+		return slot.Text;
+	}
+
+	// Same ring per thread, so this lasts as long too
+	thread_local CHAR tls_Text[DATE_SLOTS][DATE_HEADER_LENGTH + 1];
+	LPSTR text = tls_Text[now % DATE_SLOTS];
+	FormatDateHeader(now, text);
+
+	return text;
+}
+
+String TimeStampString()
+{
+	return String(DateHeader(nullptr) + DATE_PREFIX_LENGTH, IMF_FIXDATE_LENGTH);
 }
 
 }
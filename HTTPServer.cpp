@@ -0,0 +1,3519 @@
+#include "HTTPInternal.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Multishot receive and single-issuer rings both came in with 6.0
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SINGLE_ISSUER) && !defined(HTTP_NO_IO_URING)
+#define SERVER_URING
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+
+namespace HTTP
+{
+
+/*
+	SERVER
+
+	Each SERVER_LOOP has its own epoll set, and everything about a
+	connection happens on its loop's thread, so none of this needs
+	locking. A turn of the loop:
+
+	 - waits for events,
+	 - reads from each connection until the socket's drained (the
+	   sockets are edge-triggered) and handles what came in,
+	 - sends what each connection has queued, so that pipelined
+	   responses and small WebSocket messages go out together,
+	 - frees the connections that closed, and closes idle ones.
+
+	With io_uring it's the same, except that the loop doesn't read
+	or send itself: accepting and receiving are multishot requests
+	that stay armed, each connection has at most one send in flight,
+	and a turn waits for completions rather than readiness. Anything
+	received goes into the loop's ring of provided buffers, and when
+	a connection has nothing left over from before, it takes the 
+	buffer as its input and parses from it without a copy. What's
+	left once it's been parsed (the start of the next request, say)
+	is copied out, so that a client that's slow to send the rest 
+	can't keep the buffer from the ring. The buffer goes back when 
+	nothing refers to it.
+
+	With more than one thread, each loop also has its own listening
+	socket (all bound with SO_REUSEPORT, so the kernel shares out
+	the connections), buffers, pools and stats, and they share 
+	nothing but the config and the handlers (and the workers, if
+	there are any).
+*/
+#define SERVER_MAX_EVENTS		256
+#define SERVER_MAX_IOV			64
+#define SERVER_MIN_READ			2048	// Least room worth calling recv with
+#define SERVER_MAX_FREE_BUFFERS	1024
+#define SERVER_MIN_COMPRESS		64		// Smaller messages aren't worth deflating
+#define SERVER_URING_ENTRIES	4096
+#define SERVER_URING_MAX_BUFFERS	32768
+#define SERVER_LOW_WATER		(64 * 1024)	// Queued below this, an exchange is Writable
+
+enum CONNECTION_STATE
+{
+	CONNECTION_HTTP,
+	CONNECTION_WEBSOCKET,
+	CONNECTION_CLOSING,			// Sending what's queued, then closing
+	CONNECTION_CLOSED			// Waiting to be freed at the end of the turn
+};
+
+//
+// Something waiting to be sent. Owner keeps Data alive: it's
+// either a shared frame or a buffer that belongs to this item.
+//
+struct OUTPUT_ITEM
+{
+	std::shared_ptr<const void> Owner;
+	LPCSTR Data;
+	SIZE_T Length;
+};
+
+//
+// Each is only written by its own loop, so there's no need for
+// anything stronger than relaxed; they're atomic so that Stats 
+// can read them from other threads.
+//
+struct LOOP_STATS
+{
+	LOOP_STATS()
+		: Accepted(0)
+		, Open(0)
+		, Requests(0)
+		, WebsocketMessages(0)
+		, BytesReceived(0)
+		, BytesSent(0)
+	{
+	}
+
+	std::atomic<ULONGLONG> Accepted;
+	std::atomic<ULONGLONG> Open;
+	std::atomic<ULONGLONG> Requests;
+	std::atomic<ULONGLONG> WebsocketMessages;
+	std::atomic<ULONGLONG> BytesReceived;
+	std::atomic<ULONGLONG> BytesSent;
+};
+
+inline void Count(
+	std::atomic<ULONGLONG>& Counter,
+	ULONGLONG Amount)
+{
+	Counter.store(Counter.load(std::memory_order_relaxed) + Amount, std::memory_order_relaxed);
+}
+
+// Callbacks are called once, and can set themselves again
+inline void Fire(
+	std::function<void ()>& Callback)
+{
+	std::function<void ()> callback;
+	callback.swap(Callback);
+
+	if (callback)
+	{
+		callback();
+	}
+}
+
+struct SERVER_DATA;
+struct SERVER_LOOP;
+struct WORKER_JOB;
+
+#if defined(SERVER_URING)
+
+//
+// What each request's user_data says it was for. The loop's own
+// requests have no connection; the rest have it in the upper bits.
+//
+enum URING_OP
+{
+	URING_ACCEPT = 1,
+	URING_WAKE,
+	URING_IGNORE,				// Cancellations
+	URING_RECEIVE,
+	URING_SEND,
+
+	URING_OP_MASK = 7
+};
+
+//
+// The ring of buffers the kernel receives into. It's shared with 
+// the buffers that have been handed out, so that one that outlives
+// the loop has somewhere to go back to.
+//
+struct URING_BUFFERS
+{
+	URING_BUFFERS();
+	~URING_BUFFERS();
+
+	bool Open(UINT Count, SIZE_T Size);
+	void Recycle(USHORT Id);
+
+	io_uring_buf_ring* pRing;
+	LPBYTE pData;
+	UINT Count;
+	SIZE_T Size;
+	USHORT Tail;
+	UINT Returned;				// Since the loop last looked
+};
+
+struct URING
+{
+	URING();
+	~URING();
+
+	bool Open(UINT Entries, UINT BufferCount, SIZE_T BufferSize);
+	bool Enable();
+	io_uring_sqe* Next(ULONGLONG UserData);
+	void Cancel(ULONGLONG UserData);
+	void Submit();
+	void Wait(INT Timeout);
+	std::shared_ptr<char> Take(USHORT Id);
+	bool Reap(io_uring_cqe* pCqe);
+
+	INT Fd;
+	LPVOID pRings;
+	SIZE_T RingsSize;
+	io_uring_sqe* pSqes;
+	SIZE_T SqesSize;
+
+	UINT* pSqHead;
+	UINT* pSqTail;
+	UINT SqMask;
+	UINT SqEntries;
+	UINT SqTail;				// Ours, published on Submit
+
+	UINT* pCqHead;
+	UINT* pCqTail;
+	UINT CqMask;
+	io_uring_cqe* pCqes;
+
+	UINT Outstanding;			// Requests still to complete
+	ULONGLONG WakeValue;
+	std::shared_ptr<URING_BUFFERS> Buffers;
+};
+
+#endif
+
+struct SERVER_CONNECTION
+{
+	SERVER_CONNECTION(SERVER_LOOP* pLoop, INT Socket);
+
+	void OnReadable();
+	bool PrepareRead();
+	void ReleaseBuffer();
+	void Process();
+	void ProcessWebsocket();
+	void Dispatch(const SERVER_EXCHANGE& Exchange);
+	void Upgrade(const SERVER_EXCHANGE& Exchange);
+	bool ReceiveBody();
+	bool Backlogged() const;
+	void Respond(ServerExchange* pExchange, LPCVOID pBody, SIZE_T BodyLength);
+	void Write(ServerExchange* pExchange, LPCVOID pData, SIZE_T Length, bool Last);
+	void Complete(ServerExchange* pExchange);
+	void Continue();
+	void SendError(RESPONSE_CODE Code);
+	bool SendMessage(WS_FRAME_OPCODE OpCode, LPCVOID pPayload, SIZE_T PayloadLength);
+	void SendClose(WS_CLOSE_REASON Reason);
+	void Queue(String& Data);
+	void Queue(const WS_SHARED_FRAME& Frame);
+	void QueueBatch();
+	ULONGLONG Unsent() const;
+	bool OverLimit() const;
+	void Flush();
+	void Consume(SIZE_T BytesSent);
+	void Drained();
+	bool Busy() const;
+	void Close();
+	void Detach();
+	bool Paused() const;
+
+#if defined(SERVER_URING)
+	void Receive();
+	void OnReceived(std::shared_ptr<char>& Buffer, SIZE_T Length);
+	void OnReceiveEnded(INT Result);
+	void Feed(LPCSTR pData, SIZE_T Length);
+	void Hold(LPCSTR pData, SIZE_T Length);
+	void Resume();
+	void SubmitSend();
+	void OnSent(INT Result);
+#endif
+
+	SERVER_LOOP* pLoop;
+	INT Socket;
+	CONNECTION_STATE State;
+	bool ReadReady;				// Not read until EAGAIN yet
+	bool WriteReady;			// Not seen EAGAIN since the last EPOLLOUT
+	bool Dirty;					// On the loop's list to flush
+	bool InProcess;
+
+	// What's been received. Requests point into it, so it's shared
+	// with them, and only moved about when nothing else has it.
+	std::shared_ptr<char> In;
+	SIZE_T InSize;
+	SIZE_T InStart;
+	SIZE_T InEnd;
+	bool InRing;				// In is one of the loop's io_uring buffers
+
+	// The request being answered, and the one whose body is coming
+	// in (the same one, if it's being streamed)
+	SERVER_EXCHANGE Exchange;
+	SERVER_EXCHANGE Reading;
+	bool ReceivingChunked;
+	ChunkedDecoder Chunked;
+	bool ReceivingBody;			// Streaming one with a Content-Length
+	ULONGLONG BodyRemaining;
+
+	// Out goes before Batch
+	std::deque<OUTPUT_ITEM> Out;
+	SIZE_T OutOffset;
+	ULONGLONG OutBytes;
+	WebsocketFrameBatcher Batch;
+
+	SERVER_WEBSOCKET Websocket;
+	std::unique_ptr<WebsocketMessageAssembler> Assembler;
+#if !defined(HTTP_NO_DEFLATE)
+	std::unique_ptr<WebsocketDeflate> Deflate;
+#endif
+	WS_CLOSE_REASON CloseReason;
+
+	std::list<SERVER_CONNECTION*>::iterator Position;	// In the loop's idle list
+	ULONGLONG LastActive;
+
+	// io_uring requests that still refer to it; it isn't freed until
+	// they've all completed
+	UINT InFlight;
+	bool Sending;
+
+#if defined(SERVER_URING)
+	bool ReceiveArmed;
+	bool ReceiveHeld;			// Cancelled until what's held is handled
+	bool Starved;				// The ring ran out of buffers for it
+	String Held;				// Received while paused
+	std::unique_ptr<iovec[]> SendVectors;
+	msghdr SendHeader;
+#endif
+};
+
+struct SERVER_LOOP
+{
+	SERVER_LOOP(SERVER_DATA* pServer);
+	~SERVER_LOOP();
+
+	SERVER_RESULT Open(const sockaddr* pAddress, socklen_t AddressLength, bool SharePort);
+	void Run();
+	void Accept();
+	SERVER_CONNECTION* Add(INT Socket);
+	void EndTurn();
+	void Touch(SERVER_CONNECTION* pConnection);
+	void MarkDirty(SERVER_CONNECTION* pConnection);
+	void CloseAll();
+	void FreeClosed();
+	INT Timeout() const;
+
+	std::shared_ptr<char> AcquireBuffer();
+	void ReleaseBuffer(std::shared_ptr<char>& Buffer);
+
+	void Finish(WORKER_JOB* pJob);
+	void TakeFinished();
+
+	SERVER_DATA* pServer;
+	INT Epoll;
+	INT Listen;
+	INT Wake;					// eventfd, to interrupt epoll_wait
+	ULONGLONG Now;				// Milliseconds, as of the start of the turn
+	INT Cpu;					// To pin to, or -1
+
+	std::list<SERVER_CONNECTION*> Connections;	// Least recently active first
+	std::vector<SERVER_CONNECTION*> DirtyList;
+	std::vector<SERVER_CONNECTION*> ClosedList;
+	SIZE_T ConnectionCount;
+
+	std::vector<std::shared_ptr<char> > FreeBuffers;
+	WebsocketBufferPool BufferPool;
+#if !defined(HTTP_NO_DEFLATE)
+	WebsocketDeflatePool DeflatePool;
+#endif
+	// Separate, since a handler can send from within OnMessage while
+	// it's still looking at the inflated message
+	String InflateScratch;
+	String DeflateScratch;
+
+	LOOP_STATS Stats;
+
+	// Jobs the workers are done with, last finished first
+	std::atomic<WORKER_JOB*> Finished;
+
+#if defined(SERVER_URING)
+	void RunUring();
+	void Complete(const io_uring_cqe& Cqe);
+	void Arm(URING_OP Op);
+
+	std::unique_ptr<URING> Ring;	// Null when using epoll
+	std::vector<SERVER_CONNECTION*> Starved;
+#endif
+};
+
+//
+// Work a handler's offloaded. The exchange is only let go of on its
+// own loop, since it can be holding one of the loop's buffers.
+//
+struct WORKER_JOB
+{
+	SERVER_LOOP* pLoop;
+	SERVER_EXCHANGE Exchange;
+	std::function<void (String&)> Work;
+	String Body;
+	WORKER_JOB* pNext;			// On the loop's Finished stack
+};
+
+struct WORKER
+{
+	std::mutex Lock;
+	std::deque<WORKER_JOB*> Jobs;
+	std::thread Thread;
+};
+
+struct WORKER_POOL
+{
+	WORKER_POOL(UINT Count);
+	~WORKER_POOL();
+
+	void Post(WORKER_JOB* pJob);
+	WORKER_JOB* Take(UINT Index);
+	void Run(UINT Index);
+
+	std::vector<std::unique_ptr<WORKER> > Workers;
+	std::atomic<UINT> Next;		// To post to
+	std::atomic<INT> Queued;		// In all of the deques
+
+	std::mutex SleepLock;
+	std::condition_variable Sleep;
+	std::atomic<bool> Stopping;
+};
+
+struct SERVER_DATA
+{
+	SERVER_DATA()
+		: Started(false)
+		, Stopping(false)
+		, Port(0)
+	{
+		DefaultServerConfig(&Config);
+	}
+
+	SERVER_CONFIG Config;
+	RequestHandler Handler;
+	WEBSOCKET_HANDLERS Websocket;
+	bool Started;
+	std::atomic<bool> Stopping;
+	USHORT Port;
+	std::vector<std::unique_ptr<SERVER_LOOP> > Loops;
+	std::unique_ptr<WORKER_POOL> Pool;	// While running, if there are workers
+};
+
+ULONGLONG MonotonicMilliseconds()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (ULONGLONG) now.tv_sec * 1000 + (ULONGLONG) now.tv_nsec / 1000000;
+}
+
+void DefaultServerConfig(
+	SERVER_CONFIG* pConfig)
+{
+	pConfig->Address = nullptr;
+	pConfig->Port = 80;
+	pConfig->Backlog = 1024;
+	pConfig->ReadBufferSize = 16 * 1024;
+	pConfig->MaxRequestSize = 1024 * 1024;
+	pConfig->MaxWriteQueue = 16 * 1024 * 1024;
+	pConfig->MaxConnections = 100000;
+	pConfig->IdleTimeout = 60;
+	pConfig->EnableDeflate = false;
+	pConfig->Threads = 1;
+	pConfig->PinThreads = true;
+	pConfig->Io = SERVER_IO_AUTO;
+	pConfig->RingBuffers = 1024;
+	pConfig->StreamBodies = false;
+	pConfig->Workers = 0;
+}
+
+/*
+	EXCHANGES
+*/
+ServerExchange::ServerExchange()
+	: m_pConnection(nullptr)
+	, m_Streaming(false)
+	, m_BodyRead(false)
+	, m_BodyDone(false)
+	, m_Chunked(false)
+	, m_BodyLeft((ULONGLONG) -1)
+{
+	m_HeaderText.Data = nullptr;
+	m_HeaderText.Length = 0;
+	m_Body.Data = nullptr;
+	m_Body.Length = 0;
+}
+
+const RequestHeader& ServerExchange::Request() const
+{
+	return m_Request;
+}
+
+StringView ServerExchange::Body() const
+{
+	return m_Body;
+}
+
+void ServerExchange::Send(
+	LPCVOID pBody,
+	SIZE_T BodyLength)
+{
+	if (!m_pConnection)
+	{
+		return;
+	}
+
+	// After Write, it's the last piece
+	if (m_pWriter)
+	{
+		m_pConnection->Write(this, pBody, BodyLength, true);
+		return;
+	}
+
+	m_pConnection->Respond(this, pBody, BodyLength);
+}
+
+bool ServerExchange::Pending() const
+{
+	return m_pConnection != nullptr;
+}
+
+StringView ServerExchange::ReadBody()
+{
+	StringView body = { "", 0 };
+
+	if (!m_Streaming)
+	{
+		if (!m_BodyRead)
+		{
+			m_BodyRead = true;
+			body = m_Body;
+		}
+
+		return body;
+	}
+
+	m_BodyOut.clear();
+	m_BodyOut.swap(m_BodyIn);
+
+	body.Data = m_BodyOut.data();
+	body.Length = m_BodyOut.size();
+
+	// There's room again, if reading had stopped
+	if (m_pConnection && body.Length)
+	{
+		m_pConnection->Continue();
+	}
+
+	return body;
+}
+
+bool ServerExchange::BodyReadable() const
+{
+	return m_Streaming ? !m_BodyIn.empty() || m_BodyDone : true;
+}
+
+bool ServerExchange::BodyDone() const
+{
+	return m_Streaming ? m_BodyIn.empty() && m_BodyDone : m_BodyRead;
+}
+
+void ServerExchange::OnBody(
+	std::function<void ()> Callback)
+{
+	m_OnBody = Callback;
+}
+
+bool ServerExchange::Write(
+	LPCVOID pData,
+	SIZE_T Length)
+{
+	if (!m_pConnection)
+	{
+		return false;
+	}
+
+	m_pConnection->Write(this, pData, Length, false);
+
+	return m_pConnection != nullptr;
+}
+
+void ServerExchange::Finish()
+{
+	if (m_pConnection)
+	{
+		m_pConnection->Write(this, nullptr, 0, true);
+	}
+}
+
+bool ServerExchange::Writable() const
+{
+	return !m_pConnection || m_pConnection->Unsent() < SERVER_LOW_WATER;
+}
+
+void ServerExchange::OnWritable(
+	std::function<void ()> Callback)
+{
+	m_OnWritable = Callback;
+}
+
+void ServerExchange::Offload(
+	std::function<void (String& Body)> Work)
+{
+	if (!m_pConnection)
+	{
+		return;
+	}
+
+	SERVER_LOOP* pLoop = m_pConnection->pLoop;
+	WORKER_POOL* pPool = pLoop->pServer->Pool.get();
+
+	if (!pPool)
+	{
+		String body;
+		Work(body);
+		Send(body.data(), body.size());
+		return;
+	}
+
+	WORKER_JOB* pJob = new WORKER_JOB();
+	pJob->pLoop = pLoop;
+	pJob->Exchange = m_pConnection->Exchange;
+	pJob->Work = Work;
+	pJob->pNext = nullptr;
+
+	pPool->Post(pJob);
+}
+
+/*
+	WEBSOCKETS
+*/
+ServerWebsocket::ServerWebsocket()
+	: m_pConnection(nullptr)
+	, m_MessageBytes(0)
+{
+}
+
+bool ServerWebsocket::Send(
+	WS_FRAME_OPCODE OpCode,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength)
+{
+	if (!m_pConnection || m_pConnection->State != CONNECTION_WEBSOCKET)
+	{
+		return false;
+	}
+
+	return m_pConnection->SendMessage(OpCode, pPayload, PayloadLength);
+}
+
+bool ServerWebsocket::Send(
+	const WS_SHARED_FRAME& Frame)
+{
+	if (!Frame || !m_pConnection || m_pConnection->State != CONNECTION_WEBSOCKET)
+	{
+		return false;
+	}
+
+	m_pConnection->Queue(Frame);
+
+	if (m_pConnection->OverLimit())
+	{
+		m_pConnection->Close();
+		return false;
+	}
+
+	return true;
+}
+
+void ServerWebsocket::Close(
+	WS_CLOSE_REASON Reason)
+{
+	if (m_pConnection && m_pConnection->State == CONNECTION_WEBSOCKET)
+	{
+		m_pConnection->SendClose(Reason);
+	}
+}
+
+bool ServerWebsocket::Open() const
+{
+	return m_pConnection && m_pConnection->State == CONNECTION_WEBSOCKET;
+}
+
+bool ServerWebsocket::Compressed() const
+{
+#if !defined(HTTP_NO_DEFLATE)
+	return m_pConnection && m_pConnection->Deflate;
+#else
+	return false;
+#endif
+}
+
+const RequestHeader& ServerWebsocket::Request() const
+{
+	return m_Handshake->Request();
+}
+
+bool ServerWebsocket::Receive(
+	SERVER_MESSAGE* pMessage)
+{
+	if (m_Messages.empty())
+	{
+		return false;
+	}
+
+	pMessage->OpCode = m_Messages.front().OpCode;
+	pMessage->Data.swap(m_Messages.front().Data);
+
+	m_MessageBytes -= pMessage->Data.size();
+	m_Messages.pop_front();
+
+	// There's room again, if reading had stopped
+	if (m_pConnection)
+	{
+		m_pConnection->Continue();
+	}
+
+	return true;
+}
+
+void ServerWebsocket::OnReceivable(
+	std::function<void ()> Callback)
+{
+	m_OnReceivable = Callback;
+}
+
+/*
+	CONNECTIONS
+*/
+SERVER_CONNECTION::SERVER_CONNECTION(
+	SERVER_LOOP* pLoop,
+	INT Socket)
+	: pLoop(pLoop)
+	, Socket(Socket)
+	, State(CONNECTION_HTTP)
+	, ReadReady(false)
+	, WriteReady(true)
+	, Dirty(false)
+	, InProcess(false)
+	, InSize(0)
+	, InStart(0)
+	, InEnd(0)
+	, InRing(false)
+	, ReceivingChunked(false)
+	, ReceivingBody(false)
+	, BodyRemaining(0)
+	, OutOffset(0)
+	, OutBytes(0)
+	, Batch(16 * 1024, 0)
+	, CloseReason(WS_CLOSE_GOING_AWAY)
+	, LastActive(pLoop->Now)
+	, InFlight(0)
+	, Sending(false)
+#if defined(SERVER_URING)
+	, ReceiveArmed(false)
+	, ReceiveHeld(false)
+	, Starved(false)
+#endif
+{
+}
+
+//
+// Reads until the socket's drained, handling requests as they
+// complete so the buffer doesn't have to hold more than one.
+//
+void SERVER_CONNECTION::OnReadable()
+{
+	ReadReady = true;
+
+	while (State == CONNECTION_HTTP || State == CONNECTION_WEBSOCKET)
+	{
+		if (!PrepareRead())
+		{
+			// A handler's still answering an earlier request, so
+			// stop reading until it does.
+			if (Paused())
+			{
+				return;
+			}
+
+			SendError(RESPONSE_BADREQUEST);
+			return;
+		}
+
+		ssize_t received = recv(Socket, In.get() + InEnd, InSize - InEnd, 0);
+
+		if (received > 0)
+		{
+			InEnd += (SIZE_T) received;
+			Count(pLoop->Stats.BytesReceived, (ULONGLONG) received);
+			pLoop->Touch(this);
+
+			Process();
+			continue;
+		}
+
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			ReadReady = false;
+			ReleaseBuffer();
+			return;
+		}
+
+		// The client's gone
+		Close();
+		return;
+	}
+}
+
+//
+// Makes room to receive into. Returns false if what's waiting to
+// be handled has already reached MaxRequestSize.
+//
+bool SERVER_CONNECTION::PrepareRead()
+{
+	const SERVER_CONFIG& config = pLoop->pServer->Config;
+
+	if (!In)
+	{
+		In = pLoop->AcquireBuffer();
+		InSize = config.ReadBufferSize;
+		InStart = InEnd = 0;
+		InRing = false;
+	}
+
+	bool shared = !In.unique();
+
+	if (InStart == InEnd && !shared)
+	{
+		InStart = InEnd = 0;
+	}
+
+	if (InSize - InEnd >= SERVER_MIN_READ)
+	{
+		return true;
+	}
+
+	SIZE_T pending = InEnd - InStart;
+
+	if (pending >= config.MaxRequestSize)
+	{
+		return false;
+	}
+
+	// Slide it down if that makes enough room
+	if (!shared && InSize - pending >= SERVER_MIN_READ)
+	{
+		memmove(In.get(), In.get() + InStart, pending);
+		InStart = 0;
+		InEnd = pending;
+		return true;
+	}
+
+	//
+	// Otherwise it needs a bigger buffer. A request that's being
+	// answered keeps the old one.
+	//
+	SIZE_T size = InSize;
+	while (size - pending < SERVER_MIN_READ)
+	{
+		size *= 2;
+	}
+
+	std::shared_ptr<char> buffer(new char[size], std::default_delete<char[]>());
+	memcpy(buffer.get(), In.get() + InStart, pending);
+
+	if (!InRing)
+	{
+		pLoop->ReleaseBuffer(In);
+	}
+
+	In = buffer;
+	InRing = false;
+	InSize = size;
+	InStart = 0;
+	InEnd = pending;
+
+	return true;
+}
+
+// Idle connections don't keep a buffer
+void SERVER_CONNECTION::ReleaseBuffer()
+{
+	if (In && InStart == InEnd)
+	{
+		// Ring buffers go back to the ring instead, once they're
+		// no longer used
+		if (!InRing && InSize == pLoop->pServer->Config.ReadBufferSize)
+		{
+			pLoop->ReleaseBuffer(In);
+		}
+
+		In.reset();
+		InSize = InStart = InEnd = 0;
+		InRing = false;
+	}
+}
+
+//
+// Waiting for a handler to answer before taking any more in, or
+// to read what's already come in, or for the client to take most
+// of what it's been sent.
+//
+bool SERVER_CONNECTION::Paused() const
+{
+	if (State == CONNECTION_WEBSOCKET)
+	{
+		return Websocket && Websocket->m_MessageBytes >= pLoop->pServer->Config.MaxRequestSize;
+	}
+
+	if (State != CONNECTION_HTTP)
+	{
+		return false;
+	}
+
+	if (ReceivingChunked || ReceivingBody)
+	{
+		return Backlogged();
+	}
+
+	return Exchange != nullptr || Unsent() >= SERVER_LOW_WATER;
+}
+
+bool SERVER_CONNECTION::Backlogged() const
+{
+	return
+		Reading && Reading->m_Streaming && Reading->m_pConnection &&
+		Reading->m_BodyIn.size() >= pLoop->pServer->Config.MaxRequestSize;
+}
+
+void SERVER_CONNECTION::Process()
+{
+	const SERVER_CONFIG& config = pLoop->pServer->Config;
+
+	if (InProcess)
+	{
+		return;
+	}
+
+	InProcess = true;
+
+	while (State == CONNECTION_HTTP)
+	{
+		if (ReceivingChunked || ReceivingBody)
+		{
+			if (!ReceiveBody())
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		// Pipelined requests wait for the one before to be answered,
+		// and for the client to take most of the answers so far
+		if (Exchange || Unsent() >= SERVER_LOW_WATER || InStart == InEnd)
+		{
+			break;
+		}
+
+		SERVER_EXCHANGE exchange(new ServerExchange());
+
+		//
+		// Streamed requests go to the handler as soon as the header's
+		// in, and the body follows.
+		//
+		if (config.StreamBodies)
+		{
+			// Clients may send a stray CRLF between requests
+			while (InStart < InEnd && (In.get()[InStart] == '\r' || In.get()[InStart] == '\n'))
+			{
+				InStart++;
+			}
+
+			if (InStart == InEnd)
+			{
+				break;
+			}
+
+			RequestHeader& request = exchange->m_Request;
+			SIZE_T bodyOffset = 0;
+			ULONGLONG length = 0;
+
+			REQUEST_PARSE_RESULT result = request.ParseInPlace(
+				std::shared_ptr<const char>(In, In.get() + InStart),
+				InEnd - InStart,
+				&bodyOffset);
+
+			if (result == REQUEST_PARSE_INCOMPLETE)
+			{
+				break;
+			}
+
+			if (result != REQUEST_PARSE_OK ||
+				(request.FindHeader(HEADER_TRANSFER_ENCODING, nullptr) && !request.Chunked()) ||
+				(request.FindHeader(HEADER_CONTENT_LENGTH, nullptr) && !request.ContentLength(&length)))
+			{
+				SendError(RESPONSE_BADREQUEST);
+				break;
+			}
+
+			exchange->m_HeaderText.Data = In.get() + InStart;
+			exchange->m_HeaderText.Length = bodyOffset;
+			exchange->m_Streaming = true;
+
+			InStart += bodyOffset;
+
+			if (request.FindHeader(HEADER_TRANSFER_ENCODING, nullptr))
+			{
+				ReceivingChunked = true;
+				Chunked.Reset();
+				Chunked.MaxBodySize = (ULONGLONG) -1;
+			}
+			else
+			{
+				ReceivingBody = length != 0;
+				BodyRemaining = length;
+			}
+
+			if (ReceivingChunked || ReceivingBody)
+			{
+				Reading = exchange;
+			}
+			else
+			{
+				exchange->m_BodyDone = true;
+			}
+
+			Dispatch(exchange);
+			continue;
+		}
+
+		REQUEST_BATCH_ENTRY entry;
+		SIZE_T consumed;
+
+		SIZE_T count = ParseRequestBatch(
+			std::shared_ptr<const char>(In, In.get() + InStart),
+			InEnd - InStart,
+			&exchange->m_Request,
+			&entry,
+			1,
+			&consumed);
+
+		if (!count)
+		{
+			// Only stray line breaks, or not all of it yet
+			InStart += consumed;
+			break;
+		}
+
+		if (entry.Result != REQUEST_PARSE_OK || entry.BodyLength > config.MaxRequestSize)
+		{
+			SendError(RESPONSE_BADREQUEST);
+			break;
+		}
+
+		exchange->m_HeaderText.Data = In.get() + InStart + entry.Offset;
+		exchange->m_HeaderText.Length = entry.BodyOffset - entry.Offset;
+
+		if (entry.Chunked)
+		{
+			InStart += entry.BodyOffset;
+
+			Reading = exchange;
+			ReceivingChunked = true;
+			Chunked.Reset();
+			Chunked.MaxBodySize = config.MaxRequestSize;
+			continue;
+		}
+
+		exchange->m_Body.Data = In.get() + InStart + entry.BodyOffset;
+		exchange->m_Body.Length = (SIZE_T) entry.BodyLength;
+
+		InStart += consumed;
+
+		Dispatch(exchange);
+	}
+
+	if (State == CONNECTION_WEBSOCKET)
+	{
+		ProcessWebsocket();
+	}
+
+	InProcess = false;
+}
+
+//
+// Takes in what's come of the body that's on its way: all of it
+// before the handler's called, or as it comes if it's streamed. 
+// Returns true once it's all in.
+//
+bool SERVER_CONNECTION::ReceiveBody()
+{
+	ServerExchange* pExchange = Reading.get();
+	bool streaming = pExchange->m_Streaming;
+	bool done = false;
+	SIZE_T arrived = 0;
+
+	while (InStart < InEnd && !Backlogged())
+	{
+		StringView slice;
+
+		if (ReceivingChunked)
+		{
+			SIZE_T used;
+			CHUNKED_RESULT result = Chunked.Decode(In.get() + InStart, InEnd - InStart, &used, &slice);
+			InStart += used;
+
+			if (result == CHUNKED_ERROR)
+			{
+				SendError(RESPONSE_BADREQUEST);
+				return false;
+			}
+
+			if (result == CHUNKED_DONE)
+			{
+				done = true;
+				break;
+			}
+
+			if (result != CHUNKED_DATA)
+			{
+				break;
+			}
+		}
+		else
+		{
+			slice.Data = In.get() + InStart;
+			slice.Length = InEnd - InStart;
+
+			if (slice.Length > BodyRemaining)
+			{
+				slice.Length = (SIZE_T) BodyRemaining;
+			}
+
+			InStart += slice.Length;
+			BodyRemaining -= slice.Length;
+			done = !BodyRemaining;
+		}
+
+		// Once it's been answered, the rest is thrown away
+		if (!streaming)
+		{
+			pExchange->m_ChunkedBody.append(slice.Data, slice.Length);
+		}
+		else if (pExchange->m_pConnection)
+		{
+			pExchange->m_BodyIn.append(slice.Data, slice.Length);
+			arrived += slice.Length;
+		}
+
+		if (done)
+		{
+			break;
+		}
+	}
+
+	if (!done)
+	{
+		if (arrived)
+		{
+			Fire(pExchange->m_OnBody);
+		}
+
+		return false;
+	}
+
+	SERVER_EXCHANGE exchange;
+	exchange.swap(Reading);
+
+	ReceivingChunked = false;
+	ReceivingBody = false;
+	pExchange->m_BodyDone = true;
+
+	if (streaming)
+	{
+		Fire(pExchange->m_OnBody);
+		return true;
+	}
+
+	pExchange->m_Body.Data = pExchange->m_ChunkedBody.data();
+	pExchange->m_Body.Length = pExchange->m_ChunkedBody.size();
+
+	Dispatch(exchange);
+	return true;
+}
+
+void SERVER_CONNECTION::Dispatch(
+	const SERVER_EXCHANGE& exchange)
+{
+	SERVER_DATA* pServer = pLoop->pServer;
+
+	Exchange = exchange;
+	exchange->m_pConnection = this;
+	Count(pLoop->Stats.Requests, 1);
+
+	exchange->Response.NegotiateConnection(exchange->m_Request);
+	exchange->Response.AddDateHeader();
+
+	if ((pServer->Websocket.OnMessage || pServer->Websocket.OnOpen) && IsWebsocketRequest(exchange->m_Request))
+	{
+		Upgrade(exchange);
+		return;
+	}
+
+	if (pServer->Handler)
+	{
+		pServer->Handler(exchange);
+		return;
+	}
+
+	exchange->Response.Code = RESPONSE_NOTFOUND;
+	exchange->Response.AddBinaryHeaders(0, "text/plain");
+	exchange->Send(nullptr, 0);
+}
+
+void SERVER_CONNECTION::Upgrade(
+	const SERVER_EXCHANGE& exchange)
+{
+	SERVER_DATA* pServer = pLoop->pServer;
+	const RequestHeader& request = exchange->m_Request;
+	ResponseHeaderBuilder& response = exchange->Response;
+
+	if (pServer->Websocket.Accept && !pServer->Websocket.Accept(request))
+	{
+		response.Code = RESPONSE_FORBIDDEN;
+		response.AddBinaryHeaders(0, "text/plain");
+		exchange->Send(nullptr, 0);
+		return;
+	}
+
+	// A streamed handshake can't have a body still to come
+	if (ReceivingChunked || ReceivingBody ||
+		BuildWebsocketRequestResponse(request, &response) != WS_RESPONSE_OK)
+	{
+		SendError(RESPONSE_BADREQUEST);
+		return;
+	}
+
+#if !defined(HTTP_NO_DEFLATE)
+	WS_DEFLATE_PARAMS params;
+	DefaultWebsocketDeflateParams(&params);
+
+	if (pServer->Config.EnableDeflate && NegotiateWebsocketDeflate(request, &params))
+	{
+		AddWebsocketDeflateHeader(params, &response);
+		Deflate.reset(new WebsocketDeflate(params, &pLoop->DeflatePool));
+		Deflate->MaxMessageSize = pServer->Config.MaxRequestSize;
+	}
+#endif
+
+	String header;
+	response.Build(header);
+	Queue(header);
+
+	//
+	// The handshake request is kept, but as its own copy: the
+	// parsed one holds on to the whole receive buffer.
+	//
+	SERVER_EXCHANGE handshake(new ServerExchange());
+	String text(exchange->m_HeaderText.Data, exchange->m_HeaderText.Length);
+	handshake->m_Request.Parse(text.c_str(), nullptr);
+
+	exchange->m_pConnection = nullptr;
+	Exchange.reset();
+
+	State = CONNECTION_WEBSOCKET;
+
+	Assembler.reset(new WebsocketMessageAssembler(&pLoop->BufferPool));
+	Assembler->MaxMessageSize = pServer->Config.MaxRequestSize;
+#if !defined(HTTP_NO_DEFLATE)
+	Assembler->AllowCompressed = Deflate != nullptr;
+#endif
+
+	Websocket.reset(new ServerWebsocket());
+	Websocket->m_Handshake = handshake;
+	Websocket->m_pConnection = this;
+
+	pLoop->MarkDirty(this);
+
+	if (pServer->Websocket.OnOpen)
+	{
+		SERVER_WEBSOCKET websocket = Websocket;
+		pServer->Websocket.OnOpen(websocket);
+	}
+}
+
+void SERVER_CONNECTION::ProcessWebsocket()
+{
+	SERVER_DATA* pServer = pLoop->pServer;
+
+	while (State == CONNECTION_WEBSOCKET && InStart < InEnd && !Paused())
+	{
+		SIZE_T used;
+		WS_MESSAGE message;
+
+		WS_MESSAGE_RESULT result = Assembler->Feed(In.get() + InStart, InEnd - InStart, &used, &message);
+		InStart += used;
+
+		if (result == WS_MESSAGE_NEED_MORE)
+		{
+			break;
+		}
+
+		if (result == WS_MESSAGE_ERROR)
+		{
+			SendClose(Assembler->Error());
+			break;
+		}
+
+		if (result == WS_MESSAGE_CONTROL)
+		{
+			StringView payload = { "", 0 };
+			if (message.PieceCount)
+			{
+				payload = message.Pieces[0];
+			}
+
+			if (message.OpCode == WS_FRAME_OPCODE_PING)
+			{
+				SendMessage(WS_FRAME_OPCODE_PONG, payload.Data, payload.Length);
+			}
+			else if (message.OpCode == WS_FRAME_OPCODE_CONNECTION_CLOSE)
+			{
+				//
+				// Send the client's reason back, as the RFC suggests,
+				// unless it's one that can't be sent, or half of one.
+				//
+				CloseReason = WS_CLOSE_NORMAL;
+				if (payload.Length >= 2)
+				{
+					CloseReason = (WS_CLOSE_REASON) (((BYTE) payload.Data[0] << 8) | (BYTE) payload.Data[1]);
+				}
+
+				if (payload.Length == 1 || !IsValidCloseReason(CloseReason))
+				{
+					CloseReason = WS_CLOSE_PROTOCOL_ERROR;
+				}
+
+				SendClose(CloseReason);
+			}
+
+			continue;
+		}
+
+		WS_MESSAGE plain = message;
+
+#if !defined(HTTP_NO_DEFLATE)
+		StringView piece;
+		if (message.Compressed)
+		{
+			WS_DEFLATE_RESULT inflated = Deflate->Decompress(message, pLoop->InflateScratch);
+			if (inflated != WS_DEFLATE_OK)
+			{
+				SendClose(inflated == WS_DEFLATE_TOO_LARGE ? WS_CLOSE_MESSAGE_TOO_LARGE : WS_CLOSE_INCONSISTENT_DATA);
+				break;
+			}
+
+			piece.Data = pLoop->InflateScratch.data();
+			piece.Length = pLoop->InflateScratch.size();
+
+			plain.Pieces = &piece;
+			plain.PieceCount = 1;
+			plain.Length = piece.Length;
+			plain.Compressed = false;
+		}
+#endif
+
+		Count(pLoop->Stats.WebsocketMessages, 1);
+
+		SERVER_WEBSOCKET websocket = Websocket;
+
+		if (pServer->Websocket.OnMessage)
+		{
+			pServer->Websocket.OnMessage(websocket, plain);
+			continue;
+		}
+
+		// Kept for Receive instead
+		SERVER_MESSAGE queued;
+		queued.OpCode = plain.OpCode;
+		queued.Data.reserve((SIZE_T) plain.Length);
+
+		for (SIZE_T i = 0; i < plain.PieceCount; ++i)
+		{
+			queued.Data.append(plain.Pieces[i].Data, plain.Pieces[i].Length);
+		}
+
+		websocket->m_MessageBytes += queued.Data.size();
+		websocket->m_Messages.push_back(std::move(queued));
+
+		Fire(websocket->m_OnReceivable);
+	}
+}
+
+void SERVER_CONNECTION::Respond(
+	ServerExchange* pExchange,
+	LPCVOID pBody,
+	SIZE_T BodyLength)
+{
+	// Keeps it alive if the handler didn't
+	SERVER_EXCHANGE exchange = Exchange;
+
+	String response;
+	if (pExchange->Response.Build(response) != RESPONSE_HEADER_OK)
+	{
+		SendError(RESPONSE_NOTIMPL);
+		return;
+	}
+
+	if (BodyLength && pExchange->m_Request.Method() != METHOD_HEAD)
+	{
+		response.append((LPCSTR) pBody, BodyLength);
+	}
+
+	Queue(response);
+	Complete(pExchange);
+}
+
+//
+// Sends the header with the first piece, then each piece as it
+// comes. With a Content-Length, they go as they are, and are held
+// to it. Without, they go as chunks, or as they are to a client 
+// that can't take chunks, which then has the connection closed.
+//
+void SERVER_CONNECTION::Write(
+	ServerExchange* pExchange,
+	LPCVOID pData,
+	SIZE_T Length,
+	bool Last)
+{
+	SERVER_EXCHANGE exchange = Exchange;
+	ResponseHeaderBuilder& response = pExchange->Response;
+	bool sendBody = pExchange->m_Request.Method() != METHOD_HEAD;
+
+	if (!pExchange->m_pWriter)
+	{
+		ULONGLONG length;
+
+		if (response.ContentLength(&length))
+		{
+			pExchange->m_BodyLeft = length;
+		}
+		else if (response.Protocol == PROTOCOL_HTTP_1_1)
+		{
+			response.AddCommonHeader(COMMON_HEADER_TRANSFER_ENCODING_CHUNKED);
+			pExchange->m_Chunked = true;
+		}
+		else
+		{
+			response.KeepAlive = false;
+		}
+
+		String header;
+		if (response.Build(header) != RESPONSE_HEADER_OK)
+		{
+			SendError(RESPONSE_NOTIMPL);
+			return;
+		}
+
+		String& output = pExchange->m_Output;
+		pExchange->m_pWriter.reset(new ChunkedResponseWriter([&output] (LPCVOID pPiece, SIZE_T PieceLength)
+		{
+			output.append((LPCSTR) pPiece, PieceLength);
+			return true;
+		}));
+
+		pExchange->m_pWriter->Begin(header);
+	}
+
+	if (sendBody && pExchange->m_Chunked)
+	{
+		if (Length)
+		{
+			pExchange->m_pWriter->Write(pData, Length);
+		}
+
+		if (Last)
+		{
+			pExchange->m_pWriter->Finish();
+		}
+	}
+	else if (sendBody)
+	{
+		ULONGLONG& left = pExchange->m_BodyLeft;
+		bool sized = left != (ULONGLONG) -1;
+
+		//
+		// More or less than the Content-Length would leave the 
+		// client out of step with us, so it's cut short at the 
+		// length, and either way the connection's closed after.
+		//
+		if (sized && Length > left)
+		{
+			Length = (SIZE_T) left;
+			response.KeepAlive = false;
+			Last = true;
+		}
+
+		pExchange->m_Output.append((LPCSTR) pData, Length);
+
+		if (sized)
+		{
+			left -= Length;
+
+			if (Last && left)
+			{
+				response.KeepAlive = false;
+			}
+		}
+	}
+
+	Queue(pExchange->m_Output);
+
+	// A handler that writes without waiting for OnWritable
+	if (OverLimit())
+	{
+		Close();
+		return;
+	}
+
+	if (Last)
+	{
+		Complete(pExchange);
+	}
+}
+
+void SERVER_CONNECTION::Complete(
+	ServerExchange* pExchange)
+{
+	pExchange->m_pConnection = nullptr;
+	Exchange.reset();
+
+	// The client gets as long to take the response as it had to ask
+	pLoop->Touch(this);
+
+	if (!pExchange->Response.KeepAlive)
+	{
+		State = CONNECTION_CLOSING;
+	}
+
+	Continue();
+}
+
+//
+// If it was answered later (or a handler's read what had backed
+// up), carry on with anything pipelined behind it, and with 
+// reading if that was held up.
+//
+void SERVER_CONNECTION::Continue()
+{
+	if (InProcess || (State != CONNECTION_HTTP && State != CONNECTION_WEBSOCKET))
+	{
+		return;
+	}
+
+	Process();
+
+	if (ReadReady && (State == CONNECTION_HTTP || State == CONNECTION_WEBSOCKET))
+	{
+		OnReadable();
+	}
+
+#if defined(SERVER_URING)
+	if (pLoop->Ring)
+	{
+		Resume();
+	}
+#endif
+}
+
+void SERVER_CONNECTION::SendError(
+	RESPONSE_CODE Code)
+{
+	ResponseHeaderBuilder response;
+	response.Code = Code;
+	response.KeepAlive = false;
+	response.AddBinaryHeaders(0, "text/plain");
+
+	String text;
+	response.Build(text);
+	Queue(text);
+
+	State = CONNECTION_CLOSING;
+
+	Detach();
+}
+
+bool SERVER_CONNECTION::SendMessage(
+	WS_FRAME_OPCODE OpCode,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength)
+{
+	if (IsControlOpCode(OpCode) && PayloadLength > WS_MAX_CONTROL_PAYLOAD)
+	{
+		return false;
+	}
+
+	WS_FRAME_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	info.FinalPacket = 1;
+	info.OpCode = OpCode;
+	info.PayloadLength = PayloadLength;
+
+#if !defined(HTTP_NO_DEFLATE)
+	if (Deflate && !IsControlOpCode(OpCode) && PayloadLength >= SERVER_MIN_COMPRESS)
+	{
+		if (Deflate->Compress(pPayload, PayloadLength, pLoop->DeflateScratch) != WS_DEFLATE_OK)
+		{
+			Close();
+			return false;
+		}
+
+		pPayload = pLoop->DeflateScratch.data();
+		info.PayloadLength = pLoop->DeflateScratch.size();
+		info.RSV1 = 1;
+	}
+#endif
+
+	// Small frames are gathered up; large ones go on their own
+	if (info.PayloadLength < Batch.MaxBatchSize)
+	{
+		WS_BATCH_RESULT result = Batch.Add(info, pPayload, pLoop->Now);
+
+		if (result == WS_BATCH_FULL)
+		{
+			QueueBatch();
+			Batch.Add(info, pPayload, pLoop->Now);
+		}
+	}
+	else
+	{
+		WS_PACKED_FRAME_HEADER header;
+		SetWebsocketFrame(&info, &header);
+
+		String frame;
+		frame.reserve(header.Length + (SIZE_T) info.PayloadLength);
+		frame.append((LPCSTR) header.Data, header.Length);
+		frame.append((LPCSTR) pPayload, (SIZE_T) info.PayloadLength);
+
+		Queue(frame);
+	}
+
+	pLoop->MarkDirty(this);
+
+	if (OverLimit())
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void SERVER_CONNECTION::SendClose(
+	WS_CLOSE_REASON Reason)
+{
+	BYTE payload[2] = { (BYTE) (Reason >> 8), (BYTE) Reason };
+
+	CloseReason = Reason;
+
+	SendMessage(WS_FRAME_OPCODE_CONNECTION_CLOSE, payload, sizeof(payload));
+
+	if (State == CONNECTION_WEBSOCKET)
+	{
+		State = CONNECTION_CLOSING;
+	}
+}
+
+// Takes Data's contents, leaving it empty
+void SERVER_CONNECTION::Queue(
+	String& Data)
+{
+	if (Data.empty())
+	{
+		return;
+	}
+
+	QueueBatch();
+
+	std::shared_ptr<String> owned = std::make_shared<String>();
+	owned->swap(Data);
+
+	OUTPUT_ITEM item;
+	item.Data = owned->data();
+	item.Length = owned->size();
+	item.Owner = owned;
+
+	Out.push_back(item);
+	OutBytes += item.Length;
+
+	pLoop->MarkDirty(this);
+}
+
+void SERVER_CONNECTION::Queue(
+	const WS_SHARED_FRAME& Frame)
+{
+	QueueBatch();
+
+	OUTPUT_ITEM item;
+	item.Owner = Frame;
+	item.Data = (LPCSTR) Frame->Data();
+	item.Length = Frame->Length();
+
+	Out.push_back(item);
+	OutBytes += item.Length;
+
+	pLoop->MarkDirty(this);
+}
+
+//
+// The batch always goes after what's queued, so to queue anything
+// else, what's in the batch has to be queued first.
+//
+void SERVER_CONNECTION::QueueBatch()
+{
+	if (Batch.Empty())
+	{
+		return;
+	}
+
+	String batch((LPCSTR) Batch.Data(), Batch.Length());
+	Batch.Clear();
+
+	Queue(batch);
+}
+
+ULONGLONG SERVER_CONNECTION::Unsent() const
+{
+	return OutBytes + Batch.Length();
+}
+
+bool SERVER_CONNECTION::OverLimit() const
+{
+	return Unsent() > pLoop->pServer->Config.MaxWriteQueue;
+}
+
+void SERVER_CONNECTION::Flush()
+{
+#if defined(SERVER_URING)
+	if (pLoop->Ring)
+	{
+		SubmitSend();
+		return;
+	}
+#endif
+
+	while (WriteReady && (!Out.empty() || !Batch.Empty()))
+	{
+		iovec iov[SERVER_MAX_IOV];
+		SIZE_T count = 0;
+		SIZE_T offset = OutOffset;
+
+		for (auto item = std::begin(Out); item != std::end(Out) && count < SERVER_MAX_IOV - 1; ++item)
+		{
+			iov[count].iov_base = (LPVOID) (item->Data + offset);
+			iov[count].iov_len = item->Length - offset;
+			count++;
+
+			offset = 0;
+		}
+
+		if (!Batch.Empty() && count < SERVER_MAX_IOV)
+		{
+			iov[count].iov_base = (LPVOID) Batch.Data();
+			iov[count].iov_len = Batch.Length();
+			count++;
+		}
+
+		msghdr message;
+		ZeroMemory(&message, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = count;
+
+		// MSG_NOSIGNAL: a client that's gone shouldn't kill us with SIGPIPE
+		ssize_t sent = sendmsg(Socket, &message, MSG_NOSIGNAL);
+
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				WriteReady = false;
+				break;
+			}
+
+			Close();
+			return;
+		}
+
+		Count(pLoop->Stats.BytesSent, (ULONGLONG) sent);
+		Consume((SIZE_T) sent);
+		pLoop->Touch(this);
+	}
+
+	Drained();
+
+	if (State == CONNECTION_CLOSING && Out.empty() && Batch.Empty())
+	{
+		Close();
+	}
+}
+
+void SERVER_CONNECTION::Consume(
+	SIZE_T BytesSent)
+{
+	OutBytes -= BytesSent < OutBytes ? BytesSent : OutBytes;
+
+	while (BytesSent && !Out.empty())
+	{
+		SIZE_T remaining = Out.front().Length - OutOffset;
+
+		if (BytesSent < remaining)
+		{
+			OutOffset += BytesSent;
+			return;
+		}
+
+		BytesSent -= remaining;
+		OutOffset = 0;
+		Out.pop_front();
+	}
+
+	Batch.Consume(BytesSent);
+}
+
+//
+// A handler still owes a response. Waiting on the client doesn't
+// count, whether for the rest of a streamed body or for room to
+// write: a client that stalls has to time out like any other, and
+// sending touches the connection whenever it gets anywhere.
+//
+bool SERVER_CONNECTION::Busy() const
+{
+	return Exchange && Exchange != Reading && !Exchange->m_OnWritable;
+}
+
+//
+// Lets a handler that's waiting to write carry on, or the requests
+// that were held up behind what's been sent.
+//
+void SERVER_CONNECTION::Drained()
+{
+	if (Exchange)
+	{
+		if (Exchange->m_OnWritable && Exchange->Writable())
+		{
+			SERVER_EXCHANGE exchange = Exchange;
+			Fire(exchange->m_OnWritable);
+		}
+
+		return;
+	}
+
+	if (State == CONNECTION_HTTP && Unsent() < SERVER_LOW_WATER)
+	{
+		Continue();
+	}
+}
+
+void SERVER_CONNECTION::Close()
+{
+	if (State == CONNECTION_CLOSED)
+	{
+		return;
+	}
+
+	State = CONNECTION_CLOSED;
+
+#if defined(SERVER_URING)
+	if (pLoop->Ring)
+	{
+		//
+		// Anything queued for the socket has to be submitted before 
+		// its descriptor can be reused, and the requests still 
+		// waiting on it only end once it's shut down.
+		//
+		pLoop->Ring->Submit();
+		shutdown(Socket, SHUT_RDWR);
+
+		Held.clear();
+
+		if (Starved)
+		{
+			std::vector<SERVER_CONNECTION*>& starved = pLoop->Starved;
+			starved.erase(std::find(std::begin(starved), std::end(starved), this));
+			Starved = false;
+		}
+	}
+#endif
+
+	// Closing it takes it out of the epoll set too
+	close(Socket);
+	Socket = -1;
+
+	// A send that's in flight is still reading from it
+	if (!Sending)
+	{
+		Out.clear();
+	}
+
+	Batch.Clear();
+	InStart = InEnd;
+	ReleaseBuffer();
+	In.reset();
+
+	pLoop->Connections.erase(Position);
+	pLoop->ClosedList.push_back(this);
+	pLoop->ConnectionCount--;
+	pLoop->Stats.Open.store(pLoop->ConnectionCount, std::memory_order_relaxed);
+
+	if (Websocket)
+	{
+		SERVER_WEBSOCKET websocket;
+		websocket.swap(Websocket);
+		websocket->m_pConnection = nullptr;
+
+		const WEBSOCKET_HANDLERS& handlers = pLoop->pServer->Websocket;
+		if (handlers.OnClose)
+		{
+			handlers.OnClose(websocket, CloseReason);
+		}
+
+		Fire(websocket->m_OnReceivable);
+	}
+
+	Detach();
+}
+
+//
+// Lets go of the exchanges, so that a handler can't answer after
+// all, and wakes anything that was waiting on them so that it can
+// finish.
+//
+void SERVER_CONNECTION::Detach()
+{
+	SERVER_EXCHANGE exchange;
+	exchange.swap(Exchange);
+
+	SERVER_EXCHANGE reading;
+	reading.swap(Reading);
+
+	ReceivingChunked = false;
+	ReceivingBody = false;
+
+	if (exchange)
+	{
+		exchange->m_pConnection = nullptr;
+		exchange->m_BodyDone = true;
+
+		Fire(exchange->m_OnWritable);
+		Fire(exchange->m_OnBody);
+	}
+
+	if (reading)
+	{
+		reading->m_BodyDone = true;
+
+		Fire(reading->m_OnBody);
+	}
+}
+
+/*
+	LOOP
+*/
+SERVER_LOOP::SERVER_LOOP(
+	SERVER_DATA* pServer)
+	: pServer(pServer)
+	, Epoll(-1)
+	, Listen(-1)
+	, Wake(-1)
+	, Now(MonotonicMilliseconds())
+	, Cpu(-1)
+	, ConnectionCount(0)
+	, Finished(nullptr)
+{
+}
+
+SERVER_LOOP::~SERVER_LOOP()
+{
+	CloseAll();
+
+#if defined(SERVER_URING)
+	// Whatever's still in flight goes with the ring
+	Ring.reset();
+
+	for (auto connection = std::begin(ClosedList); connection != std::end(ClosedList); ++connection)
+	{
+		delete *connection;
+	}
+#endif
+
+	if (Listen >= 0) close(Listen);
+	if (Wake >= 0) close(Wake);
+	if (Epoll >= 0) close(Epoll);
+}
+
+//
+// Sets up the loop's epoll set and its own listening socket. With 
+// SharePort, the socket's bound with SO_REUSEPORT so that the other
+// loops can bind the same address, and the kernel shares the new 
+// connections out between them.
+//
+SERVER_RESULT SERVER_LOOP::Open(
+	const sockaddr* pAddress,
+	socklen_t AddressLength,
+	bool SharePort)
+{
+	Listen = socket(pAddress->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (Listen < 0)
+	{
+		return SERVER_SOCKET_FAILED;
+	}
+
+	INT one = 1;
+	setsockopt(Listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (SharePort && setsockopt(Listen, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+	{
+		return SERVER_SOCKET_FAILED;
+	}
+
+	if (bind(Listen, pAddress, AddressLength) < 0)
+	{
+		return SERVER_BIND_FAILED;
+	}
+
+	if (listen(Listen, pServer->Config.Backlog) < 0)
+	{
+		return SERVER_LISTEN_FAILED;
+	}
+
+	Wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (Wake < 0)
+	{
+		return SERVER_EPOLL_FAILED;
+	}
+
+	const SERVER_CONFIG& config = pServer->Config;
+
+#if defined(SERVER_URING)
+	if (config.Io != SERVER_IO_EPOLL)
+	{
+		Ring.reset(new URING());
+		if (Ring->Open(SERVER_URING_ENTRIES, config.RingBuffers, config.ReadBufferSize))
+		{
+			return SERVER_OK;
+		}
+
+		Ring.reset();
+	}
+#endif
+
+	if (config.Io == SERVER_IO_URING)
+	{
+		return SERVER_URING_FAILED;
+	}
+
+	Epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (Epoll < 0)
+	{
+		return SERVER_EPOLL_FAILED;
+	}
+
+	// Level-triggered, so accepting can stop part way
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &Listen;
+
+	if (epoll_ctl(Epoll, EPOLL_CTL_ADD, Listen, &event) < 0)
+	{
+		return SERVER_EPOLL_FAILED;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = &Wake;
+
+	if (epoll_ctl(Epoll, EPOLL_CTL_ADD, Wake, &event) < 0)
+	{
+		return SERVER_EPOLL_FAILED;
+	}
+
+	return SERVER_OK;
+}
+
+std::shared_ptr<char> SERVER_LOOP::AcquireBuffer()
+{
+	if (FreeBuffers.empty())
+	{
+		return std::shared_ptr<char>(new char[pServer->Config.ReadBufferSize], std::default_delete<char[]>());
+	}
+
+	std::shared_ptr<char> buffer = FreeBuffers.back();
+	FreeBuffers.pop_back();
+
+	return buffer;
+}
+
+//
+// Only keeps buffers nothing else is using, and only ones of the
+// usual size.
+//
+void SERVER_LOOP::ReleaseBuffer(
+	std::shared_ptr<char>& Buffer)
+{
+	if (Buffer && Buffer.unique() && FreeBuffers.size() < SERVER_MAX_FREE_BUFFERS)
+	{
+		FreeBuffers.push_back(Buffer);
+	}
+
+	Buffer.reset();
+}
+
+void SERVER_LOOP::Touch(
+	SERVER_CONNECTION* pConnection)
+{
+	pConnection->LastActive = Now;
+	Connections.splice(Connections.end(), Connections, pConnection->Position);
+}
+
+void SERVER_LOOP::MarkDirty(
+	SERVER_CONNECTION* pConnection)
+{
+	if (!pConnection->Dirty)
+	{
+		pConnection->Dirty = true;
+		DirtyList.push_back(pConnection);
+	}
+}
+
+SERVER_CONNECTION* SERVER_LOOP::Add(
+	INT Socket)
+{
+	if (ConnectionCount >= pServer->Config.MaxConnections)
+	{
+		close(Socket);
+		return nullptr;
+	}
+
+	// We do our own batching
+	INT one = 1;
+	setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	SERVER_CONNECTION* pConnection = new SERVER_CONNECTION(this, Socket);
+	pConnection->Position = Connections.insert(Connections.end(), pConnection);
+	ConnectionCount++;
+	Count(Stats.Accepted, 1);
+	Stats.Open.store(ConnectionCount, std::memory_order_relaxed);
+
+	return pConnection;
+}
+
+void SERVER_LOOP::Accept()
+{
+	for (;;)
+	{
+		INT socket = accept4(Listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (socket < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+
+			// EAGAIN, or out of descriptors; the listening socket
+			// is level-triggered, so it'll come round again.
+			return;
+		}
+
+		SERVER_CONNECTION* pConnection = Add(socket);
+		if (!pConnection)
+		{
+			continue;
+		}
+
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = pConnection;
+
+		if (epoll_ctl(Epoll, EPOLL_CTL_ADD, socket, &event) < 0)
+		{
+			pConnection->Close();
+		}
+	}
+}
+
+// How long epoll_wait can wait before the next connection times out
+INT SERVER_LOOP::Timeout() const
+{
+	UINT idle = pServer->Config.IdleTimeout;
+
+	if (!idle || Connections.empty())
+	{
+		return -1;
+	}
+
+	ULONGLONG expires = Connections.front()->LastActive + (ULONGLONG) idle * 1000;
+
+	return expires > Now ? (INT) (expires - Now) : 0;
+}
+
+void SERVER_LOOP::Run()
+{
+#if defined(SERVER_URING)
+	if (Ring)
+	{
+		RunUring();
+		return;
+	}
+#endif
+
+	epoll_event events[SERVER_MAX_EVENTS];
+
+	while (!pServer->Stopping)
+	{
+		INT count = epoll_wait(Epoll, events, SERVER_MAX_EVENTS, Timeout());
+		Now = MonotonicMilliseconds();
+
+		for (INT i = 0; i < count; ++i)
+		{
+			LPVOID pTag = events[i].data.ptr;
+			UINT32 flags = events[i].events;
+
+			if (pTag == &Listen)
+			{
+				Accept();
+				continue;
+			}
+
+			if (pTag == &Wake)
+			{
+				ULONGLONG value;
+				ssize_t ignored = read(Wake, &value, sizeof(value));
+				(void) ignored;
+				continue;
+			}
+
+			SERVER_CONNECTION* pConnection = (SERVER_CONNECTION*) pTag;
+
+			if (pConnection->State == CONNECTION_CLOSED)
+			{
+				continue;
+			}
+
+			if (flags & EPOLLOUT)
+			{
+				pConnection->WriteReady = true;
+				MarkDirty(pConnection);
+			}
+
+			// Errors and hang-ups show up as a failed recv
+			if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				pConnection->OnReadable();
+			}
+		}
+
+		EndTurn();
+	}
+
+	CloseAll();
+}
+
+void SERVER_LOOP::EndTurn()
+{
+	TakeFinished();
+
+	//
+	// Send everything that was queued this turn. Flushing can
+	// close connections, and their OnClose can queue more on
+	// others, so the list can grow as we go.
+	//
+	for (SIZE_T i = 0; i < DirtyList.size(); ++i)
+	{
+		SERVER_CONNECTION* pConnection = DirtyList[i];
+		pConnection->Dirty = false;
+
+		if (pConnection->State != CONNECTION_CLOSED)
+		{
+			pConnection->Flush();
+		}
+	}
+	DirtyList.clear();
+
+	//
+	// Close the ones that have been quiet too long. One that's still
+	// waiting on a handler isn't idle, so it goes to the back instead.
+	//
+	UINT idle = pServer->Config.IdleTimeout;
+	while (idle && !Connections.empty() &&
+		Connections.front()->LastActive + (ULONGLONG) idle * 1000 <= Now)
+	{
+		SERVER_CONNECTION* pConnection = Connections.front();
+
+		if (pConnection->Busy())
+		{
+			Touch(pConnection);
+			continue;
+		}
+
+		pConnection->Close();
+	}
+
+	FreeClosed();
+}
+
+//
+// Called by the workers. Only the push that finds the stack empty 
+// needs to wake the loop: the others' jobs are taken with it.
+//
+void SERVER_LOOP::Finish(
+	WORKER_JOB* pJob)
+{
+	WORKER_JOB* pHead = Finished.load(std::memory_order_relaxed);
+
+	do
+	{
+		pJob->pNext = pHead;
+	}
+	while (!Finished.compare_exchange_weak(pHead, pJob, std::memory_order_release, std::memory_order_relaxed));
+
+	if (!pHead)
+	{
+		ULONGLONG value = 1;
+		ssize_t ignored = write(Wake, &value, sizeof(value));
+		(void) ignored;
+	}
+}
+
+// Sends what the workers came up with, in the order they finished
+void SERVER_LOOP::TakeFinished()
+{
+	if (!Finished.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+
+	WORKER_JOB* pJob = Finished.exchange(nullptr, std::memory_order_acquire);
+	WORKER_JOB* pOrdered = nullptr;
+
+	while (pJob)
+	{
+		WORKER_JOB* pNext = pJob->pNext;
+		pJob->pNext = pOrdered;
+		pOrdered = pJob;
+		pJob = pNext;
+	}
+
+	while (pOrdered)
+	{
+		pJob = pOrdered;
+		pOrdered = pJob->pNext;
+
+		// The client may have gone in the meantime
+		if (pJob->Exchange->Pending())
+		{
+			pJob->Exchange->Send(pJob->Body.data(), pJob->Body.size());
+		}
+
+		delete pJob;
+	}
+}
+
+void SERVER_LOOP::CloseAll()
+{
+	while (!Connections.empty())
+	{
+		Connections.front()->Close();
+	}
+
+	DirtyList.clear();
+	FreeClosed();
+}
+
+// Those that io_uring still has requests for are kept for later
+void SERVER_LOOP::FreeClosed()
+{
+	SIZE_T kept = 0;
+
+	for (auto connection = std::begin(ClosedList); connection != std::end(ClosedList); ++connection)
+	{
+		if ((*connection)->InFlight)
+		{
+			ClosedList[kept++] = *connection;
+			continue;
+		}
+
+		delete *connection;
+	}
+
+	ClosedList.resize(kept);
+}
+
+#if defined(SERVER_URING)
+
+/*
+	IO_URING
+
+	There's no liburing, just the system calls and the structures 
+	from linux/io_uring.h. Only the loop's own thread submits, and
+	the ring's created disabled so that the thread can claim it.
+*/
+inline INT UringSetup(UINT Entries, io_uring_params* pParams)
+{
+	return (INT) syscall(__NR_io_uring_setup, Entries, pParams);
+}
+
+inline INT UringEnter(INT Fd, UINT Submit, UINT WaitFor, UINT Flags, LPVOID pArg, SIZE_T ArgSize)
+{
+	return (INT) syscall(__NR_io_uring_enter, Fd, Submit, WaitFor, Flags, pArg, ArgSize);
+}
+
+inline INT UringRegister(INT Fd, UINT OpCode, LPVOID pArg, UINT Count)
+{
+	return (INT) syscall(__NR_io_uring_register, Fd, OpCode, pArg, Count);
+}
+
+inline ULONGLONG UringData(SERVER_CONNECTION* pConnection, URING_OP Op)
+{
+	return (ULONGLONG) (UINT_PTR) pConnection | Op;
+}
+
+URING_BUFFERS::URING_BUFFERS()
+	: pRing(nullptr)
+	, pData(nullptr)
+	, Count(0)
+	, Size(0)
+	, Tail(0)
+	, Returned(0)
+{
+}
+
+URING_BUFFERS::~URING_BUFFERS()
+{
+	if (pRing) munmap(pRing, Count * sizeof(io_uring_buf));
+	if (pData) munmap(pData, Count * Size);
+}
+
+bool URING_BUFFERS::Open(
+	UINT BufferCount,
+	SIZE_T BufferSize)
+{
+	// The ring's size has to be a power of two
+	Count = 1;
+	while (Count < BufferCount && Count < SERVER_URING_MAX_BUFFERS)
+	{
+		Count *= 2;
+	}
+
+	Size = BufferSize;
+
+	LPVOID pMemory = mmap(nullptr, Count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pMemory == MAP_FAILED)
+	{
+		return false;
+	}
+	pRing = (io_uring_buf_ring*) pMemory;
+
+	pMemory = mmap(nullptr, Count * Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pMemory == MAP_FAILED)
+	{
+		return false;
+	}
+	pData = (LPBYTE) pMemory;
+
+	for (UINT i = 0; i < Count; ++i)
+	{
+		Recycle((USHORT) i);
+	}
+
+	Returned = 0;
+
+	return true;
+}
+
+void URING_BUFFERS::Recycle(
+	USHORT Id)
+{
+	// Not pRing->bufs: in C++ the header's flexible array ends up 
+	// after an empty struct, which takes up space
+	io_uring_buf* pBuffer = (io_uring_buf*) pRing + (Tail & (Count - 1));
+	pBuffer->addr = (ULONGLONG) (UINT_PTR) (pData + (SIZE_T) Id * Size);
+	pBuffer->len = (UINT32) Size;
+	pBuffer->bid = Id;
+
+	Tail++;
+	__atomic_store_n(&pRing->tail, Tail, __ATOMIC_RELEASE);
+
+	Returned++;
+}
+
+URING::URING()
+	: Fd(-1)
+	, pRings(MAP_FAILED)
+	, RingsSize(0)
+	, pSqes((io_uring_sqe*) MAP_FAILED)
+	, SqesSize(0)
+	, SqTail(0)
+	, Outstanding(0)
+	, WakeValue(0)
+{
+}
+
+URING::~URING()
+{
+	if (pSqes != MAP_FAILED) munmap(pSqes, SqesSize);
+	if (pRings != MAP_FAILED) munmap(pRings, RingsSize);
+	if (Fd >= 0) close(Fd);
+}
+
+bool URING::Open(
+	UINT Entries,
+	UINT BufferCount,
+	SIZE_T BufferSize)
+{
+	io_uring_params params;
+	ZeroMemory(&params, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+	params.cq_entries = Entries * 4;
+
+	Fd = UringSetup(Entries, &params);
+	if (Fd < 0)
+	{
+		return false;
+	}
+
+	UINT needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & needed) != needed)
+	{
+		return false;
+	}
+
+	SIZE_T sqSize = params.sq_off.array + params.sq_entries * sizeof(UINT);
+	SIZE_T cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	RingsSize = sqSize > cqSize ? sqSize : cqSize;
+	pRings = mmap(nullptr, RingsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING);
+	if (pRings == MAP_FAILED)
+	{
+		return false;
+	}
+
+	SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	pSqes = (io_uring_sqe*) mmap(nullptr, SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES);
+	if (pSqes == MAP_FAILED)
+	{
+		return false;
+	}
+
+	LPBYTE pBase = (LPBYTE) pRings;
+
+	pSqHead = (UINT*) (pBase + params.sq_off.head);
+	pSqTail = (UINT*) (pBase + params.sq_off.tail);
+	SqMask = *(UINT*) (pBase + params.sq_off.ring_mask);
+	SqEntries = params.sq_entries;
+	SqTail = *pSqTail;
+
+	// Each slot always holds the same entry
+	UINT* pArray = (UINT*) (pBase + params.sq_off.array);
+	for (UINT i = 0; i < SqEntries; ++i)
+	{
+		pArray[i] = i;
+	}
+
+	pCqHead = (UINT*) (pBase + params.cq_off.head);
+	pCqTail = (UINT*) (pBase + params.cq_off.tail);
+	CqMask = *(UINT*) (pBase + params.cq_off.ring_mask);
+	pCqes = (io_uring_cqe*) (pBase + params.cq_off.cqes);
+
+	Buffers = std::make_shared<URING_BUFFERS>();
+	if (!Buffers->Open(BufferCount, BufferSize))
+	{
+		return false;
+	}
+
+	io_uring_buf_reg registration;
+	ZeroMemory(&registration, sizeof(registration));
+	registration.ring_addr = (ULONGLONG) (UINT_PTR) Buffers->pRing;
+	registration.ring_entries = Buffers->Count;
+	registration.bgid = 0;
+
+	return UringRegister(Fd, IORING_REGISTER_PBUF_RING, &registration, 1) == 0;
+}
+
+// Called on the loop's thread, which from then on is the only one
+// that can submit
+bool URING::Enable()
+{
+	return UringRegister(Fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) == 0;
+}
+
+//
+// The next entry to fill in. Every entry gets at least one
+// completion, and the last one for it doesn't have IORING_CQE_F_MORE.
+//
+io_uring_sqe* URING::Next(
+	ULONGLONG UserData)
+{
+	if (SqTail - __atomic_load_n(pSqHead, __ATOMIC_ACQUIRE) >= SqEntries)
+	{
+		Submit();
+	}
+
+	io_uring_sqe* pSqe = &pSqes[SqTail & SqMask];
+	ZeroMemory(pSqe, sizeof(*pSqe));
+	pSqe->user_data = UserData;
+
+	SqTail++;
+	Outstanding++;
+
+	return pSqe;
+}
+
+void URING::Cancel(
+	ULONGLONG UserData)
+{
+	io_uring_sqe* pSqe = Next(URING_IGNORE);
+	pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+	pSqe->fd = -1;
+	pSqe->addr = UserData;
+}
+
+void URING::Submit()
+{
+	__atomic_store_n(pSqTail, SqTail, __ATOMIC_RELEASE);
+
+	UINT pending = SqTail - __atomic_load_n(pSqHead, __ATOMIC_ACQUIRE);
+	if (pending)
+	{
+		UringEnter(Fd, pending, 0, 0, nullptr, 0);
+	}
+}
+
+//
+// Submits what's queued and waits for at least one completion, or
+// for Timeout milliseconds (-1 for as long as it takes).
+//
+void URING::Wait(
+	INT Timeout)
+{
+	__atomic_store_n(pSqTail, SqTail, __ATOMIC_RELEASE);
+
+	UINT pending = SqTail - __atomic_load_n(pSqHead, __ATOMIC_ACQUIRE);
+
+	__kernel_timespec timeout;
+	timeout.tv_sec = Timeout / 1000;
+	timeout.tv_nsec = (Timeout % 1000) * 1000000LL;
+
+	io_uring_getevents_arg arg;
+	ZeroMemory(&arg, sizeof(arg));
+	if (Timeout >= 0)
+	{
+		arg.ts = (ULONGLONG) (UINT_PTR) &timeout;
+	}
+
+	UringEnter(Fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+//
+// Hands out a buffer the kernel's filled. It goes back in the ring
+// when the last reference to it goes.
+//
+std::shared_ptr<char> URING::Take(
+	USHORT Id)
+{
+	std::shared_ptr<URING_BUFFERS> buffers = Buffers;
+
+	return std::shared_ptr<char>((char*) buffers->pData + (SIZE_T) Id * buffers->Size, [buffers, Id] (char*)
+	{
+		buffers->Recycle(Id);
+	});
+}
+
+bool URING::Reap(
+	io_uring_cqe* pCqe)
+{
+	UINT head = *pCqHead;
+
+	if (head == __atomic_load_n(pCqTail, __ATOMIC_ACQUIRE))
+	{
+		return false;
+	}
+
+	*pCqe = pCqes[head & CqMask];
+	__atomic_store_n(pCqHead, head + 1, __ATOMIC_RELEASE);
+
+	if (!(pCqe->flags & IORING_CQE_F_MORE))
+	{
+		Outstanding--;
+	}
+
+	return true;
+}
+
+void SERVER_LOOP::Arm(
+	URING_OP Op)
+{
+	io_uring_sqe* pSqe = Ring->Next(Op);
+
+	if (Op == URING_ACCEPT)
+	{
+		pSqe->opcode = IORING_OP_ACCEPT;
+		pSqe->fd = Listen;
+		pSqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		pSqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	else
+	{
+		pSqe->opcode = IORING_OP_READ;
+		pSqe->fd = Wake;
+		pSqe->addr = (ULONGLONG) (UINT_PTR) &Ring->WakeValue;
+		pSqe->len = sizeof(Ring->WakeValue);
+		pSqe->off = (ULONGLONG) -1;
+	}
+}
+
+void SERVER_LOOP::RunUring()
+{
+	io_uring_cqe cqe;
+
+	Ring->Enable();
+	Arm(URING_ACCEPT);
+	Arm(URING_WAKE);
+
+	while (!pServer->Stopping)
+	{
+		Ring->Wait(Timeout());
+		Now = MonotonicMilliseconds();
+
+		while (Ring->Reap(&cqe))
+		{
+			Complete(cqe);
+		}
+
+		EndTurn();
+
+		// Give the ones the ring ran dry on another go, now that
+		// some buffers have come back
+		if (!Starved.empty() && Ring->Buffers->Returned)
+		{
+			std::vector<SERVER_CONNECTION*> starved;
+			starved.swap(Starved);
+
+			for (auto connection = std::begin(starved); connection != std::end(starved); ++connection)
+			{
+				(*connection)->Starved = false;
+				(*connection)->Receive();
+			}
+		}
+		Ring->Buffers->Returned = 0;
+	}
+
+	CloseAll();
+
+	//
+	// Nothing can be freed while the kernel still has requests for
+	// it, so wait for them all to finish.
+	//
+	Ring->Cancel(URING_ACCEPT);
+	Ring->Cancel(URING_WAKE);
+
+	for (UINT tries = 0; Ring->Outstanding && tries < 100; ++tries)
+	{
+		Ring->Wait(10);
+
+		while (Ring->Reap(&cqe))
+		{
+			Complete(cqe);
+		}
+
+		FreeClosed();
+	}
+}
+
+void SERVER_LOOP::Complete(
+	const io_uring_cqe& Cqe)
+{
+	URING_OP op = (URING_OP) (Cqe.user_data & URING_OP_MASK);
+	SERVER_CONNECTION* pConnection = (SERVER_CONNECTION*) (UINT_PTR) (Cqe.user_data & ~(ULONGLONG) URING_OP_MASK);
+	bool more = (Cqe.flags & IORING_CQE_F_MORE) != 0;
+
+	switch (op)
+	{
+	case URING_ACCEPT:
+		if (Cqe.res >= 0)
+		{
+			if (pServer->Stopping)
+			{
+				close(Cqe.res);
+			}
+			else if ((pConnection = Add(Cqe.res)) != nullptr)
+			{
+				pConnection->Receive();
+			}
+		}
+
+		if (!more && !pServer->Stopping)
+		{
+			Arm(URING_ACCEPT);
+		}
+		break;
+
+	case URING_WAKE:
+		if (!pServer->Stopping)
+		{
+			Arm(URING_WAKE);
+		}
+		break;
+
+	case URING_RECEIVE:
+		{
+			std::shared_ptr<char> buffer;
+			if (Cqe.flags & IORING_CQE_F_BUFFER)
+			{
+				buffer = Ring->Take((USHORT) (Cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			}
+
+			if (Cqe.res > 0 && buffer && pConnection->State != CONNECTION_CLOSED)
+			{
+				pConnection->OnReceived(buffer, (SIZE_T) Cqe.res);
+			}
+
+			if (!more)
+			{
+				pConnection->OnReceiveEnded(Cqe.res);
+			}
+		}
+		break;
+
+	case URING_SEND:
+		pConnection->OnSent(Cqe.res);
+		break;
+
+	default:
+		break;
+	}
+}
+
+//
+// Multishot: it stays armed, and each lot that arrives comes in a
+// buffer from the ring, until the ring runs out, the client goes,
+// or it's cancelled.
+//
+void SERVER_CONNECTION::Receive()
+{
+	if (ReceiveArmed || ReceiveHeld || Starved || (State != CONNECTION_HTTP && State != CONNECTION_WEBSOCKET))
+	{
+		return;
+	}
+
+	io_uring_sqe* pSqe = pLoop->Ring->Next(UringData(this, URING_RECEIVE));
+	pSqe->opcode = IORING_OP_RECV;
+	pSqe->fd = Socket;
+	pSqe->ioprio = IORING_RECV_MULTISHOT;
+	pSqe->flags = IOSQE_BUFFER_SELECT;
+	pSqe->buf_group = 0;
+
+	ReceiveArmed = true;
+	InFlight++;
+}
+
+//
+// With nothing left over, the ring buffer becomes the input as it
+// is, and requests are parsed straight out of it. Otherwise what's
+// come in is added to what's there.
+//
+void SERVER_CONNECTION::OnReceived(
+	std::shared_ptr<char>& Buffer,
+	SIZE_T Length)
+{
+	Count(pLoop->Stats.BytesReceived, Length);
+	pLoop->Touch(this);
+
+	if (State != CONNECTION_HTTP && State != CONNECTION_WEBSOCKET)
+	{
+		return;
+	}
+
+	if (Paused() || !Held.empty())
+	{
+		Hold(Buffer.get(), Length);
+		return;
+	}
+
+	if (!In || InStart == InEnd)
+	{
+		ReleaseBuffer();
+
+		In = Buffer;
+		InSize = pLoop->Ring->Buffers->Size;
+		InStart = 0;
+		InEnd = Length;
+		InRing = true;
+
+		Process();
+
+		// What's left waits in a buffer of our own, as it would if
+		// we were paused (see Hold)
+		if (InRing && InStart < InEnd)
+		{
+			if (State == CONNECTION_HTTP || State == CONNECTION_WEBSOCKET)
+			{
+				SIZE_T pending = InEnd - InStart;
+				std::shared_ptr<char> buffer = pLoop->AcquireBuffer();
+				memcpy(buffer.get(), In.get() + InStart, pending);
+
+				In = buffer;
+				InSize = pLoop->pServer->Config.ReadBufferSize;
+				InStart = 0;
+				InEnd = pending;
+				InRing = false;
+			}
+			else
+			{
+				InStart = InEnd;
+			}
+		}
+	}
+	else
+	{
+		Feed(Buffer.get(), Length);
+	}
+
+	// So that the ring gets it back
+	ReleaseBuffer();
+}
+
+//
+// Copies in what's been received, handling requests as they 
+// complete, as OnReadable does.
+//
+void SERVER_CONNECTION::Feed(
+	LPCSTR pData,
+	SIZE_T Length)
+{
+	while (Length && (State == CONNECTION_HTTP || State == CONNECTION_WEBSOCKET))
+	{
+		if (Paused())
+		{
+			Hold(pData, Length);
+			return;
+		}
+
+		if (!PrepareRead())
+		{
+			SendError(RESPONSE_BADREQUEST);
+			return;
+		}
+
+		SIZE_T room = InSize - InEnd;
+		SIZE_T copied = Length < room ? Length : room;
+
+		memcpy(In.get() + InEnd, pData, copied);
+		InEnd += copied;
+		pData += copied;
+		Length -= copied;
+
+		Process();
+	}
+}
+
+//
+// While a handler's still answering, what comes in is copied aside
+// (rather than keeping the ring's buffers from everyone else), and
+// receiving stops if it gets to be too much.
+//
+void SERVER_CONNECTION::Hold(
+	LPCSTR pData,
+	SIZE_T Length)
+{
+	Held.append(pData, Length);
+
+	if (Held.size() >= pLoop->pServer->Config.MaxRequestSize && !ReceiveHeld)
+	{
+		ReceiveHeld = true;
+
+		if (ReceiveArmed)
+		{
+			pLoop->Ring->Cancel(UringData(this, URING_RECEIVE));
+		}
+	}
+}
+
+void SERVER_CONNECTION::OnReceiveEnded(
+	INT Result)
+{
+	ReceiveArmed = false;
+	InFlight--;
+
+	if (State == CONNECTION_CLOSED)
+	{
+		return;
+	}
+
+	// The client's gone
+	if (Result == 0 || (Result < 0 && Result != -ENOBUFS && Result != -ECANCELED))
+	{
+		Close();
+		return;
+	}
+
+	if (Result == -ENOBUFS && !ReceiveHeld)
+	{
+		Starved = true;
+		pLoop->Starved.push_back(this);
+		return;
+	}
+
+	Receive();
+}
+
+// Carries on with what was held back, once the handler's answered
+void SERVER_CONNECTION::Resume()
+{
+	if (!Held.empty() && !Paused())
+	{
+		String held;
+		held.swap(Held);
+
+		Feed(held.data(), held.size());
+		ReleaseBuffer();
+	}
+
+	if (ReceiveHeld && Held.size() < pLoop->pServer->Config.MaxRequestSize)
+	{
+		ReceiveHeld = false;
+		Receive();
+	}
+}
+
+//
+// Only one send at a time, so that they can't go out of order.
+// It gathers up everything that's queued, the batch included.
+//
+void SERVER_CONNECTION::SubmitSend()
+{
+	if (Sending)
+	{
+		return;
+	}
+
+	// The batch can grow while the send's in flight, so it has to
+	// go in the queue
+	QueueBatch();
+
+	if (Out.empty())
+	{
+		if (State == CONNECTION_CLOSING)
+		{
+			Close();
+		}
+		return;
+	}
+
+	if (!SendVectors)
+	{
+		SendVectors.reset(new iovec[SERVER_MAX_IOV]);
+	}
+
+	SIZE_T count = 0;
+	SIZE_T offset = OutOffset;
+
+	for (auto item = std::begin(Out); item != std::end(Out) && count < SERVER_MAX_IOV; ++item)
+	{
+		SendVectors[count].iov_base = (LPVOID) (item->Data + offset);
+		SendVectors[count].iov_len = item->Length - offset;
+		count++;
+
+		offset = 0;
+	}
+
+	ZeroMemory(&SendHeader, sizeof(SendHeader));
+	SendHeader.msg_iov = SendVectors.get();
+	SendHeader.msg_iovlen = count;
+
+	io_uring_sqe* pSqe = pLoop->Ring->Next(UringData(this, URING_SEND));
+	pSqe->opcode = IORING_OP_SENDMSG;
+	pSqe->fd = Socket;
+	pSqe->addr = (ULONGLONG) (UINT_PTR) &SendHeader;
+	pSqe->len = 1;
+	pSqe->msg_flags = MSG_NOSIGNAL;
+
+	Sending = true;
+	InFlight++;
+}
+
+void SERVER_CONNECTION::OnSent(
+	INT Result)
+{
+	Sending = false;
+	InFlight--;
+
+	if (State == CONNECTION_CLOSED)
+	{
+		return;
+	}
+
+	if (Result < 0 && Result != -EINTR && Result != -EAGAIN)
+	{
+		Close();
+		return;
+	}
+
+	if (Result > 0)
+	{
+		Count(pLoop->Stats.BytesSent, (ULONGLONG) Result);
+		Consume((SIZE_T) Result);
+		pLoop->Touch(this);
+		Drained();
+	}
+
+	// There's more, or it's done and closing
+	pLoop->MarkDirty(this);
+}
+
+#endif
+
+/*
+	WORKERS
+
+	Each worker has its own deque, and the loops post to them in 
+	turn. A worker takes its own jobs oldest first, and when it runs
+	out, it takes the oldest from another's, so that a slow job only
+	holds up the jobs behind it for as long as the rest are busy. 
+	Each deque has its own lock, which only a thief contends for.
+
+	Finished jobs go back to the loop they came from on its lock-free
+	Finished stack (any number of workers push, and only the loop 
+	takes, all at once), and answered there.
+*/
+WORKER_POOL::WORKER_POOL(
+	UINT Count)
+	: Next(0)
+	, Queued(0)
+	, Stopping(false)
+{
+	for (UINT i = 0; i < Count; ++i)
+	{
+		Workers.push_back(std::unique_ptr<WORKER>(new WORKER()));
+	}
+
+	for (UINT i = 0; i < Count; ++i)
+	{
+		Workers[i]->Thread = std::thread([this, i] ()
+		{
+			Run(i);
+		});
+	}
+}
+
+//
+// Jobs that haven't been started are dropped. Only called once the
+// loops have stopped, so nothing else is using their exchanges.
+//
+WORKER_POOL::~WORKER_POOL()
+{
+	{
+		std::lock_guard<std::mutex> sleep(SleepLock);
+		Stopping = true;
+	}
+	Sleep.notify_all();
+
+	for (auto worker = std::begin(Workers); worker != std::end(Workers); ++worker)
+	{
+		(*worker)->Thread.join();
+
+		for (auto job = std::begin((*worker)->Jobs); job != std::end((*worker)->Jobs); ++job)
+		{
+			delete *job;
+		}
+	}
+}
+
+// Called from the loops
+void WORKER_POOL::Post(
+	WORKER_JOB* pJob)
+{
+	WORKER& worker = *Workers[Next.fetch_add(1, std::memory_order_relaxed) % Workers.size()];
+
+	//
+	// Counted first, so that a worker can't take it and count it
+	// down before it's counted. A worker that wakes in between 
+	// just looks again.
+	//
+	Queued.fetch_add(1);
+
+	{
+		std::lock_guard<std::mutex> lock(worker.Lock);
+		worker.Jobs.push_back(pJob);
+	}
+
+	// Taking the lock means a worker can't be between checking 
+	// Queued and waiting, and miss this
+	{
+		std::lock_guard<std::mutex> sleep(SleepLock);
+	}
+	Sleep.notify_one();
+}
+
+// Its own first, then anyone else's
+WORKER_JOB* WORKER_POOL::Take(
+	UINT Index)
+{
+	SIZE_T count = Workers.size();
+
+	for (SIZE_T i = 0; i < count; ++i)
+	{
+		WORKER& worker = *Workers[(Index + i) % count];
+		std::lock_guard<std::mutex> lock(worker.Lock);
+
+		if (!worker.Jobs.empty())
+		{
+			WORKER_JOB* pJob = worker.Jobs.front();
+			worker.Jobs.pop_front();
+
+			Queued.fetch_sub(1);
+
+			return pJob;
+		}
+	}
+
+	return nullptr;
+}
+
+void WORKER_POOL::Run(
+	UINT Index)
+{
+	while (!Stopping)
+	{
+		WORKER_JOB* pJob = Take(Index);
+
+		if (!pJob)
+		{
+			std::unique_lock<std::mutex> sleep(SleepLock);
+			Sleep.wait(sleep, [this] () { return Stopping || Queued.load() > 0; });
+			continue;
+		}
+
+		pJob->Work(pJob->Body);
+		pJob->pLoop->Finish(pJob);
+	}
+}
+
+// Once the loops have stopped, along with whatever they'd finished
+void StopWorkers(
+	SERVER_DATA* pServer)
+{
+	pServer->Pool.reset();
+
+	for (auto loop = std::begin(pServer->Loops); loop != std::end(pServer->Loops); ++loop)
+	{
+		(*loop)->TakeFinished();
+	}
+}
+
+/*
+	SERVER
+*/
+Server::Server()
+	: m_pData(new SERVER_DATA())
+{
+}
+
+Server::~Server()
+{
+	delete m_pData;
+}
+
+void Server::OnRequest(
+	RequestHandler Handler)
+{
+	m_pData->Handler = Handler;
+}
+
+void Server::OnWebsocket(
+	const WEBSOCKET_HANDLERS& Handlers)
+{
+	m_pData->Websocket = Handlers;
+}
+
+SERVER_RESULT Server::Start(
+	const SERVER_CONFIG& Config)
+{
+	if (m_pData->Started)
+	{
+		return SERVER_ALREADY_STARTED;
+	}
+
+	m_pData->Config = Config;
+	if (!m_pData->Config.ReadBufferSize)
+	{
+		m_pData->Config.ReadBufferSize = SERVER_MIN_READ;
+	}
+
+	sockaddr_storage address;
+	socklen_t addressLength;
+	ZeroMemory(&address, sizeof(address));
+
+	sockaddr_in* pIPv4 = (sockaddr_in*) &address;
+	sockaddr_in6* pIPv6 = (sockaddr_in6*) &address;
+
+	if (!Config.Address || inet_pton(AF_INET, Config.Address, &pIPv4->sin_addr) == 1)
+	{
+		pIPv4->sin_family = AF_INET;
+		pIPv4->sin_port = htons(Config.Port);
+		if (!Config.Address)
+		{
+			pIPv4->sin_addr.s_addr = htonl(INADDR_ANY);
+		}
+		addressLength = sizeof(sockaddr_in);
+	}
+	else if (inet_pton(AF_INET6, Config.Address, &pIPv6->sin6_addr) == 1)
+	{
+		pIPv6->sin6_family = AF_INET6;
+		pIPv6->sin6_port = htons(Config.Port);
+		addressLength = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		return SERVER_ADDRESS_INVALID;
+	}
+
+	// The CPUs we're allowed on, to share the loops out over
+	std::vector<INT> cpus;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		for (INT cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+	}
+
+	UINT threads = Config.Threads;
+	if (!threads)
+	{
+		threads = cpus.empty() ? 1 : (UINT) cpus.size();
+	}
+
+	for (UINT i = 0; i < threads; ++i)
+	{
+		std::unique_ptr<SERVER_LOOP> loop(new SERVER_LOOP(m_pData));
+
+		if (threads > 1 && Config.PinThreads && !cpus.empty())
+		{
+			loop->Cpu = cpus[i % cpus.size()];
+		}
+
+		SERVER_RESULT result = loop->Open((sockaddr*) &address, addressLength, threads > 1);
+		if (result != SERVER_OK)
+		{
+			m_pData->Loops.clear();
+			return result;
+		}
+
+		// If we were given port 0, the rest have to use the one the 
+		// first was given
+		if (i == 0)
+		{
+			addressLength = sizeof(address);
+			getsockname(loop->Listen, (sockaddr*) &address, &addressLength);
+			m_pData->Port = ntohs(address.ss_family == AF_INET ? pIPv4->sin_port : pIPv6->sin6_port);
+		}
+
+		m_pData->Loops.push_back(std::move(loop));
+	}
+
+	m_pData->Started = true;
+
+	return SERVER_OK;
+}
+
+void Server::Run()
+{
+	if (!m_pData->Started)
+	{
+		return;
+	}
+
+	m_pData->Stopping = false;
+
+	if (m_pData->Config.Workers)
+	{
+		m_pData->Pool.reset(new WORKER_POOL(m_pData->Config.Workers));
+	}
+
+	if (m_pData->Loops.size() == 1)
+	{
+		m_pData->Loops[0]->Run();
+		StopWorkers(m_pData);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for (auto loop = std::begin(m_pData->Loops); loop != std::end(m_pData->Loops); ++loop)
+	{
+		SERVER_LOOP* pLoop = loop->get();
+
+		threads.push_back(std::thread([pLoop] ()
+		{
+			// Pinned before it allocates anything, so that its 
+			// buffers end up in memory local to its CPU
+			if (pLoop->Cpu >= 0)
+			{
+				cpu_set_t cpu;
+				CPU_ZERO(&cpu);
+				CPU_SET(pLoop->Cpu, &cpu);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+			}
+
+			pLoop->Run();
+		}));
+	}
+
+	for (auto thread = std::begin(threads); thread != std::end(threads); ++thread)
+	{
+		thread->join();
+	}
+
+	StopWorkers(m_pData);
+}
+
+void Server::Stop()
+{
+	m_pData->Stopping = true;
+
+	for (auto loop = std::begin(m_pData->Loops); loop != std::end(m_pData->Loops); ++loop)
+	{
+		ULONGLONG value = 1;
+		ssize_t ignored = write((*loop)->Wake, &value, sizeof(value));
+		(void) ignored;
+	}
+}
+
+USHORT Server::Port() const
+{
+	return m_pData->Port;
+}
+
+UINT Server::Threads() const
+{
+	return (UINT) m_pData->Loops.size();
+}
+
+SERVER_IO Server::Io() const
+{
+	if (m_pData->Loops.empty())
+	{
+		return SERVER_IO_AUTO;
+	}
+
+#if defined(SERVER_URING)
+	if (m_pData->Loops[0]->Ring)
+	{
+		return SERVER_IO_URING;
+	}
+#endif
+
+	return SERVER_IO_EPOLL;
+}
+
+void Server::Stats(
+	UINT Thread,
+	SERVER_STATS* pStats) const
+{
+	ZeroMemory(pStats, sizeof(*pStats));
+
+	if (Thread >= m_pData->Loops.size())
+	{
+		return;
+	}
+
+	const LOOP_STATS& stats = m_pData->Loops[Thread]->Stats;
+
+	pStats->Accepted = stats.Accepted.load(std::memory_order_relaxed);
+	pStats->Open = stats.Open.load(std::memory_order_relaxed);
+	pStats->Requests = stats.Requests.load(std::memory_order_relaxed);
+	pStats->WebsocketMessages = stats.WebsocketMessages.load(std::memory_order_relaxed);
+	pStats->BytesReceived = stats.BytesReceived.load(std::memory_order_relaxed);
+	pStats->BytesSent = stats.BytesSent.load(std::memory_order_relaxed);
+}
+
+void Server::TotalStats(
+	SERVER_STATS* pStats) const
+{
+	ZeroMemory(pStats, sizeof(*pStats));
+
+	for (UINT i = 0; i < Threads(); ++i)
+	{
+		SERVER_STATS stats;
+		Stats(i, &stats);
+
+		pStats->Accepted += stats.Accepted;
+		pStats->Open += stats.Open;
+		pStats->Requests += stats.Requests;
+		pStats->WebsocketMessages += stats.WebsocketMessages;
+		pStats->BytesReceived += stats.BytesReceived;
+		pStats->BytesSent += stats.BytesSent;
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include "HTTP.h"
+
+#if defined(__linux__) && defined(__cpp_impl_coroutine)
+
+#include <exception>
+
+namespace HTTP
+{
+
+/*
+	COROUTINES
+
+	The awaiters are only the callbacks underneath, turned around:
+	each checks whether what it's waiting for is already there, and
+	if not, sets the callback to resume the coroutine. The loop
+	calls it from wherever it would have called the callback, so the
+	coroutine always runs on the connection's own thread.
+*/
+ServerTask ServerTask::promise_type::get_return_object()
+{
+	return ServerTask();
+}
+
+std::suspend_never ServerTask::promise_type::initial_suspend()
+{
+	return std::suspend_never();
+}
+
+// Nobody waits on a ServerTask, so it frees itself at the end
+std::suspend_never ServerTask::promise_type::final_suspend() noexcept
+{
+	return std::suspend_never();
+}
+
+void ServerTask::promise_type::return_void()
+{
+}
+
+// The library doesn't throw, and there's nobody to tell
+void ServerTask::promise_type::unhandled_exception()
+{
+	std::terminate();
+}
+
+/*
+	EXCHANGES
+*/
+SERVER_BODY_AWAITER ServerExchange::BodyChunk()
+{
+	SERVER_BODY_AWAITER awaiter;
+	awaiter.pExchange = this;
+
+	return awaiter;
+}
+
+bool SERVER_BODY_AWAITER::await_ready()
+{
+	return pExchange->BodyReadable();
+}
+
+void SERVER_BODY_AWAITER::await_suspend(
+	std::coroutine_handle<> Handle)
+{
+	pExchange->OnBody([Handle] () { Handle.resume(); });
+}
+
+StringView SERVER_BODY_AWAITER::await_resume()
+{
+	return pExchange->ReadBody();
+}
+
+SERVER_WRITE_AWAITER ServerExchange::WriteAsync(
+	LPCVOID pData,
+	SIZE_T Length)
+{
+	SERVER_WRITE_AWAITER awaiter;
+	awaiter.pExchange = this;
+	awaiter.Written = Write(pData, Length);
+
+	return awaiter;
+}
+
+bool SERVER_WRITE_AWAITER::await_ready()
+{
+	return !Written || pExchange->Writable();
+}
+
+void SERVER_WRITE_AWAITER::await_suspend(
+	std::coroutine_handle<> Handle)
+{
+	pExchange->OnWritable([Handle] () { Handle.resume(); });
+}
+
+// It may have gone while we waited
+bool SERVER_WRITE_AWAITER::await_resume()
+{
+	return Written && pExchange->Pending();
+}
+
+/*
+	WEBSOCKETS
+*/
+SERVER_MESSAGE_AWAITER ServerWebsocket::NextMessage(
+	SERVER_MESSAGE* pMessage)
+{
+	SERVER_MESSAGE_AWAITER awaiter;
+	awaiter.pWebsocket = this;
+	awaiter.pMessage = pMessage;
+	awaiter.Received = false;
+
+	return awaiter;
+}
+
+bool SERVER_MESSAGE_AWAITER::await_ready()
+{
+	Received = pWebsocket->Receive(pMessage);
+
+	return Received || !pWebsocket->Open();
+}
+
+void SERVER_MESSAGE_AWAITER::await_suspend(
+	std::coroutine_handle<> Handle)
+{
+	pWebsocket->OnReceivable([Handle] () { Handle.resume(); });
+}
+
+bool SERVER_MESSAGE_AWAITER::await_resume()
+{
+	return Received || pWebsocket->Receive(pMessage);
+}
+
+}
+
+#endif
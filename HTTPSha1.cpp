@@ -0,0 +1,280 @@
+#include "HTTPInternal.h"
+
+#include <string.h>
+
+namespace HTTP
+{
+
+/*
+	SHA-1 (FIPS 180-4)
+
+	Only used for the WebSocket handshake, where it's a checksum
+	rather than anything to do with security.
+*/
+typedef void (*SHA1_BLOCKS_FUNC)(UINT32 State[5], LPCBYTE pData, SIZE_T BlockCount);
+
+inline UINT32 RotateLeft(UINT32 Value, INT Bits)
+{
+	return (Value << Bits) | (Value >> (32 - Bits));
+}
+
+inline UINT32 LoadBigEndian32(LPCBYTE p)
+{
+	return ((UINT32) p[0] << 24) | ((UINT32) p[1] << 16) | ((UINT32) p[2] << 8) | p[3];
+}
+
+void Sha1BlocksScalar(UINT32 State[5], LPCBYTE pData, SIZE_T BlockCount)
+{
+	while (BlockCount--)
+	{
+		UINT32 w[80];
+		for (INT i = 0; i < 16; ++i)
+		{
+			w[i] = LoadBigEndian32(pData + i * 4);
+		}
+		for (INT i = 16; i < 80; ++i)
+		{
+			w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+
+		UINT32 a = State[0];
+		UINT32 b = State[1];
+		UINT32 c = State[2];
+		UINT32 d = State[3];
+		UINT32 e = State[4];
+
+		for (INT i = 0; i < 80; ++i)
+		{
+			UINT32 f, k;
+
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+
+			UINT32 t = RotateLeft(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = RotateLeft(b, 30);
+			b = a;
+			a = t;
+		}
+
+		State[0] += a;
+		State[1] += b;
+		State[2] += c;
+		State[3] += d;
+		State[4] += e;
+
+		pData += SHA1_BLOCK_SIZE;
+	}
+}
+
+/*
+	SHA EXTENSIONS
+
+	Each sha1rnds4 does four rounds; sha1nexte works out E for the
+	next four from the current A. The message schedule runs a few
+	groups ahead: W[g] = msg2(msg1(W[g-4], W[g-3]) ^ W[g-2], W[g-1]),
+	spread over the groups before it's needed, in a ring of four.
+*/
+#if defined(HTTP_X86)
+
+#define SHA1_GROUP(g, f, eCurrent, eNext) \
+	eCurrent = _mm_sha1nexte_epu32(eCurrent, msg[(g) % 4]); \
+	eNext = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, eCurrent, f); \
+	if ((g) >= 1 && (g) <= 16) msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]); \
+	if ((g) >= 2 && (g) <= 17) msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], msg[(g) % 4]); \
+	if ((g) >= 3 && (g) <= 18) msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]);
+
+HTTP_TARGET("sha,sse4.1,ssse3")
+void Sha1BlocksSHA(UINT32 State[5], LPCBYTE pData, SIZE_T BlockCount)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607LL, 0x08090A0B0C0D0E0FLL);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) State), 0x1B);
+	__m128i e0 = _mm_set_epi32((INT) State[4], 0, 0, 0);
+	__m128i e1;
+
+	while (BlockCount--)
+	{
+		__m128i abcdSaved = abcd;
+		__m128i eSaved = e0;
+
+		__m128i msg[4];
+		for (INT i = 0; i < 4; ++i)
+		{
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (pData + i * 16)), byteSwap);
+		}
+
+		// The first group has no previous A to take E from
+		e0 = _mm_add_epi32(e0, msg[0]);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		SHA1_GROUP(1, 0, e1, e0)
+		SHA1_GROUP(2, 0, e0, e1)
+		SHA1_GROUP(3, 0, e1, e0)
+		SHA1_GROUP(4, 0, e0, e1)
+		SHA1_GROUP(5, 1, e1, e0)
+		SHA1_GROUP(6, 1, e0, e1)
+		SHA1_GROUP(7, 1, e1, e0)
+		SHA1_GROUP(8, 1, e0, e1)
+		SHA1_GROUP(9, 1, e1, e0)
+		SHA1_GROUP(10, 2, e0, e1)
+		SHA1_GROUP(11, 2, e1, e0)
+		SHA1_GROUP(12, 2, e0, e1)
+		SHA1_GROUP(13, 2, e1, e0)
+		SHA1_GROUP(14, 2, e0, e1)
+		SHA1_GROUP(15, 3, e1, e0)
+		SHA1_GROUP(16, 3, e0, e1)
+		SHA1_GROUP(17, 3, e1, e0)
+		SHA1_GROUP(18, 3, e0, e1)
+		SHA1_GROUP(19, 3, e1, e0)
+
+		e0 = _mm_sha1nexte_epu32(e0, eSaved);
+		abcd = _mm_add_epi32(abcd, abcdSaved);
+
+		pData += SHA1_BLOCK_SIZE;
+	}
+
+	_mm_storeu_si128((__m128i*) State, _mm_shuffle_epi32(abcd, 0x1B));
+	State[4] = (UINT32) _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_GROUP
+
+#endif
+
+SHA1_BLOCKS_FUNC SelectSha1Func()
+{
+#if defined(HTTP_X86)
+	const CPU_FEATURES& cpu = GetCPUFeatures();
+
+	if (cpu.SHA && cpu.SSE41 && cpu.SSSE3)
+	{
+		return Sha1BlocksSHA;
+	}
+#endif
+
+	return Sha1BlocksScalar;
+}
+
+void Sha1Blocks(UINT32 State[5], LPCBYTE pData, SIZE_T BlockCount)
+{
+	static const SHA1_BLOCKS_FUNC blocks = SelectSha1Func();
+	blocks(State, pData, BlockCount);
+}
+
+/*
+	STREAMING
+*/
+void Sha1Init(
+	SHA1_CONTEXT* pContext)
+{
+	pContext->State[0] = 0x67452301;
+	pContext->State[1] = 0xEFCDAB89;
+	pContext->State[2] = 0x98BADCFE;
+	pContext->State[3] = 0x10325476;
+	pContext->State[4] = 0xC3D2E1F0;
+	pContext->Length = 0;
+	pContext->BufferLength = 0;
+}
+
+void Sha1Update(
+	SHA1_CONTEXT* pContext,
+	LPCVOID pData,
+	SIZE_T DataLength)
+{
+	LPCBYTE pBytes = (LPCBYTE) pData;
+
+	pContext->Length += DataLength;
+
+	// Top up a partial block first
+	if (pContext->BufferLength)
+	{
+		SIZE_T space = SHA1_BLOCK_SIZE - pContext->BufferLength;
+		SIZE_T length = DataLength < space ? DataLength : space;
+
+		memcpy(pContext->Buffer + pContext->BufferLength, pBytes, length);
+		pContext->BufferLength += length;
+		pBytes += length;
+		DataLength -= length;
+
+		if (pContext->BufferLength < SHA1_BLOCK_SIZE)
+		{
+			return;
+		}
+
+		Sha1Blocks(pContext->State, pContext->Buffer, 1);
+		pContext->BufferLength = 0;
+	}
+
+	// Whole blocks straight from the input
+	SIZE_T blocks = DataLength / SHA1_BLOCK_SIZE;
+	if (blocks)
+	{
+		Sha1Blocks(pContext->State, pBytes, blocks);
+		pBytes += blocks * SHA1_BLOCK_SIZE;
+		DataLength -= blocks * SHA1_BLOCK_SIZE;
+	}
+
+	memcpy(pContext->Buffer, pBytes, DataLength);
+	pContext->BufferLength = DataLength;
+}
+
+void Sha1Final(
+	SHA1_CONTEXT* pContext,
+	LPBYTE pDigest)
+{
+	ULONGLONG bitLength = pContext->Length * 8;
+
+	//
+	// Pad with 0x80, then zeroes up to 8 bytes short of a block,
+	// then the length in bits, big-endian.
+	//
+	pContext->Buffer[pContext->BufferLength++] = 0x80;
+
+	if (pContext->BufferLength > SHA1_BLOCK_SIZE - 8)
+	{
+		memset(pContext->Buffer + pContext->BufferLength, 0, SHA1_BLOCK_SIZE - pContext->BufferLength);
+		Sha1Blocks(pContext->State, pContext->Buffer, 1);
+		pContext->BufferLength = 0;
+	}
+
+	memset(pContext->Buffer + pContext->BufferLength, 0, SHA1_BLOCK_SIZE - 8 - pContext->BufferLength);
+
+	for (INT i = 0; i < 8; ++i)
+	{
+		pContext->Buffer[SHA1_BLOCK_SIZE - 1 - i] = (BYTE) (bitLength >> (i * 8));
+	}
+
+	Sha1Blocks(pContext->State, pContext->Buffer, 1);
+
+	for (INT i = 0; i < 5; ++i)
+	{
+		pDigest[i * 4 + 0] = (BYTE) (pContext->State[i] >> 24);
+		pDigest[i * 4 + 1] = (BYTE) (pContext->State[i] >> 16);
+		pDigest[i * 4 + 2] = (BYTE) (pContext->State[i] >> 8);
+		pDigest[i * 4 + 3] = (BYTE) pContext->State[i];
+	}
+}
+
+}
@@ -0,0 +1,324 @@
+#include "HTTPInternal.h"
+
+#if defined(HTTP_X86) && !defined(_MSC_VER)
+#	include <cpuid.h>
+#endif
+
+namespace HTTP
+{
+
+/*
+	CPU DETECTION
+*/
+
+#if defined(HTTP_X86)
+
+void CPUID(INT Leaf, INT SubLeaf, INT Regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex(Regs, Leaf, SubLeaf);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(Leaf, SubLeaf, a, b, c, d);
+	Regs[0] = (INT) a; Regs[1] = (INT) b; Regs[2] = (INT) c; Regs[3] = (INT) d;
+#endif
+}
+
+ULONGLONG XGETBV()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int a, d;
+	__asm__ __volatile__ ("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return ((ULONGLONG) d << 32) | a;
+#endif
+}
+
+CPU_FEATURES DetectCPUFeatures()
+{
+	CPU_FEATURES f;
+	ZeroMemory(&f, sizeof(f));
+
+	INT regs[4];
+	CPUID(0, 0, regs);
+	INT maxLeaf = regs[0];
+
+	if (maxLeaf < 1)
+	{
+		return f;
+	}
+
+	CPUID(1, 0, regs);
+	f.SSE2 = (regs[3] & (1 << 26)) != 0;
+	f.SSSE3 = (regs[2] & (1 << 9)) != 0;
+	f.SSE41 = (regs[2] & (1 << 19)) != 0;
+
+	// AVX needs the OS to save the upper halves of the registers
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+	bool ymmSaved = osxsave && (XGETBV() & 0x6) == 0x6;
+
+	if (maxLeaf >= 7)
+	{
+		CPUID(7, 0, regs);
+		f.AVX2 = avx && ymmSaved && (regs[1] & (1 << 5)) != 0;
+		f.SHA = (regs[1] & (1 << 29)) != 0;
+	}
+
+	return f;
+}
+
+#else
+
+CPU_FEATURES DetectCPUFeatures()
+{
+	CPU_FEATURES f;
+	ZeroMemory(&f, sizeof(f));
+	return f;
+}
+
+#endif
+
+const CPU_FEATURES& GetCPUFeatures()
+{
+	static const CPU_FEATURES features = DetectCPUFeatures();
+	return features;
+}
+
+/*
+	SCALAR SCANNING
+
+	One table per mode saying which bytes stop the scan.
+*/
+struct SCAN_TABLE
+{
+	SCAN_TABLE()
+	{
+		for (INT c = 0; c < 256; ++c)
+		{
+			bool control = c < 0x20 || c == 0x7F;
+
+			Stop[SCAN_LINE][c] = c == '\n';
+			Stop[SCAN_TOKEN][c] = control || c == ' ' || c == ':';
+			Stop[SCAN_WORD][c] = control || c == ' ';
+			Stop[SCAN_VALUE][c] = control && c != '\t';
+		}
+	}
+
+	bool Stop[SCAN_MODE_COUNT][256];
+};
+
+const SCAN_TABLE& GetScanTable()
+{
+	static const SCAN_TABLE table;
+	return table;
+}
+
+template<SCAN_MODE Mode>
+const char* ScanScalar(const char* begin, const char* end)
+{
+	const bool* stop = GetScanTable().Stop[Mode];
+
+	while (begin < end && !stop[(BYTE) *begin])
+	{
+		begin++;
+	}
+
+	return begin;
+}
+
+/*
+	SSE2 / AVX2 SCANNING
+
+	These look at 16 or 32 bytes at a time and build a mask of
+	the bytes that stop the scan. Whatever's left over at the end
+	goes through the scalar version, so nothing past end is read.
+
+	There's no unsigned byte compare, but (min(v, k) == v) is the 
+	same as v <= k.
+*/
+#if defined(HTTP_X86)
+
+HTTP_TARGET("sse2")
+inline INT StopMaskSSE2(SCAN_MODE Mode, __m128i v)
+{
+	__m128i stop;
+
+	switch (Mode)
+	{
+	case SCAN_LINE:
+		stop = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+		break;
+	case SCAN_TOKEN:
+		stop = _mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x20)), v),
+				_mm_cmpeq_epi8(v, _mm_set1_epi8(':'))),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+		break;
+	case SCAN_WORD:
+		stop = _mm_or_si128(
+			_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x20)), v),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+		break;
+	default:
+		stop = _mm_or_si128(
+			_mm_andnot_si128(
+				_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+				_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v)),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+		break;
+	}
+
+	return _mm_movemask_epi8(stop);
+}
+
+HTTP_TARGET("avx2")
+inline UINT StopMaskAVX2(SCAN_MODE Mode, __m256i v)
+{
+	__m256i stop;
+
+	switch (Mode)
+	{
+	case SCAN_LINE:
+		stop = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+		break;
+	case SCAN_TOKEN:
+		stop = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x20)), v),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+		break;
+	case SCAN_WORD:
+		stop = _mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x20)), v),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+		break;
+	default:
+		stop = _mm256_or_si256(
+			_mm256_andnot_si256(
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+				_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v)),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+		break;
+	}
+
+	return (UINT) _mm256_movemask_epi8(stop);
+}
+
+inline INT LowestBit(UINT Mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, Mask);
+	return (INT) index;
+#else
+	return __builtin_ctz(Mask);
+#endif
+}
+
+template<SCAN_MODE Mode>
+HTTP_TARGET("sse2")
+const char* ScanSSE2(const char* begin, const char* end)
+{
+	while (end - begin >= 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*) begin);
+
+		INT mask = StopMaskSSE2(Mode, v);
+		if (mask)
+		{
+			return begin + LowestBit((UINT) mask);
+		}
+
+		begin += 16;
+	}
+
+	return ScanScalar<Mode>(begin, end);
+}
+
+template<SCAN_MODE Mode>
+HTTP_TARGET("avx2")
+const char* ScanAVX2(const char* begin, const char* end)
+{
+	while (end - begin >= 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*) begin);
+
+		UINT mask = StopMaskAVX2(Mode, v);
+		if (mask)
+		{
+			return begin + LowestBit(mask);
+		}
+
+		begin += 32;
+	}
+
+	return ScanSSE2<Mode>(begin, end);
+}
+
+#endif
+
+/*
+	DISPATCH
+*/
+typedef const char* (*SCAN_FUNC)(const char*, const char*);
+
+struct SCAN_DISPATCH
+{
+	SCAN_DISPATCH()
+	{
+		Func[SCAN_LINE] = ScanScalar<SCAN_LINE>;
+		Func[SCAN_TOKEN] = ScanScalar<SCAN_TOKEN>;
+		Func[SCAN_WORD] = ScanScalar<SCAN_WORD>;
+		Func[SCAN_VALUE] = ScanScalar<SCAN_VALUE>;
+
+#if defined(HTTP_X86)
+		const CPU_FEATURES& cpu = GetCPUFeatures();
+
+		if (cpu.AVX2)
+		{
+			Func[SCAN_LINE] = ScanAVX2<SCAN_LINE>;
+			Func[SCAN_TOKEN] = ScanAVX2<SCAN_TOKEN>;
+			Func[SCAN_WORD] = ScanAVX2<SCAN_WORD>;
+			Func[SCAN_VALUE] = ScanAVX2<SCAN_VALUE>;
+		}
+		else if (cpu.SSE2)
+		{
+			Func[SCAN_LINE] = ScanSSE2<SCAN_LINE>;
+			Func[SCAN_TOKEN] = ScanSSE2<SCAN_TOKEN>;
+			Func[SCAN_WORD] = ScanSSE2<SCAN_WORD>;
+			Func[SCAN_VALUE] = ScanSSE2<SCAN_VALUE>;
+		}
+#endif
+	}
+
+	SCAN_FUNC Func[SCAN_MODE_COUNT];
+};
+
+const char* ScanFor(
+	SCAN_MODE Mode,
+	const char* begin,
+	const char* end)
+{
+	static const SCAN_DISPATCH dispatch;
+
+	// Not worth setting up a vector for a handful of bytes
+	if (end - begin < 16)
+	{
+		const bool* stop = GetScanTable().Stop[Mode];
+
+		while (begin < end && !stop[(BYTE) *begin])
+		{
+			begin++;
+		}
+
+		return begin;
+	}
+
+	return dispatch.Func[Mode](begin, end);
+}
+
+}
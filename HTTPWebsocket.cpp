@@ -1,5 +1,6 @@
-#include "HTTP.h"
+#include "HTTPInternal.h"
 #include <assert.h>
+#include <string.h>
 
 namespace HTTP
 {
@@ -28,11 +29,15 @@ template<class T> T ByteSwap(T original)
 	return b.t;
 }
 
+// The handshake appends this to the client's key before hashing
+#define WS_KEY_GUID			"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_GUID_LENGTH	(sizeof(WS_KEY_GUID) - 1)
+
 bool IsWebsocketRequest(_In_ const RequestHeader& req)
 {
 	return 
-		req.Header().find("Upgrade") != std::end(req.Header()) &&
-		req.Header().find("Sec-WebSocket-Key") != std::end(req.Header());
+		req.FindHeader(HEADER_UPGRADE, nullptr) &&
+		req.FindHeader(HEADER_SEC_WEBSOCKET_KEY, nullptr);
 }
 
 WS_RESPONSE_RESULT
@@ -41,11 +46,13 @@ BuildWebsocketRequestResponse(
 	_In_ HashFunc HashFunction,
 	_Out_ ResponseHeaderBuilder* responseHeader)
 {
-	String wsKey = request.Header().find("Sec-WebSocket-Key")->second;
-	if (!wsKey.size())
+	StringView wsKeyView;
+	if (!request.FindHeader(HEADER_SEC_WEBSOCKET_KEY, &wsKeyView) || !wsKeyView.Length)
 		return WS_RESPONSE_MISSING_KEY;
 
-	wsKey += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	String wsKey = wsKeyView.ToString();
+
+	wsKey += WS_KEY_GUID;
 
 	/*
 	SHA1 hash;
@@ -64,49 +71,135 @@ BuildWebsocketRequestResponse(
 	responseHeader->Protocol = HTTP::PROTOCOL_HTTP_1_1;
 	responseHeader->Code = HTTP::RESPONSE_SWITCHING_PROTOCOLS;
 
-	responseHeader->AddKey("Upgrade", "websocket");
-	responseHeader->AddKey("Connection", "Upgrade");
+	responseHeader->AddCommonHeader(COMMON_HEADER_UPGRADE_WEBSOCKET);
+	responseHeader->AddCommonHeader(COMMON_HEADER_CONNECTION_UPGRADE);
 	responseHeader->AddKey("Sec-WebSocket-Accept", wsKey);
-//	responseHeader->AddKey("Sec-WebSocket-Extensions", "");
 	responseHeader->AddKey("Sec-WebSocket-Version", "17");
 
 	return WS_RESPONSE_OK;
 }
 
-WS_FRAME_RESULT
-ParseWebsocketFrame(
-	_In_reads_(DataLength) LPCVOID pData,
-	_In_ ULONGLONG DataLength,
-	_Out_ WS_FRAME_INFO* pFrameInfo,
-	_Out_ LPCVOID* pFramePayload)
+void
+ComputeWebsocketAcceptKey(
+	_In_reads_(KeyLength) LPCSTR pKey,
+	_In_ SIZE_T KeyLength,
+	_Out_writes_(WS_ACCEPT_KEY_LENGTH) LPSTR pOut)
 {
-	if (!pData || DataLength < 2 || !pFrameInfo || !pFramePayload)
-		return WS_FRAME_ERROR;
+	SHA1_CONTEXT sha;
+	Sha1Init(&sha);
+	Sha1Update(&sha, pKey, KeyLength);
+	Sha1Update(&sha, WS_KEY_GUID, WS_KEY_GUID_LENGTH);
 
-	LPCBYTE pFrameHeader = (LPCBYTE) pData;
+	BYTE digest[SHA1_DIGEST_SIZE];
+	Sha1Final(&sha, digest);
+
+	SIZE_T length;
+	Base64Encode(digest, sizeof(digest), pOut, WS_ACCEPT_KEY_LENGTH, &length);
+	assert(length == WS_ACCEPT_KEY_LENGTH);
+}
+
+WS_RESPONSE_RESULT
+BuildWebsocketRequestResponse(
+	_In_ const HTTP::RequestHeader& request,
+	_Out_ ResponseHeaderBuilder* responseHeader)
+{
+	StringView wsKeyView;
+	if (!request.FindHeader(HEADER_SEC_WEBSOCKET_KEY, &wsKeyView) || !wsKeyView.Length)
+		return WS_RESPONSE_MISSING_KEY;
+
+	CHAR acceptKey[WS_ACCEPT_KEY_LENGTH];
+	ComputeWebsocketAcceptKey(wsKeyView.Data, wsKeyView.Length, acceptKey);
+
+	responseHeader->Protocol = HTTP::PROTOCOL_HTTP_1_1;
+	responseHeader->Code = HTTP::RESPONSE_SWITCHING_PROTOCOLS;
+
+	responseHeader->AddCommonHeader(COMMON_HEADER_UPGRADE_WEBSOCKET);
+	responseHeader->AddCommonHeader(COMMON_HEADER_CONNECTION_UPGRADE);
+	responseHeader->AddKey("Sec-WebSocket-Accept", String(acceptKey, WS_ACCEPT_KEY_LENGTH));
+	responseHeader->AddKey("Sec-WebSocket-Version", "17");
+
+	return WS_RESPONSE_OK;
+}
+
+/*
+	FRAME HEADERS
+
+	 0               1               2  ...
+	+-+-+-+-+-------+-+-------------+-------------------------------+
+	|F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+	|I|S|S|S|  (4)  |A|     (7)     |          (16 or 64)           |
+	|N|V|V|V|       |S|             |                               |
+	| |1|2|3|       |K|             |                               |
+	+-+-+-+-+-------+-+-------------+-------------------------------+
+	                                |  Masking key, if MASK is set  |
+	                                +-------------------------------+
+
+	The extended length is big-endian. The masking key is kept in
+	wire order, as that's the order it's applied in.
+*/
+bool IsControlOpCode(INT OpCode)
+{
+	return (OpCode & WS_CONTROL_OPCODE) != 0;
+}
+
+bool IsValidCloseReason(INT Code)
+{
+	return
+		(Code >= WS_CLOSE_NORMAL && Code <= WS_CLOSE_NO_DATA_HANDLER) ||
+		(Code >= WS_CLOSE_INCONSISTENT_DATA && Code <= WS_CLOSE_CANNOT_FULFILL_REQUEST) ||
+		(Code >= 3000 && Code <= 4999);
+}
+
+// How long the whole header is, going by its second byte
+SIZE_T FrameHeaderSize(BYTE SecondByte)
+{
+	SIZE_T size = 2;
+
+	switch (SecondByte & 0x7F)
+	{
+	case 126: size += 2; break;
+	case 127: size += 8; break;
+	}
+
+	if (SecondByte & 0x80)
+	{
+		size += 4;
+	}
 
+	return size;
+}
+
+// pHeader must hold FrameHeaderSize(pHeader[1]) bytes
+void ReadFrameHeader(LPCBYTE pHeader, WS_FRAME_INFO* pFrameInfo)
+{
 	ZeroMemory(pFrameInfo, sizeof(*pFrameInfo));
 
-	pFrameInfo->FinalPacket = AllBitsSet(pFrameHeader[0], 0x80);
-	pFrameInfo->RSV1 = AllBitsSet(pFrameHeader[0], 0x40);
-	pFrameInfo->RSV2 = AllBitsSet(pFrameHeader[0], 0x20);
-	pFrameInfo->RSV3 = AllBitsSet(pFrameHeader[0], 0x10);
-	pFrameInfo->OpCode = (WS_FRAME_OPCODE) (pFrameHeader[0] & 0x0F);
+	pFrameInfo->FinalPacket = AllBitsSet(pHeader[0], 0x80);
+	pFrameInfo->RSV1 = AllBitsSet(pHeader[0], 0x40);
+	pFrameInfo->RSV2 = AllBitsSet(pHeader[0], 0x20);
+	pFrameInfo->RSV3 = AllBitsSet(pHeader[0], 0x10);
+	pFrameInfo->OpCode = (WS_FRAME_OPCODE) (pHeader[0] & 0x0F);
 
-	pFrameInfo->Masked = AllBitsSet(pFrameHeader[1], 0x80);
-	
-	LPCBYTE pFrameData = pFrameHeader + 2;
+	pFrameInfo->Masked = AllBitsSet(pHeader[1], 0x80);
+
+	LPCBYTE pExtra = pHeader + 2;
 
-	BYTE payloadLengthBits = pFrameHeader[1] & 0x7F;
+	BYTE payloadLengthBits = pHeader[1] & 0x7F;
 	if (payloadLengthBits == 127)
 	{
-		pFrameInfo->PayloadLength = ByteSwap((* (ULONGLONG*) pFrameData) & 0x7FFFFFFFFFFFFFFF);
-		pFrameData += sizeof(ULONGLONG);
+		ULONGLONG length = 0;
+		for (INT i = 0; i < 8; ++i)
+		{
+			length = (length << 8) | pExtra[i];
+		}
+
+		pFrameInfo->PayloadLength = length;
+		pExtra += 8;
 	}
 	else if (payloadLengthBits == 126)
 	{
-		pFrameInfo->PayloadLength = ByteSwap(* (USHORT*) pFrameData);
-		pFrameData += sizeof(USHORT);
+		pFrameInfo->PayloadLength = ((ULONGLONG) pExtra[0] << 8) | pExtra[1];
+		pExtra += 2;
 	}
 	else
 	{
@@ -115,13 +208,34 @@ ParseWebsocketFrame(
 
 	if (pFrameInfo->Masked)
 	{
-		pFrameInfo->MaskingKey = * (DWORD*) pFrameData;
-		pFrameData += sizeof(DWORD);
+		memcpy(&pFrameInfo->MaskingKey, pExtra, sizeof(DWORD));
 	}
+}
 
-	*pFramePayload = pFrameData;
+WS_FRAME_RESULT
+ParseWebsocketFrame(
+	_In_reads_(DataLength) LPCVOID pData,
+	_In_ ULONGLONG DataLength,
+	_Out_ WS_FRAME_INFO* pFrameInfo,
+	_Out_ LPCVOID* pFramePayload)
+{
+	if (!pData || !pFrameInfo || !pFramePayload)
+		return WS_FRAME_ERROR;
+
+	LPCBYTE pFrameHeader = (LPCBYTE) pData;
+
+	if (DataLength < 2 || DataLength < FrameHeaderSize(pFrameHeader[1]))
+		return WS_FRAME_NEED_MORE;
+
+	ReadFrameHeader(pFrameHeader, pFrameInfo);
+
+	*pFramePayload = pFrameHeader + FrameHeaderSize(pFrameHeader[1]);
+
+	// The top bit of a 64 bit length must be clear
+	if (pFrameInfo->PayloadLength >> 63)
+		return WS_FRAME_ERROR;
 
-	if ((pFrameInfo->OpCode & 0x80) && !pFrameInfo->FinalPacket)
+	if (IsControlOpCode(pFrameInfo->OpCode) && !pFrameInfo->FinalPacket)
 		return WS_FRAME_FRAGMENTED_OPCODE;
 
 	return WS_FRAME_OK;
@@ -135,7 +249,7 @@ SetWebsocketFrame(
 	if (!pFrameInfo || !pFrameHeader)
 		return WS_FRAME_ERROR;
 
-	if ((pFrameInfo->OpCode & 0x80) && !pFrameInfo->FinalPacket)
+	if (IsControlOpCode(pFrameInfo->OpCode) && !pFrameInfo->FinalPacket)
 		return WS_FRAME_FRAGMENTED_OPCODE;
 
 	ZeroMemory(pFrameHeader, sizeof(WS_PACKED_FRAME_HEADER));
@@ -157,15 +271,15 @@ SetWebsocketFrame(
 	{
 		pOut[1] |= 0x7F;
 		pFrameHeader->Length += sizeof(ULONGLONG);
-		(*(ULONGLONG*) pExtraOut) = pFrameInfo->PayloadLength;
-		pExtraOut += sizeof(ULONGLONG);
+		for (INT i = 7; i >= 0; --i)
+			*pExtraOut++ = (BYTE) (pFrameInfo->PayloadLength >> (i * 8));
 	}
-	else if (pFrameInfo->PayloadLength > 0x7E)
+	else if (pFrameInfo->PayloadLength > 0x7D)
 	{
 		pOut[1] |= 0x7E;
 		pFrameHeader->Length += sizeof(USHORT);
-		(*(USHORT*) pExtraOut) = (USHORT) pFrameInfo->PayloadLength;
-		pExtraOut += sizeof(USHORT);
+		*pExtraOut++ = (BYTE) (pFrameInfo->PayloadLength >> 8);
+		*pExtraOut++ = (BYTE) pFrameInfo->PayloadLength;
 	}
 	else
 	{
@@ -175,7 +289,7 @@ SetWebsocketFrame(
 	if (pFrameInfo->Masked)
 	{
 		pFrameHeader->Length += sizeof(DWORD);
-		(*(DWORD*) pExtraOut) = pFrameInfo->MaskingKey;
+		memcpy(pExtraOut, &pFrameInfo->MaskingKey, sizeof(DWORD));
 		pExtraOut += sizeof(DWORD);
 	}
 
@@ -232,23 +346,328 @@ SetWebsocketCloseFrame(
 	return WS_FRAME_OK;
 }
 
+/*
+	STREAMING DECODER
+*/
+enum WS_DECODE_STATE
+{
+	WS_DECODE_STATE_HEADER,			// Collecting header bytes
+	WS_DECODE_STATE_PAYLOAD,		// Handing out payload
+	WS_DECODE_STATE_ERROR
+};
+
+WebsocketFrameDecoder::WebsocketFrameDecoder()
+	: MaxPayloadSize(16 * 1024 * 1024)
+	, RequireMasked(true)
+	, Unmask(true)
+	, AllowRSV1(false)
+{
+	Reset();
+}
+
+void WebsocketFrameDecoder::Reset()
+{
+	m_State = WS_DECODE_STATE_HEADER;
+	m_HeaderLength = 0;
+	m_PayloadOffset = 0;
+	m_SliceOffset = 0;
+	m_Error = WS_CLOSE_NORMAL;
+
+	ZeroMemory(&m_Frame, sizeof(m_Frame));
+}
+
+const WS_FRAME_INFO& WebsocketFrameDecoder::Frame() const
+{
+	return m_Frame;
+}
+
+ULONGLONG WebsocketFrameDecoder::PayloadOffset() const
+{
+	return m_SliceOffset;
+}
+
+WS_CLOSE_REASON WebsocketFrameDecoder::Error() const
+{
+	return m_Error;
+}
+
+WS_DECODE_RESULT WebsocketFrameDecoder::Decode(
+	LPVOID pData,
+	SIZE_T DataLength,
+	SIZE_T* pConsumedOut,
+	StringView* pPayloadOut)
+{
+	LPBYTE pBytes = (LPBYTE) pData;
+
+	*pConsumedOut = 0;
+	pPayloadOut->Data = nullptr;
+	pPayloadOut->Length = 0;
+
+	if (m_State == WS_DECODE_STATE_ERROR)
+	{
+		return WS_DECODE_ERROR;
+	}
+
+	if (m_State == WS_DECODE_STATE_PAYLOAD)
+	{
+		ULONGLONG remaining = m_Frame.PayloadLength - m_PayloadOffset;
+		if (!remaining)
+		{
+			m_State = WS_DECODE_STATE_HEADER;
+			m_HeaderLength = 0;
+			return WS_DECODE_FRAME_END;
+		}
+
+		if (!DataLength)
+		{
+			return WS_DECODE_NEED_MORE;
+		}
+
+		SIZE_T length = remaining < DataLength ? (SIZE_T) remaining : DataLength;
+
+		if (Unmask && m_Frame.Masked)
+		{
+			MaskWebsocketPayloadAt(pBytes, length, m_Frame.MaskingKey, m_PayloadOffset, pBytes);
+		}
+
+		m_SliceOffset = m_PayloadOffset;
+		m_PayloadOffset += length;
+
+		pPayloadOut->Data = (LPCSTR) pBytes;
+		pPayloadOut->Length = length;
+		*pConsumedOut = length;
+
+		return WS_DECODE_DATA;
+	}
+
+	//
+	// Collect the header. The first two bytes say how long the rest
+	// of it is.
+	//
+	SIZE_T needed = m_HeaderLength < 2 ? 2 : FrameHeaderSize(m_Header[1]);
+	SIZE_T i = 0;
+
+	while (i < DataLength)
+	{
+		m_Header[m_HeaderLength++] = pBytes[i++];
+
+		if (m_HeaderLength == 2)
+		{
+			needed = FrameHeaderSize(m_Header[1]);
+		}
+
+		if (m_HeaderLength == needed)
+		{
+			break;
+		}
+	}
+
+	*pConsumedOut = i;
+
+	if (m_HeaderLength < needed)
+	{
+		return WS_DECODE_NEED_MORE;
+	}
+
+	ReadFrameHeader(m_Header, &m_Frame);
+
+	m_PayloadOffset = 0;
+	m_SliceOffset = 0;
+	m_State = WS_DECODE_STATE_PAYLOAD;
+
+	//
+	// Check it. RSV1 is only used by permessage-deflate, and then
+	// only on the first frame of a message; the assembler checks
+	// that. Nothing uses the others.
+	//
+	INT opCode = m_Frame.OpCode;
+	bool knownOpCode = 
+		opCode == WS_FRAME_OPCODE_CONTINUATION ||
+		opCode == WS_FRAME_OPCODE_TEXT ||
+		opCode == WS_FRAME_OPCODE_BINARY ||
+		opCode == WS_FRAME_OPCODE_CONNECTION_CLOSE ||
+		opCode == WS_FRAME_OPCODE_PING ||
+		opCode == WS_FRAME_OPCODE_PONG;
+
+	if (!knownOpCode ||
+		(m_Frame.RSV1 && !AllowRSV1) || m_Frame.RSV2 || m_Frame.RSV3 ||
+		(m_Frame.PayloadLength >> 63) ||
+		(RequireMasked && !m_Frame.Masked))
+	{
+		m_Error = WS_CLOSE_PROTOCOL_ERROR;
+	}
+	else if (IsControlOpCode(opCode) &&
+		(!m_Frame.FinalPacket || m_Frame.PayloadLength > WS_MAX_CONTROL_PAYLOAD))
+	{
+		m_Error = WS_CLOSE_PROTOCOL_ERROR;
+	}
+	else if (m_Frame.PayloadLength > MaxPayloadSize)
+	{
+		m_Error = WS_CLOSE_MESSAGE_TOO_LARGE;
+	}
+	else
+	{
+		return WS_DECODE_HEADER;
+	}
+
+	m_State = WS_DECODE_STATE_ERROR;
+	return WS_DECODE_ERROR;
+}
+
+/*
+	MASKING
+
+	The mask repeats every 4 bytes, so once it's been rotated to
+	line up with the start of the data it can be widened to 8, 16
+	or 32 bytes and XORed in that many at a time. All of the loads
+	and stores are unaligned, so the only special case is the tail
+	that's shorter than a block.
+*/
+typedef void (*MASK_FUNC)(LPCBYTE, LPBYTE, SIZE_T, UINT64);
+
+void MaskScalar(LPCBYTE pIn, LPBYTE pOut, SIZE_T Length, UINT64 Mask)
+{
+	while (Length >= 8)
+	{
+		UINT64 block;
+		memcpy(&block, pIn, 8);
+		block ^= Mask;
+		memcpy(pOut, &block, 8);
+
+		pIn += 8;
+		pOut += 8;
+		Length -= 8;
+	}
+
+	LPCBYTE maskBytes = (LPCBYTE) &Mask;
+	for (SIZE_T i = 0; i < Length; ++i)
+	{
+		pOut[i] = pIn[i] ^ maskBytes[i];
+	}
+}
+
+#if defined(HTTP_X86)
+
+HTTP_TARGET("sse2")
+void MaskSSE2(LPCBYTE pIn, LPBYTE pOut, SIZE_T Length, UINT64 Mask)
+{
+	__m128i mask = _mm_set1_epi64x((LONGLONG) Mask);
+
+	while (Length >= 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i*) pIn);
+		_mm_storeu_si128((__m128i*) pOut, _mm_xor_si128(block, mask));
+
+		pIn += 16;
+		pOut += 16;
+		Length -= 16;
+	}
+
+	MaskScalar(pIn, pOut, Length, Mask);
+}
+
+HTTP_TARGET("avx2")
+void MaskAVX2(LPCBYTE pIn, LPBYTE pOut, SIZE_T Length, UINT64 Mask)
+{
+	__m256i mask = _mm256_set1_epi64x((LONGLONG) Mask);
+
+	while (Length >= 64)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*) pIn);
+		__m256i b = _mm256_loadu_si256((const __m256i*) (pIn + 32));
+		_mm256_storeu_si256((__m256i*) pOut, _mm256_xor_si256(a, mask));
+		_mm256_storeu_si256((__m256i*) (pOut + 32), _mm256_xor_si256(b, mask));
+
+		pIn += 64;
+		pOut += 64;
+		Length -= 64;
+	}
+
+	if (Length >= 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*) pIn);
+		_mm256_storeu_si256((__m256i*) pOut, _mm256_xor_si256(a, mask));
+
+		pIn += 32;
+		pOut += 32;
+		Length -= 32;
+	}
+
+	MaskSSE2(pIn, pOut, Length, Mask);
+}
+
+#endif
+
+MASK_FUNC SelectMaskFunc()
+{
+#if defined(HTTP_X86)
+	const CPU_FEATURES& cpu = GetCPUFeatures();
+
+	if (cpu.AVX2)
+	{
+		return MaskAVX2;
+	}
+	if (cpu.SSE2)
+	{
+		return MaskSSE2;
+	}
+#endif
+
+	return MaskScalar;
+}
+
 void 
-MaskWebsocketPayload(
+MaskWebsocketPayloadAt(
 	_In_reads_(DataLength) LPCVOID pData,
 	_In_ ULONGLONG DataLength,
 	_In_ DWORD MaskingKey,
+	_In_ ULONGLONG Offset,
 	_Out_writes_(DataLength) LPVOID pOutData)
 {
-	LPCBYTE pInDataBytes = (LPCBYTE) pData;
-	LPCBYTE MaskBytes = (LPCBYTE) &MaskingKey;
-	LPBYTE pOutDataBytes = (LPBYTE) pOutData;
+	static const MASK_FUNC mask = SelectMaskFunc();
+
+	//
+	// Rotate the key so its first byte is the one for Offset, then
+	// repeat it to fill 64 bits. The key is in wire order, so this
+	// is done bytewise to stay independent of endianness.
+	//
+	LPCBYTE keyBytes = (LPCBYTE) &MaskingKey;
+	BYTE rotated[8];
+	for (INT i = 0; i < 8; ++i)
+	{
+		rotated[i] = keyBytes[(Offset + i) % 4];
+	}
+
+	UINT64 wideMask;
+	memcpy(&wideMask, rotated, sizeof(wideMask));
+
+	LPCBYTE pIn = (LPCBYTE) pData;
+	LPBYTE pOut = (LPBYTE) pOutData;
 
-	for (ULONGLONG i = 0; i < DataLength; ++i)
+	// Blocks are multiples of 4 bytes, so the mask stays lined up
+	// however the work is split.
+	const ULONGLONG kMaxChunk = (ULONGLONG) ((SIZE_T) -1) & ~(ULONGLONG) 63;
+	while (DataLength)
 	{
-		pOutDataBytes[i] = pInDataBytes[i] ^ MaskBytes[i % 4];
+		SIZE_T length = (SIZE_T) (DataLength < kMaxChunk ? DataLength : kMaxChunk);
+		mask(pIn, pOut, length, wideMask);
+
+		pIn += length;
+		pOut += length;
+		DataLength -= length;
 	}
 }
 
+void 
+MaskWebsocketPayload(
+	_In_reads_(DataLength) LPCVOID pData,
+	_In_ ULONGLONG DataLength,
+	_In_ DWORD MaskingKey,
+	_Out_writes_(DataLength) LPVOID pOutData)
+{
+	MaskWebsocketPayloadAt(pData, DataLength, MaskingKey, 0, pOutData);
+}
+
 void 
 UnmaskWebsocketPayload(
 	_In_reads_(DataLength) LPCVOID pData,
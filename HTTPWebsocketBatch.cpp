@@ -0,0 +1,172 @@
+#include "HTTP.h"
+
+#include <string.h>
+
+namespace HTTP
+{
+
+/*
+	FRAME BATCHING
+
+	Frames are appended to one buffer, which keeps its capacity from
+	one batch to the next. Anything added while a batch is partly
+	sent goes on the end, and the buffer is emptied once it's all 
+	gone. If it never quite all goes, what's been sent is dropped 
+	from the front once it's at least half the buffer, so that the
+	buffer doesn't keep growing.
+*/
+WebsocketFrameBatcher::WebsocketFrameBatcher(
+	SIZE_T MaxBatchSize,
+	ULONGLONG FlushDelay)
+	: MaxBatchSize(MaxBatchSize)
+	, FlushDelay(FlushDelay)
+	, m_Offset(0)
+	, m_Deadline(0)
+{
+	m_Buffer.reserve(MaxBatchSize);
+}
+
+WS_BATCH_RESULT WebsocketFrameBatcher::Reserve(
+	SIZE_T FrameLength,
+	ULONGLONG Now)
+{
+	if (Empty())
+	{
+		m_Deadline = Now + FlushDelay;
+	}
+	else if (Length() + FrameLength > MaxBatchSize)
+	{
+		return WS_BATCH_FULL;
+	}
+
+	if (m_Offset && m_Offset >= m_Buffer.size() / 2)
+	{
+		m_Buffer.erase(0, m_Offset);
+		m_Offset = 0;
+	}
+
+	return WS_BATCH_OK;
+}
+
+WS_BATCH_RESULT WebsocketFrameBatcher::Added() const
+{
+	return Length() >= MaxBatchSize ? WS_BATCH_FLUSH : WS_BATCH_OK;
+}
+
+WS_BATCH_RESULT WebsocketFrameBatcher::Add(
+	const WS_FRAME_INFO& Info,
+	LPCVOID pPayload,
+	ULONGLONG Now)
+{
+	WS_PACKED_FRAME_HEADER header;
+	if (SetWebsocketFrame(&Info, &header) != WS_FRAME_OK || 
+		(Info.PayloadLength && !pPayload) ||
+		Info.PayloadLength > (SIZE_T) -1 - header.Length)
+	{
+		return WS_BATCH_ERROR;
+	}
+
+	SIZE_T payloadLength = (SIZE_T) Info.PayloadLength;
+
+	WS_BATCH_RESULT result = Reserve(header.Length + payloadLength, Now);
+	if (result != WS_BATCH_OK)
+	{
+		return result;
+	}
+
+	SIZE_T offset = m_Buffer.size();
+	m_Buffer.resize(offset + header.Length + payloadLength);
+
+	memcpy(&m_Buffer[offset], header.Data, header.Length);
+
+	if (payloadLength)
+	{
+		LPVOID pOut = &m_Buffer[offset + header.Length];
+
+		if (Info.Masked)
+		{
+			MaskWebsocketPayload(pPayload, payloadLength, Info.MaskingKey, pOut);
+		}
+		else
+		{
+			memcpy(pOut, pPayload, payloadLength);
+		}
+	}
+
+	return Added();
+}
+
+WS_BATCH_RESULT WebsocketFrameBatcher::Add(
+	WS_FRAME_OPCODE OpCode,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength,
+	ULONGLONG Now)
+{
+	WS_FRAME_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	info.FinalPacket = 1;
+	info.OpCode = OpCode;
+	info.PayloadLength = PayloadLength;
+
+	return Add(info, pPayload, Now);
+}
+
+WS_BATCH_RESULT WebsocketFrameBatcher::Add(
+	const WebsocketSharedFrame& Frame,
+	ULONGLONG Now)
+{
+	WS_BATCH_RESULT result = Reserve(Frame.Length(), Now);
+	if (result != WS_BATCH_OK)
+	{
+		return result;
+	}
+
+	m_Buffer.append((LPCSTR) Frame.Data(), Frame.Length());
+
+	return Added();
+}
+
+bool WebsocketFrameBatcher::FlushDue(
+	ULONGLONG Now) const
+{
+	return !Empty() && Now >= m_Deadline;
+}
+
+ULONGLONG WebsocketFrameBatcher::Deadline() const
+{
+	return m_Deadline;
+}
+
+LPCVOID WebsocketFrameBatcher::Data() const
+{
+	return m_Buffer.data() + m_Offset;
+}
+
+SIZE_T WebsocketFrameBatcher::Length() const
+{
+	return m_Buffer.size() - m_Offset;
+}
+
+bool WebsocketFrameBatcher::Empty() const
+{
+	return m_Offset == m_Buffer.size();
+}
+
+void WebsocketFrameBatcher::Consume(
+	SIZE_T BytesSent)
+{
+	m_Offset += BytesSent < Length() ? BytesSent : Length();
+
+	if (Empty())
+	{
+		Clear();
+	}
+}
+
+void WebsocketFrameBatcher::Clear()
+{
+	m_Buffer.clear();
+	m_Offset = 0;
+}
+
+}
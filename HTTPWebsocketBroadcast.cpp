@@ -0,0 +1,190 @@
+#include "HTTPInternal.h"
+
+#include <string.h>
+
+namespace HTTP
+{
+
+/*
+	SHARED FRAMES
+
+	The header and payload go in one buffer, so a frame is one
+	allocation for the bytes and one for the shared_ptr, however
+	many connections it's queued on.
+*/
+WebsocketSharedFrame::WebsocketSharedFrame()
+	: m_HeaderLength(0)
+{
+}
+
+WS_SHARED_FRAME WebsocketSharedFrame::Build(
+	WS_FRAME_OPCODE OpCode,
+	bool Compressed,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength)
+{
+	if (IsControlOpCode(OpCode) && (Compressed || PayloadLength > WS_MAX_CONTROL_PAYLOAD))
+	{
+		return WS_SHARED_FRAME();
+	}
+
+	WS_FRAME_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	info.FinalPacket = 1;
+	info.RSV1 = Compressed ? 1 : 0;
+	info.OpCode = OpCode;
+	info.PayloadLength = PayloadLength;
+
+	WS_PACKED_FRAME_HEADER header;
+	if (SetWebsocketFrame(&info, &header) != WS_FRAME_OK)
+	{
+		return WS_SHARED_FRAME();
+	}
+
+	std::shared_ptr<WebsocketSharedFrame> frame(new WebsocketSharedFrame());
+
+	frame->m_HeaderLength = header.Length;
+	frame->m_Data.resize(header.Length + PayloadLength);
+
+	memcpy(&frame->m_Data[0], header.Data, header.Length);
+	if (PayloadLength)
+	{
+		memcpy(&frame->m_Data[header.Length], pPayload, PayloadLength);
+	}
+
+	return frame;
+}
+
+WS_SHARED_FRAME WebsocketSharedFrame::Create(
+	WS_FRAME_OPCODE OpCode,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength)
+{
+	return Build(OpCode, false, pPayload, PayloadLength);
+}
+
+#if !defined(HTTP_NO_DEFLATE)
+WS_SHARED_FRAME WebsocketSharedFrame::Create(
+	WS_FRAME_OPCODE OpCode,
+	LPCVOID pPayload,
+	SIZE_T PayloadLength,
+	WebsocketDeflate& Deflate)
+{
+	// Control frames are never compressed
+	if (!Deflate.Params().ServerNoContextTakeover || IsControlOpCode(OpCode))
+	{
+		return WS_SHARED_FRAME();
+	}
+
+	String compressed;
+	if (Deflate.Compress(pPayload, PayloadLength, compressed) != WS_DEFLATE_OK)
+	{
+		return WS_SHARED_FRAME();
+	}
+
+	return Build(OpCode, true, compressed.data(), compressed.size());
+}
+#endif
+
+LPCVOID WebsocketSharedFrame::Data() const
+{
+	return m_Data.data();
+}
+
+SIZE_T WebsocketSharedFrame::Length() const
+{
+	return m_Data.size();
+}
+
+SIZE_T WebsocketSharedFrame::HeaderLength() const
+{
+	return m_HeaderLength;
+}
+
+/*
+	SEND QUEUE
+*/
+WebsocketSendQueue::WebsocketSendQueue()
+	: MaxQueuedBytes(16 * 1024 * 1024)
+	, m_FrontOffset(0)
+	, m_QueuedBytes(0)
+{
+}
+
+bool WebsocketSendQueue::Push(
+	const WS_SHARED_FRAME& Frame)
+{
+	if (!Frame)
+	{
+		return false;
+	}
+
+	if (MaxQueuedBytes && m_QueuedBytes + Frame->Length() > MaxQueuedBytes)
+	{
+		return false;
+	}
+
+	m_Frames.push_back(Frame);
+	m_QueuedBytes += Frame->Length();
+
+	return true;
+}
+
+SIZE_T WebsocketSendQueue::Gather(
+	RESPONSE_SEGMENT* pSegments,
+	SIZE_T MaxSegments) const
+{
+	SIZE_T count = 0;
+	SIZE_T offset = m_FrontOffset;
+
+	for (auto frame = std::begin(m_Frames); frame != std::end(m_Frames) && count < MaxSegments; ++frame)
+	{
+		pSegments[count].Data = (LPCBYTE) (*frame)->Data() + offset;
+		pSegments[count].Length = (*frame)->Length() - offset;
+		count++;
+
+		offset = 0;
+	}
+
+	return count;
+}
+
+void WebsocketSendQueue::Consume(
+	SIZE_T BytesSent)
+{
+	m_QueuedBytes -= BytesSent < m_QueuedBytes ? BytesSent : m_QueuedBytes;
+
+	while (!m_Frames.empty())
+	{
+		SIZE_T remaining = m_Frames.front()->Length() - m_FrontOffset;
+
+		if (BytesSent < remaining)
+		{
+			m_FrontOffset += BytesSent;
+			break;
+		}
+
+		BytesSent -= remaining;
+		m_FrontOffset = 0;
+		m_Frames.pop_front();
+	}
+}
+
+void WebsocketSendQueue::Clear()
+{
+	m_Frames.clear();
+	m_FrontOffset = 0;
+	m_QueuedBytes = 0;
+}
+
+bool WebsocketSendQueue::Empty() const
+{
+	return m_Frames.empty();
+}
+
+ULONGLONG WebsocketSendQueue::QueuedBytes() const
+{
+	return m_QueuedBytes;
+}
+
+}
@@ -0,0 +1,630 @@
+#include "HTTP.h"
+
+#if !defined(HTTP_NO_DEFLATE)
+
+#include <string.h>
+#include <zlib.h>
+
+namespace HTTP
+{
+
+/*
+	NEGOTIATION (RFC 7692 section 7.1)
+
+	The client lists what it'll accept in Sec-WebSocket-Extensions,
+	most preferred first:
+
+		permessage-deflate; client_max_window_bits, permessage-deflate
+
+	We take the first permessage-deflate offer we can agree to.
+*/
+#define WS_DEFLATE_MIN_WINDOW_BITS 9	// zlib can't do raw deflate with 8
+#define WS_DEFLATE_MAX_WINDOW_BITS 15
+
+const BYTE kDeflateTail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+inline StringView Trim(LPCSTR pBegin, LPCSTR pEnd)
+{
+	while (pBegin < pEnd && IsSpace(*pBegin))
+	{
+		pBegin++;
+	}
+
+	while (pEnd > pBegin && IsSpace(pEnd[-1]))
+	{
+		pEnd--;
+	}
+
+	StringView view = { pBegin, (SIZE_T) (pEnd - pBegin) };
+	return view;
+}
+
+// Returns 0 if it isn't a number from 8 to 15
+BYTE ParseWindowBits(StringView Value)
+{
+	// The value can be sent as a quoted string
+	if (Value.Length >= 2 && Value.Data[0] == '"' && Value.Data[Value.Length - 1] == '"')
+	{
+		Value.Data++;
+		Value.Length -= 2;
+	}
+
+	UINT bits = 0;
+
+	if (!Value.Length || Value.Length > 2 || Value.Data[0] == '0')
+	{
+		return 0;
+	}
+
+	for (SIZE_T i = 0; i < Value.Length; ++i)
+	{
+		if (Value.Data[i] < '0' || Value.Data[i] > '9')
+		{
+			return 0;
+		}
+
+		bits = bits * 10 + (Value.Data[i] - '0');
+	}
+
+	return (bits >= 8 && bits <= WS_DEFLATE_MAX_WINDOW_BITS) ? (BYTE) bits : 0;
+}
+
+//
+// Agrees one offer (the text between the commas) against the
+// server's preferences. Returns false if the offer isn't for
+// permessage-deflate or has parameters we don't understand.
+//
+bool NegotiateOffer(
+	LPCSTR pBegin,
+	LPCSTR pEnd,
+	const WS_DEFLATE_PARAMS& Preferred,
+	WS_DEFLATE_PARAMS* pAgreed)
+{
+	LPCSTR pSemicolon = (LPCSTR) memchr(pBegin, ';', pEnd - pBegin);
+	LPCSTR pNameEnd = pSemicolon ? pSemicolon : pEnd;
+
+	if (!Trim(pBegin, pNameEnd).EqualsNoCase("permessage-deflate"))
+	{
+		return false;
+	}
+
+	bool serverNoContextTakeover = false;
+	bool clientNoContextTakeover = false;
+	bool haveServerWindowBits = false;
+	bool haveClientWindowBits = false;
+	BYTE serverWindowBits = WS_DEFLATE_MAX_WINDOW_BITS;
+	BYTE clientWindowBits = WS_DEFLATE_MAX_WINDOW_BITS;
+
+	while (pSemicolon)
+	{
+		LPCSTR pParam = pSemicolon + 1;
+		pSemicolon = (LPCSTR) memchr(pParam, ';', pEnd - pParam);
+		LPCSTR pParamEnd = pSemicolon ? pSemicolon : pEnd;
+
+		LPCSTR pEquals = (LPCSTR) memchr(pParam, '=', pParamEnd - pParam);
+		StringView name = Trim(pParam, pEquals ? pEquals : pParamEnd);
+		StringView value = { nullptr, 0 };
+
+		if (pEquals)
+		{
+			value = Trim(pEquals + 1, pParamEnd);
+		}
+
+		//
+		// Each parameter can only appear once, and the ones that
+		// don't take a value mustn't have one.
+		//
+		if (name.EqualsNoCase("server_no_context_takeover") && !pEquals && !serverNoContextTakeover)
+		{
+			serverNoContextTakeover = true;
+		}
+		else if (name.EqualsNoCase("client_no_context_takeover") && !pEquals && !clientNoContextTakeover)
+		{
+			clientNoContextTakeover = true;
+		}
+		else if (name.EqualsNoCase("server_max_window_bits") && pEquals && !haveServerWindowBits)
+		{
+			serverWindowBits = ParseWindowBits(value);
+			haveServerWindowBits = true;
+
+			if (serverWindowBits < WS_DEFLATE_MIN_WINDOW_BITS)
+			{
+				return false;
+			}
+		}
+		else if (name.EqualsNoCase("client_max_window_bits") && !haveClientWindowBits)
+		{
+			// The value is optional; without one, the client is
+			// just saying it'll take a limit from us.
+			if (pEquals)
+			{
+				clientWindowBits = ParseWindowBits(value);
+
+				if (!clientWindowBits)
+				{
+					return false;
+				}
+			}
+
+			haveClientWindowBits = true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	//
+	// The server's window is whichever of the two is smaller. We
+	// can only limit the client's if it said it would take a limit,
+	// and we never have to: inflating always uses the largest
+	// window, which copes with anything smaller.
+	//
+	BYTE preferredServerBits = Preferred.ServerMaxWindowBits;
+	if (preferredServerBits < WS_DEFLATE_MIN_WINDOW_BITS || preferredServerBits > WS_DEFLATE_MAX_WINDOW_BITS)
+	{
+		preferredServerBits = WS_DEFLATE_MAX_WINDOW_BITS;
+	}
+
+	pAgreed->ServerNoContextTakeover = Preferred.ServerNoContextTakeover || serverNoContextTakeover;
+	pAgreed->ClientNoContextTakeover = Preferred.ClientNoContextTakeover || clientNoContextTakeover;
+	pAgreed->ServerMaxWindowBits = serverWindowBits < preferredServerBits ? serverWindowBits : preferredServerBits;
+	pAgreed->ClientMaxWindowBits = 0;
+
+	if (haveClientWindowBits && Preferred.ClientMaxWindowBits)
+	{
+		BYTE preferredClientBits = Preferred.ClientMaxWindowBits;
+		if (preferredClientBits < 8)
+		{
+			preferredClientBits = 8;
+		}
+
+		pAgreed->ClientMaxWindowBits = clientWindowBits < preferredClientBits ? clientWindowBits : preferredClientBits;
+	}
+
+	return true;
+}
+
+void DefaultWebsocketDeflateParams(
+	WS_DEFLATE_PARAMS* pParams)
+{
+	pParams->ServerNoContextTakeover = true;
+	pParams->ClientNoContextTakeover = true;
+	pParams->ServerMaxWindowBits = WS_DEFLATE_MAX_WINDOW_BITS;
+	pParams->ClientMaxWindowBits = 0;
+}
+
+bool NegotiateWebsocketDeflate(
+	const RequestHeader& Request,
+	WS_DEFLATE_PARAMS* pParams)
+{
+	StringView extensions;
+	if (!Request.FindHeader(HEADER_SEC_WEBSOCKET_EXTENSIONS, &extensions) || !extensions.Length)
+	{
+		return false;
+	}
+
+	const WS_DEFLATE_PARAMS preferred = *pParams;
+
+	LPCSTR pOffer = extensions.Data;
+	LPCSTR pEnd = extensions.Data + extensions.Length;
+
+	while (pOffer < pEnd)
+	{
+		LPCSTR pComma = (LPCSTR) memchr(pOffer, ',', pEnd - pOffer);
+		LPCSTR pOfferEnd = pComma ? pComma : pEnd;
+
+		if (NegotiateOffer(pOffer, pOfferEnd, preferred, pParams))
+		{
+			return true;
+		}
+
+		pOffer = pOfferEnd + 1;
+	}
+
+	return false;
+}
+
+void AddWebsocketDeflateHeader(
+	const WS_DEFLATE_PARAMS& Params,
+	ResponseHeaderBuilder* pResponseBuilder)
+{
+	String value = "permessage-deflate";
+
+	if (Params.ServerNoContextTakeover)
+	{
+		value += "; server_no_context_takeover";
+	}
+
+	if (Params.ClientNoContextTakeover)
+	{
+		value += "; client_no_context_takeover";
+	}
+
+	// Always sent; it's how we accept an offer that included it
+	value += "; server_max_window_bits=";
+	value += std::to_string((UINT) Params.ServerMaxWindowBits);
+
+	if (Params.ClientMaxWindowBits)
+	{
+		value += "; client_max_window_bits=";
+		value += std::to_string((UINT) Params.ClientMaxWindowBits);
+	}
+
+	pResponseBuilder->AddKey("Sec-WebSocket-Extensions", value);
+}
+
+/*
+	STREAM POOL
+
+	A deflate stream with the default settings is about 256KB and
+	an inflate one about 40KB, so connections that don't keep
+	context hand them back here between messages. Deflate streams
+	are kept by window size, since that can't be changed by a reset.
+*/
+WebsocketDeflatePool::WebsocketDeflatePool(
+	INT Level,
+	INT MemLevel,
+	SIZE_T MaxFree)
+	: m_Level(Level)
+	, m_MemLevel(MemLevel)
+	, m_MaxFree(MaxFree)
+{
+}
+
+WebsocketDeflatePool::~WebsocketDeflatePool()
+{
+	for (INT bits = 0; bits < 16; ++bits)
+	{
+		for (auto stream = std::begin(m_FreeDeflate[bits]); stream != std::end(m_FreeDeflate[bits]); ++stream)
+		{
+			deflateEnd(*stream);
+			delete *stream;
+		}
+	}
+
+	for (auto stream = std::begin(m_FreeInflate); stream != std::end(m_FreeInflate); ++stream)
+	{
+		inflateEnd(*stream);
+		delete *stream;
+	}
+}
+
+z_stream* WebsocketDeflatePool::AcquireDeflate(
+	INT WindowBits)
+{
+	if (WindowBits < WS_DEFLATE_MIN_WINDOW_BITS || WindowBits > WS_DEFLATE_MAX_WINDOW_BITS)
+	{
+		return nullptr;
+	}
+
+	std::vector<z_stream*>& free = m_FreeDeflate[WindowBits];
+
+	if (!free.empty())
+	{
+		z_stream* stream = free.back();
+		free.pop_back();
+
+		return stream;
+	}
+
+	z_stream* stream = new z_stream();
+
+	// Negative window bits mean raw deflate, without the zlib wrapper
+	if (deflateInit2(stream, m_Level, Z_DEFLATED, -WindowBits, m_MemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		delete stream;
+		return nullptr;
+	}
+
+	return stream;
+}
+
+void WebsocketDeflatePool::ReleaseDeflate(
+	z_stream* pStream,
+	INT WindowBits)
+{
+	if (!pStream)
+	{
+		return;
+	}
+
+	if (m_FreeDeflate[WindowBits].size() < m_MaxFree && deflateReset(pStream) == Z_OK)
+	{
+		m_FreeDeflate[WindowBits].push_back(pStream);
+	}
+	else
+	{
+		deflateEnd(pStream);
+		delete pStream;
+	}
+}
+
+z_stream* WebsocketDeflatePool::AcquireInflate()
+{
+	if (!m_FreeInflate.empty())
+	{
+		z_stream* stream = m_FreeInflate.back();
+		m_FreeInflate.pop_back();
+
+		return stream;
+	}
+
+	z_stream* stream = new z_stream();
+
+	if (inflateInit2(stream, -WS_DEFLATE_MAX_WINDOW_BITS) != Z_OK)
+	{
+		delete stream;
+		return nullptr;
+	}
+
+	return stream;
+}
+
+void WebsocketDeflatePool::ReleaseInflate(
+	z_stream* pStream)
+{
+	if (!pStream)
+	{
+		return;
+	}
+
+	if (m_FreeInflate.size() < m_MaxFree && inflateReset(pStream) == Z_OK)
+	{
+		m_FreeInflate.push_back(pStream);
+	}
+	else
+	{
+		inflateEnd(pStream);
+		delete pStream;
+	}
+}
+
+/*
+	COMPRESSION (RFC 7692 section 7.2)
+
+	Each message is deflated and sync flushed, which ends it with an
+	empty stored block: 00 00 FF FF. That's taken off before sending,
+	and the receiver puts it back before inflating.
+*/
+WebsocketDeflate::WebsocketDeflate(
+	const WS_DEFLATE_PARAMS& Params,
+	WebsocketDeflatePool* pPool)
+	: MaxMessageSize(16 * 1024 * 1024)
+	, m_Params(Params)
+	, m_pPool(pPool)
+	, m_pDeflate(nullptr)
+	, m_pInflate(nullptr)
+{
+	if (!m_pPool)
+	{
+		m_OwnPool.reset(new WebsocketDeflatePool());
+		m_pPool = m_OwnPool.get();
+	}
+
+	if (m_Params.ServerMaxWindowBits < WS_DEFLATE_MIN_WINDOW_BITS || m_Params.ServerMaxWindowBits > WS_DEFLATE_MAX_WINDOW_BITS)
+	{
+		m_Params.ServerMaxWindowBits = WS_DEFLATE_MAX_WINDOW_BITS;
+	}
+}
+
+WebsocketDeflate::~WebsocketDeflate()
+{
+	m_pPool->ReleaseDeflate(m_pDeflate, m_Params.ServerMaxWindowBits);
+	m_pPool->ReleaseInflate(m_pInflate);
+}
+
+const WS_DEFLATE_PARAMS& WebsocketDeflate::Params() const
+{
+	return m_Params;
+}
+
+WS_DEFLATE_RESULT WebsocketDeflate::Compress(
+	LPCVOID pData,
+	SIZE_T DataLength,
+	String& Output)
+{
+	z_stream* stream = m_pDeflate;
+
+	if (!stream)
+	{
+		stream = m_pPool->AcquireDeflate(m_Params.ServerMaxWindowBits);
+
+		if (!stream)
+		{
+			return WS_DEFLATE_ERROR;
+		}
+	}
+
+	//
+	// deflateBound doesn't count the sync flush, so leave room for
+	// that too. Output keeps its capacity, so once it's grown to
+	// suit the messages being sent this doesn't allocate.
+	//
+	SIZE_T length = 0;
+	Output.resize(deflateBound(stream, (uLong) DataLength) + 16);
+
+	stream->next_in = (Bytef*) pData;
+	stream->avail_in = (uInt) DataLength;
+
+	INT result;
+
+	for (;;)
+	{
+		stream->next_out = (Bytef*) &Output[length];
+		stream->avail_out = (uInt) (Output.size() - length);
+
+		result = deflate(stream, Z_SYNC_FLUSH);
+
+		length = Output.size() - stream->avail_out;
+
+		// It's done when it didn't fill the output
+		if (result != Z_OK || stream->avail_out)
+		{
+			break;
+		}
+
+		Output.resize(Output.size() * 2);
+	}
+
+	if (m_Params.ServerNoContextTakeover)
+	{
+		m_pPool->ReleaseDeflate(stream, m_Params.ServerMaxWindowBits);
+	}
+	else
+	{
+		m_pDeflate = stream;
+	}
+
+	if (result != Z_OK || length < sizeof(kDeflateTail) ||
+		memcmp(&Output[length - sizeof(kDeflateTail)], kDeflateTail, sizeof(kDeflateTail)))
+	{
+		Output.clear();
+		return WS_DEFLATE_ERROR;
+	}
+
+	Output.resize(length - sizeof(kDeflateTail));
+
+	return WS_DEFLATE_OK;
+}
+
+WS_DEFLATE_RESULT WebsocketDeflate::Decompress(
+	const WS_MESSAGE& Message,
+	String& Output)
+{
+	Output.clear();
+
+	if (!Message.Compressed)
+	{
+		for (SIZE_T i = 0; i < Message.PieceCount; ++i)
+		{
+			Output.append(Message.Pieces[i].Data, Message.Pieces[i].Length);
+		}
+
+		return WS_DEFLATE_OK;
+	}
+
+	z_stream* stream = m_pInflate;
+
+	if (!stream)
+	{
+		stream = m_pPool->AcquireInflate();
+
+		if (!stream)
+		{
+			return WS_DEFLATE_ERROR;
+		}
+	}
+
+	WS_DEFLATE_RESULT result = WS_DEFLATE_OK;
+	SIZE_T length = 0;
+	bool ended = false;
+
+	//
+	// A byte of room past the limit, since the tail can still be
+	// waiting to go in when a message that's exactly the limit has
+	// filled the output.
+	//
+	ULONGLONG room = MaxMessageSize < (ULONGLONG) -1 ? MaxMessageSize + 1 : MaxMessageSize;
+
+	// Start from its capacity, but at least twice the message
+	Output.resize(Output.capacity() > Message.Length * 2 ? Output.capacity() : (SIZE_T) Message.Length * 2 + 64);
+
+	//
+	// The pieces, then the tail that the sender took off. The
+	// sender can also end the message with a final block, in which
+	// case the tail isn't needed.
+	//
+	for (SIZE_T i = 0; i <= Message.PieceCount && !ended && result == WS_DEFLATE_OK; ++i)
+	{
+		if (i < Message.PieceCount)
+		{
+			stream->next_in = (Bytef*) Message.Pieces[i].Data;
+			stream->avail_in = (uInt) Message.Pieces[i].Length;
+		}
+		else
+		{
+			stream->next_in = (Bytef*) kDeflateTail;
+			stream->avail_in = sizeof(kDeflateTail);
+		}
+
+		while (stream->avail_in)
+		{
+			if (length == Output.size())
+			{
+				if (Output.size() >= room)
+				{
+					result = WS_DEFLATE_TOO_LARGE;
+					break;
+				}
+
+				SIZE_T size = Output.size() * 2;
+				Output.resize(size < room ? size : (SIZE_T) room);
+			}
+
+			stream->next_out = (Bytef*) &Output[length];
+			stream->avail_out = (uInt) (Output.size() - length);
+
+			INT inflateResult = inflate(stream, Z_SYNC_FLUSH);
+
+			length = Output.size() - stream->avail_out;
+
+			if (length > MaxMessageSize)
+			{
+				result = WS_DEFLATE_TOO_LARGE;
+				break;
+			}
+
+			if (inflateResult == Z_STREAM_END)
+			{
+				ended = true;
+				break;
+			}
+
+			// Z_BUF_ERROR just means it wants more room
+			if (inflateResult != Z_OK && inflateResult != Z_BUF_ERROR)
+			{
+				result = WS_DEFLATE_ERROR;
+				break;
+			}
+		}
+	}
+
+	//
+	// After a final block the next message starts a new stream, so
+	// it's reset even if we're keeping the context.
+	//
+	if (m_Params.ClientNoContextTakeover || result != WS_DEFLATE_OK)
+	{
+		m_pPool->ReleaseInflate(stream);
+		m_pInflate = nullptr;
+	}
+	else
+	{
+		if (ended)
+		{
+			inflateReset(stream);
+		}
+
+		m_pInflate = stream;
+	}
+
+	if (result != WS_DEFLATE_OK)
+	{
+		Output.clear();
+		return result;
+	}
+
+	Output.resize(length);
+
+	return WS_DEFLATE_OK;
+}
+
+}
+
+#endif
@@ -0,0 +1,320 @@
+#include "HTTPInternal.h"
+
+#include <string.h>
+
+namespace HTTP
+{
+
+/*
+	BUFFER POOL
+*/
+WebsocketBufferPool::WebsocketBufferPool(
+	SIZE_T BlockSize,
+	SIZE_T MaxFree)
+	: m_BlockSize(BlockSize ? BlockSize : 1)
+	, m_MaxFree(MaxFree)
+{
+}
+
+WebsocketBufferPool::~WebsocketBufferPool()
+{
+	for (auto block = std::begin(m_Free); block != std::end(m_Free); ++block)
+	{
+		delete [] *block;
+	}
+}
+
+LPBYTE WebsocketBufferPool::Acquire()
+{
+	if (m_Free.empty())
+	{
+		return new BYTE[m_BlockSize];
+	}
+
+	LPBYTE block = m_Free.back();
+	m_Free.pop_back();
+
+	return block;
+}
+
+void WebsocketBufferPool::Release(
+	LPBYTE pBlock)
+{
+	if (m_Free.size() < m_MaxFree)
+	{
+		m_Free.push_back(pBlock);
+	}
+	else
+	{
+		delete [] pBlock;
+	}
+}
+
+SIZE_T WebsocketBufferPool::BlockSize() const
+{
+	return m_BlockSize;
+}
+
+/*
+	MESSAGE ASSEMBLY
+
+	Frames come through the frame decoder. Control frames are small
+	(125 bytes at most), so they're always copied aside; that way 
+	one can be handed out without disturbing a message that's half
+	gathered.
+*/
+WebsocketMessageAssembler::WebsocketMessageAssembler(
+	WebsocketBufferPool* pPool)
+	: MaxMessageSize(16 * 1024 * 1024)
+	, RequireMasked(true)
+	, AllowCompressed(false)
+	, m_pPool(pPool)
+{
+	if (!m_pPool)
+	{
+		m_OwnPool.reset(new WebsocketBufferPool());
+		m_pPool = m_OwnPool.get();
+	}
+
+	Reset();
+}
+
+WebsocketMessageAssembler::~WebsocketMessageAssembler()
+{
+	ReleaseBlocks();
+}
+
+void WebsocketMessageAssembler::Reset()
+{
+	ReleaseBlocks();
+
+	m_Decoder.Reset();
+	m_Direct.Data = nullptr;
+	m_Direct.Length = 0;
+	m_ControlLength = 0;
+	m_InMessage = false;
+	m_MessageOpCode = WS_FRAME_OPCODE_CONTINUATION;
+	m_MessageCompressed = false;
+	m_MessageLength = 0;
+	m_Failed = false;
+	m_Error = WS_CLOSE_NORMAL;
+}
+
+WS_CLOSE_REASON WebsocketMessageAssembler::Error() const
+{
+	return m_Error;
+}
+
+void WebsocketMessageAssembler::Fail(
+	WS_CLOSE_REASON Reason)
+{
+	m_Failed = true;
+	m_Error = Reason;
+
+	ReleaseBlocks();
+}
+
+void WebsocketMessageAssembler::ReleaseBlocks()
+{
+	for (auto block = std::begin(m_Blocks); block != std::end(m_Blocks); ++block)
+	{
+		m_pPool->Release((LPBYTE) block->Data);
+	}
+
+	m_Blocks.clear();
+}
+
+void WebsocketMessageAssembler::Append(
+	StringView Data)
+{
+	SIZE_T blockSize = m_pPool->BlockSize();
+
+	while (Data.Length)
+	{
+		if (m_Blocks.empty() || m_Blocks.back().Length == blockSize)
+		{
+			StringView block = { (LPCSTR) m_pPool->Acquire(), 0 };
+			m_Blocks.push_back(block);
+		}
+
+		StringView& tail = m_Blocks.back();
+
+		SIZE_T space = blockSize - tail.Length;
+		SIZE_T length = Data.Length < space ? Data.Length : space;
+
+		memcpy((LPSTR) tail.Data + tail.Length, Data.Data, length);
+		tail.Length += length;
+
+		Data.Data += length;
+		Data.Length -= length;
+	}
+}
+
+WS_MESSAGE_RESULT WebsocketMessageAssembler::Feed(
+	LPVOID pData,
+	SIZE_T DataLength,
+	SIZE_T* pConsumedOut,
+	WS_MESSAGE* pMessageOut)
+{
+	LPBYTE pBytes = (LPBYTE) pData;
+	SIZE_T consumed = 0;
+
+	*pConsumedOut = 0;
+	ZeroMemory(pMessageOut, sizeof(*pMessageOut));
+
+	if (m_Failed)
+	{
+		return WS_MESSAGE_ERROR;
+	}
+
+	// Whatever was handed out last time is finished with
+	if (!m_InMessage)
+	{
+		ReleaseBlocks();
+	}
+
+	m_Direct.Data = nullptr;
+	m_Direct.Length = 0;
+
+	m_Decoder.MaxPayloadSize = MaxMessageSize;
+	m_Decoder.RequireMasked = RequireMasked;
+	m_Decoder.AllowRSV1 = AllowCompressed;
+
+	for (;;)
+	{
+		SIZE_T used;
+		StringView slice;
+
+		WS_DECODE_RESULT result = m_Decoder.Decode(
+			pBytes + consumed, 
+			DataLength - consumed, 
+			&used, 
+			&slice);
+
+		consumed += used;
+		*pConsumedOut = consumed;
+
+		const WS_FRAME_INFO& frame = m_Decoder.Frame();
+		bool control = IsControlOpCode(frame.OpCode);
+
+		switch (result)
+		{
+		case WS_DECODE_NEED_MORE:
+			return WS_MESSAGE_NEED_MORE;
+
+		case WS_DECODE_ERROR:
+			Fail(m_Decoder.Error());
+			return WS_MESSAGE_ERROR;
+
+		case WS_DECODE_HEADER:
+			if (control)
+			{
+				// Control frames are never compressed
+				if (frame.RSV1)
+				{
+					Fail(WS_CLOSE_PROTOCOL_ERROR);
+					return WS_MESSAGE_ERROR;
+				}
+
+				m_ControlLength = 0;
+				break;
+			}
+
+			//
+			// A message is a TEXT or BINARY frame, then any number
+			// of CONTINUATION frames, the last with FinalPacket set.
+			//
+			if (frame.OpCode == WS_FRAME_OPCODE_CONTINUATION)
+			{
+				// RSV1 marks the whole message, on its first frame
+				if (!m_InMessage || frame.RSV1)
+				{
+					Fail(WS_CLOSE_PROTOCOL_ERROR);
+					return WS_MESSAGE_ERROR;
+				}
+			}
+			else
+			{
+				if (m_InMessage)
+				{
+					Fail(WS_CLOSE_PROTOCOL_ERROR);
+					return WS_MESSAGE_ERROR;
+				}
+
+				m_InMessage = true;
+				m_MessageOpCode = frame.OpCode;
+				m_MessageCompressed = frame.RSV1;
+				m_MessageLength = 0;
+			}
+
+			// Caught here, before any of the payload's been kept
+			if (frame.PayloadLength > MaxMessageSize - m_MessageLength)
+			{
+				Fail(WS_CLOSE_MESSAGE_TOO_LARGE);
+				return WS_MESSAGE_ERROR;
+			}
+
+			m_MessageLength += frame.PayloadLength;
+			break;
+
+		case WS_DECODE_DATA:
+			if (control)
+			{
+				memcpy(m_Control + m_ControlLength, slice.Data, slice.Length);
+				m_ControlLength += slice.Length;
+			}
+			else if (frame.FinalPacket &&
+				frame.OpCode != WS_FRAME_OPCODE_CONTINUATION &&
+				slice.Length == frame.PayloadLength)
+			{
+				// The whole message is right here
+				m_Direct = slice;
+			}
+			else
+			{
+				Append(slice);
+			}
+			break;
+
+		case WS_DECODE_FRAME_END:
+			if (control)
+			{
+				m_Direct.Data = m_Control;
+				m_Direct.Length = m_ControlLength;
+
+				pMessageOut->OpCode = frame.OpCode;
+				pMessageOut->Pieces = &m_Direct;
+				pMessageOut->PieceCount = m_ControlLength ? 1 : 0;
+				pMessageOut->Length = m_ControlLength;
+
+				return WS_MESSAGE_CONTROL;
+			}
+
+			if (!frame.FinalPacket)
+			{
+				break;
+			}
+
+			m_InMessage = false;
+
+			pMessageOut->OpCode = m_MessageOpCode;
+			pMessageOut->Length = m_MessageLength;
+			pMessageOut->Compressed = m_MessageCompressed;
+
+			if (m_Direct.Data)
+			{
+				pMessageOut->Pieces = &m_Direct;
+				pMessageOut->PieceCount = 1;
+			}
+			else if (!m_Blocks.empty())
+			{
+				pMessageOut->Pieces = &m_Blocks[0];
+				pMessageOut->PieceCount = m_Blocks.size();
+			}
+
+			return WS_MESSAGE_COMPLETE;
+		}
+	}
+}
+
+}